@@ -0,0 +1,103 @@
+/* ----------------------------------------------------------------------
+   LAMMPS - Large-scale Atomic/Molecular Massively Parallel Simulator
+   https://www.lammps.org/, Sandia National Laboratories
+   Steve Plimpton, sjplimp@sandia.gov
+
+   Copyright (2003) Sandia Corporation.  Under the terms of Contract
+   DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government retains
+   certain rights in this software.  This software is distributed under
+   the GNU General Public License.
+
+   See the README file in the top-level LAMMPS directory.
+------------------------------------------------------------------------- */
+
+/* ----------------------------------------------------------------------
+   compute ID group-ID phin/atom name
+
+   A per-atom output of pair_style phin: "uncertainties" or any output
+   the model declares in its per_atom_outputs metadata. For group all
+   the pair style's own storage is used directly; other groups get a
+   copy with zeros outside the group.
+------------------------------------------------------------------------- */
+
+#include "compute_phin_atom.h"
+#include "pair_phin.h"
+
+#include "atom.h"
+#include "error.h"
+#include "force.h"
+#include "memory.h"
+#include "update.h"
+
+using namespace LAMMPS_NS;
+
+ComputePHINAtom::ComputePHINAtom(LAMMPS *lmp, int narg, char **arg) :
+  Compute(lmp, narg, arg), nmax(0), vector_copy(nullptr), array_copy(nullptr)
+{
+  if (narg != 4) error->all(FLERR, "Illegal compute phin/atom command");
+  name = arg[3];
+
+  pair = dynamic_cast<PairPHIN *>(force->pair_match("phin", 1));
+  if (!pair) error->all(FLERR, "Compute phin/atom requires pair_style phin");
+
+  int ncol = -1;
+  pair->extract_peratom(name.c_str(), ncol);
+  if (ncol < 0)
+    error->all(FLERR, "Compute phin/atom: the PHIN model has no per-atom output {}", name);
+
+  peratom_flag = 1;
+  size_peratom_cols = ncol;
+}
+
+ComputePHINAtom::~ComputePHINAtom()
+{
+  memory->destroy(vector_copy);
+  memory->destroy(array_copy);
+}
+
+void ComputePHINAtom::init()
+{
+  if (force->pair_match("phin", 1) != pair)
+    error->all(FLERR, "Compute phin/atom requires the pair_style phin it was defined with");
+}
+
+void ComputePHINAtom::compute_peratom()
+{
+  // the pair style fills its outputs on every force evaluation
+  invoked_peratom = update->ntimestep;
+
+  int ncol;
+  void *data = pair->extract_peratom(name.c_str(), ncol);
+  if (!data) error->all(FLERR, "Compute phin/atom {} was invoked before the pair style ran", name);
+
+  if (igroup == 0) {
+    if (ncol == 0) vector_atom = static_cast<double *>(data);
+    else array_atom = static_cast<double **>(data);
+    return;
+  }
+
+  if (atom->nmax > nmax) {
+    memory->destroy(vector_copy);
+    memory->destroy(array_copy);
+    nmax = atom->nmax;
+    if (ncol == 0) memory->create(vector_copy, nmax, "phin/atom:vector");
+    else memory->create(array_copy, nmax, ncol, "phin/atom:array");
+  }
+  int *mask = atom->mask;
+  const int nlocal = atom->nlocal;
+  if (ncol == 0) {
+    const double *src = static_cast<double *>(data);
+    for (int i = 0; i < nlocal; i++) vector_copy[i] = (mask[i] & groupbit) ? src[i] : 0.0;
+    vector_atom = vector_copy;
+  } else {
+    double **src = static_cast<double **>(data);
+    for (int i = 0; i < nlocal; i++)
+      for (int k = 0; k < ncol; k++) array_copy[i][k] = (mask[i] & groupbit) ? src[i][k] : 0.0;
+    array_atom = array_copy;
+  }
+}
+
+double ComputePHINAtom::memory_usage()
+{
+  return (double) nmax * (size_peratom_cols ? size_peratom_cols : 1) * sizeof(double);
+}
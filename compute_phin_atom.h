@@ -0,0 +1,48 @@
+/* -*- c++ -*- ----------------------------------------------------------
+   LAMMPS - Large-scale Atomic/Molecular Massively Parallel Simulator
+   https://www.lammps.org/, Sandia National Laboratories
+   Steve Plimpton, sjplimp@sandia.gov
+
+   Copyright (2003) Sandia Corporation.  Under the terms of Contract
+   DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government retains
+   certain rights in this software.  This software is distributed under
+   the GNU General Public License.
+
+   See the README file in the top-level LAMMPS directory.
+------------------------------------------------------------------------- */
+
+#ifdef COMPUTE_CLASS
+
+ComputeStyle(phin/atom,ComputePHINAtom)
+
+#else
+
+#ifndef LMP_COMPUTE_PHIN_ATOM_H
+#define LMP_COMPUTE_PHIN_ATOM_H
+
+#include "compute.h"
+
+#include <string>
+
+namespace LAMMPS_NS {
+
+class ComputePHINAtom : public Compute {
+ public:
+  ComputePHINAtom(class LAMMPS *, int, char **);
+  ~ComputePHINAtom() override;
+  void init() override;
+  void compute_peratom() override;
+  double memory_usage() override;
+
+ protected:
+  class PairPHIN *pair;
+  std::string name;
+  int nmax;
+  double *vector_copy;
+  double **array_copy;
+};
+
+}
+
+#endif
+#endif
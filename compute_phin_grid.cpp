@@ -0,0 +1,117 @@
+/* ----------------------------------------------------------------------
+   LAMMPS - Large-scale Atomic/Molecular Massively Parallel Simulator
+   https://www.lammps.org/, Sandia National Laboratories
+   Steve Plimpton, sjplimp@sandia.gov
+
+   Copyright (2003) Sandia Corporation.  Under the terms of Contract
+   DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government retains
+   certain rights in this software.  This software is distributed under
+   the GNU General Public License.
+
+   See the README file in the top-level LAMMPS directory.
+------------------------------------------------------------------------- */
+
+/* ----------------------------------------------------------------------
+   compute ID group-ID phin/grid nx ny nz
+
+   Map of the pair_style phin uncertainties on an nx x ny x nz grid of
+   the (possibly triclinic) box. The pair style adds every atom of the
+   group to its bin as it writes the uncertainties; invoking the compute
+   reduces over ranks once and starts the next interval. One row per bin,
+   in the layout of fix ave/chunk with compute chunk/atom bin/3d:
+     x y z (bin center)  count (atoms per step)  mean  max
+   over all steps since the previous invocation. Use it with e.g.
+     fix ave/time 1 1 N c_ID[*] mode vector file grid.dat
+------------------------------------------------------------------------- */
+
+#include "compute_phin_grid.h"
+
+#include "domain.h"
+#include "error.h"
+#include "force.h"
+#include "memory.h"
+#include "update.h"
+
+#include <algorithm>
+
+using namespace LAMMPS_NS;
+
+ComputePHINGrid::ComputePHINGrid(LAMMPS *lmp, int narg, char **arg) :
+  Compute(lmp, narg, arg), result(nullptr)
+{
+  if (narg != 6) error->all(FLERR, "Illegal compute phin/grid command");
+  for (int k = 0; k < 3; k++) {
+    grid.nbin[k] = utils::inumeric(FLERR, arg[3+k], false, lmp);
+    if (grid.nbin[k] < 1) error->all(FLERR, "Illegal compute phin/grid command");
+  }
+  grid.groupbit = groupbit;
+  nbins = grid.nbin[0] * grid.nbin[1] * grid.nbin[2];
+  grid.count.assign(nbins, 0.0);
+  grid.sum.assign(nbins, 0.0);
+  grid.max.assign(nbins, 0.0);
+
+  pair = dynamic_cast<PairPHIN *>(force->pair_match("phin", 1));
+  if (!pair) error->all(FLERR, "Compute phin/grid requires pair_style phin");
+  if (pair->ugrid) error->all(FLERR, "Only one compute phin/grid may be defined");
+  pair->ugrid = &grid;
+
+  array_flag = 1;
+  size_array_rows = nbins;
+  size_array_cols = 6;
+  extarray = 0;
+  memory->create(result, nbins, 6, "phin/grid:result");
+  array = result;
+}
+
+ComputePHINGrid::~ComputePHINGrid()
+{
+  // pair may be gone if the pair style was redefined; a hybrid sub-style
+  // is only found through pair_match()
+  if (force->pair_match("phin", 1) == pair && pair->ugrid == &grid) pair->ugrid = nullptr;
+  memory->destroy(result);
+}
+
+void ComputePHINGrid::init()
+{
+  if (force->pair_match("phin", 1) != pair)
+    error->all(FLERR, "Compute phin/grid requires the pair_style phin it was defined with");
+}
+
+void ComputePHINGrid::compute_array()
+{
+  if (invoked_array == update->ntimestep) return;
+  invoked_array = update->ntimestep;
+
+  // one reduction per interval: counts and sums, then maxima
+  std::vector<double> total(2*nbins), max(nbins);
+  std::copy(grid.count.begin(), grid.count.end(), total.begin());
+  std::copy(grid.sum.begin(), grid.sum.end(), total.begin() + nbins);
+  MPI_Allreduce(MPI_IN_PLACE, total.data(), 2*nbins, MPI_DOUBLE, MPI_SUM, world);
+  MPI_Allreduce(grid.max.data(), max.data(), nbins, MPI_DOUBLE, MPI_MAX, world);
+
+  const int nsteps = std::max(grid.nsteps, 1);
+  const double *lo = domain->boxlo, *h = domain->h;
+  for (int bin = 0; bin < nbins; bin++) {
+    const int b[3] = {bin % grid.nbin[0], (bin / grid.nbin[0]) % grid.nbin[1],
+                      bin / (grid.nbin[0] * grid.nbin[1])};
+    double s[3];
+    for (int k = 0; k < 3; k++) s[k] = (b[k] + 0.5) / grid.nbin[k];
+    result[bin][0] = lo[0] + h[0]*s[0] + h[5]*s[1] + h[4]*s[2];
+    result[bin][1] = lo[1] + h[1]*s[1] + h[3]*s[2];
+    result[bin][2] = lo[2] + h[2]*s[2];
+    const double count = total[bin];
+    result[bin][3] = count / nsteps;
+    result[bin][4] = count > 0.0 ? total[nbins + bin] / count : 0.0;
+    result[bin][5] = max[bin];
+  }
+
+  std::fill(grid.count.begin(), grid.count.end(), 0.0);
+  std::fill(grid.sum.begin(), grid.sum.end(), 0.0);
+  std::fill(grid.max.begin(), grid.max.end(), 0.0);
+  grid.nsteps = 0;
+}
+
+double ComputePHINGrid::memory_usage()
+{
+  return (double) nbins * 9 * sizeof(double);
+}
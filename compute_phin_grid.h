@@ -0,0 +1,46 @@
+/* -*- c++ -*- ----------------------------------------------------------
+   LAMMPS - Large-scale Atomic/Molecular Massively Parallel Simulator
+   https://www.lammps.org/, Sandia National Laboratories
+   Steve Plimpton, sjplimp@sandia.gov
+
+   Copyright (2003) Sandia Corporation.  Under the terms of Contract
+   DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government retains
+   certain rights in this software.  This software is distributed under
+   the GNU General Public License.
+
+   See the README file in the top-level LAMMPS directory.
+------------------------------------------------------------------------- */
+
+#ifdef COMPUTE_CLASS
+
+ComputeStyle(phin/grid,ComputePHINGrid)
+
+#else
+
+#ifndef LMP_COMPUTE_PHIN_GRID_H
+#define LMP_COMPUTE_PHIN_GRID_H
+
+#include "compute.h"
+#include "pair_phin.h"
+
+namespace LAMMPS_NS {
+
+class ComputePHINGrid : public Compute {
+ public:
+  ComputePHINGrid(class LAMMPS *, int, char **);
+  ~ComputePHINGrid() override;
+  void init() override;
+  void compute_array() override;
+  double memory_usage() override;
+
+ protected:
+  PairPHIN *pair;
+  PairPHIN::UncertaintyGrid grid;
+  int nbins;
+  double **result;
+};
+
+}
+
+#endif
+#endif
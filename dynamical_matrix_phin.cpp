@@ -0,0 +1,231 @@
+/* ----------------------------------------------------------------------
+   LAMMPS - Large-scale Atomic/Molecular Massively Parallel Simulator
+   https://www.lammps.org/, Sandia National Laboratories
+   Steve Plimpton, sjplimp@sandia.gov
+
+   Copyright (2003) Sandia Corporation.  Under the terms of Contract
+   DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government retains
+   certain rights in this software.  This software is distributed under
+   the GNU General Public License.
+
+   See the README file in the top-level LAMMPS directory.
+------------------------------------------------------------------------- */
+
+/* ----------------------------------------------------------------------
+   dynamical_matrix/phin: the dynamical matrix (or Hessian) of a group
+   from second derivatives of pair_style phin, instead of the 6N finite
+   difference force calls of dynamical_matrix.
+
+   dynamical_matrix/phin group-ID [file name] [hessian yes/no] [block N]
+                         [method analytic/fd] [delta d] [batch K]
+
+   method analytic (default) uses double backward through the model;
+   method fd uses central differences of the forces, with the displaced
+   configurations evaluated K at a time in one batched model call.
+
+   The output has the layout and units of dynamical_matrix: for every
+   atom i and direction a (by atom ID), one line of three values per
+   atom j, i.e. D(ia, jx) D(ia, jy) D(ia, jz), in 10 J/mol/A^2/(g/mol)
+   (energy / distance^2 / mass times the factor of convert_units(); in
+   metal units 9648.5, i.e. sqrt(D) is in 10^13 rad/s). As there, the
+   hessian yes output is scaled by the same factor.
+------------------------------------------------------------------------- */
+
+#include "dynamical_matrix_phin.h"
+#include "pair_phin.h"
+
+#include "atom.h"
+#include "comm.h"
+#include "domain.h"
+#include "error.h"
+#include "force.h"
+#include "group.h"
+#include "lammps.h"
+#include "neighbor.h"
+#include "update.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+using namespace LAMMPS_NS;
+
+void DynamicalMatrixPHIN::command(int narg, char **arg)
+{
+  if (narg < 1) error->all(FLERR, "Illegal dynamical_matrix/phin command");
+  if (domain->box_exist == 0)
+    error->all(FLERR, "dynamical_matrix/phin command before simulation box is defined");
+  if (comm->nprocs != 1)
+    error->all(FLERR, "dynamical_matrix/phin requires a single MPI rank");
+
+  const int igroup = group->find(arg[0]);
+  if (igroup < 0) error->all(FLERR, "Could not find dynamical_matrix/phin group ID {}", arg[0]);
+  const int groupbit = group->bitmask[igroup];
+
+  std::string filename = "dynmat.dat";
+  int hessian = 0;
+  int block = 32;
+  int fd = 0;
+  double delta = 1.0e-3;
+  int batch = 64;
+  int iarg = 1;
+  while (iarg < narg) {
+    if (iarg+2 > narg) error->all(FLERR, "Illegal dynamical_matrix/phin command");
+    if (strcmp(arg[iarg], "file") == 0) filename = arg[iarg+1];
+    else if (strcmp(arg[iarg], "hessian") == 0) hessian = utils::logical(FLERR, arg[iarg+1], false, lmp);
+    else if (strcmp(arg[iarg], "block") == 0) {
+      block = utils::inumeric(FLERR, arg[iarg+1], false, lmp);
+      if (block < 1) error->all(FLERR, "Illegal dynamical_matrix/phin command");
+    } else if (strcmp(arg[iarg], "method") == 0) {
+      if (strcmp(arg[iarg+1], "analytic") == 0) fd = 0;
+      else if (strcmp(arg[iarg+1], "fd") == 0) fd = 1;
+      else error->all(FLERR, "Illegal dynamical_matrix/phin command");
+    } else if (strcmp(arg[iarg], "delta") == 0) {
+      delta = utils::numeric(FLERR, arg[iarg+1], false, lmp);
+      if (delta <= 0.0) error->all(FLERR, "Illegal dynamical_matrix/phin command");
+    } else if (strcmp(arg[iarg], "batch") == 0) {
+      batch = utils::inumeric(FLERR, arg[iarg+1], false, lmp);
+      if (batch < 1) error->all(FLERR, "Illegal dynamical_matrix/phin command");
+    } else error->all(FLERR, "Illegal dynamical_matrix/phin command");
+    iarg += 2;
+  }
+
+  auto pair = dynamic_cast<PairPHIN *>(force->pair_match("phin", 1));
+  if (!pair) error->all(FLERR, "dynamical_matrix/phin requires pair_style phin");
+
+  lmp->init();
+  update->setupflag = 1;
+  setup();
+  update->setupflag = 0;
+
+  const double t_start = MPI_Wtime();
+  if (!fd) pair->hessian_setup();
+
+  // graph node of every group atom, in atom ID order
+  const int nlocal = atom->nlocal;
+  std::vector<int> i2node(nlocal, -1);
+  for (size_t n = 0; n < pair->hessian_node2i.size(); n++) i2node[pair->hessian_node2i[n]] = n;
+  std::vector<int> atoms;
+  for (int i = 0; i < nlocal; i++)
+    if (atom->mask[i] & groupbit) atoms.push_back(i);
+  std::sort(atoms.begin(), atoms.end(), [this](int a, int b) { return atom->tag[a] < atom->tag[b]; });
+
+  auto mass = [this](int i) { return atom->rmass ? atom->rmass[i] : atom->mass[atom->type[i]]; };
+  const double conversion = convert_units(update->unit_style);
+
+  FILE *fp = fopen(filename.c_str(), "w");
+  if (!fp) error->one(FLERR, "Cannot open dynamical_matrix/phin file {}: {}", filename, utils::getsyserror());
+
+  // one block of atoms at a time: 3*block backward passes, 3*block columns of memory
+  std::vector<int> cols;
+  std::vector<double> hcols;
+  const int nnode3 = 3 * pair->hessian_node2i.size();
+  for (size_t first = 0; first < atoms.size(); first += block) {
+    const size_t last = std::min(atoms.size(), first + block);
+    cols.clear();
+    for (size_t a = first; a < last; a++)
+      for (int alpha = 0; alpha < 3; alpha++) cols.push_back(3*i2node[atoms[a]] + alpha);
+    if (fd) fd_columns(pair, cols, delta, batch, hcols);
+    else pair->hessian_columns(cols, hcols);
+
+    // the Hessian is symmetric, so column (i, alpha) is row (i, alpha)
+    for (size_t a = first; a < last; a++) {
+      const int i = atoms[a];
+      for (int alpha = 0; alpha < 3; alpha++) {
+        const double *h = &hcols[(3*(a - first) + alpha) * nnode3];
+        for (int j : atoms) {
+          const double scale = conversion * (hessian ? 1.0 : 1.0 / sqrt(mass(i) * mass(j)));
+          const int nj = i2node[j];
+          fprintf(fp, "%.8g %.8g %.8g\n", h[3*nj] * scale, h[3*nj+1] * scale, h[3*nj+2] * scale);
+        }
+      }
+    }
+  }
+  fclose(fp);
+
+  if (comm->me == 0)
+    utils::logmesg(lmp, "dynamical_matrix/phin: {} of {} atoms written to {} in {:.3f} s\n",
+                   hessian ? "Hessian" : "dynamical matrix", atoms.size(), filename,
+                   MPI_Wtime() - t_start);
+}
+
+/* ----------------------------------------------------------------------
+   factor to 10 J/mol/A^2/(g/mol), as DynamicalMatrix::convert_units()
+   (thermochemical calorie, 4.184 J)
+------------------------------------------------------------------------- */
+
+double DynamicalMatrixPHIN::convert_units(const char *style)
+{
+  if (strcmp(style, "lj") == 0) return 1.0;
+  if (strcmp(style, "real") == 0) return 418.4;     // kcal/mol/A^2/(g/mol)
+  if (strcmp(style, "metal") == 0) return 9648.5;   // eV/A^2/(g/mol)
+  if (strcmp(style, "si") == 0 || strcmp(style, "cgs") == 0) {
+    if (comm->me == 0) error->warning(FLERR, "dynamical_matrix/phin: multiplication by a large float");
+    return strcmp(style, "si") == 0 ? 6.022e+22 : 6.022e+12;
+  }
+  if (strcmp(style, "electron") == 0 || strcmp(style, "micro") == 0 || strcmp(style, "nano") == 0)
+    return 1.0;
+  error->all(FLERR, "dynamical_matrix/phin: no unit conversion for units {}", style);
+  return 1.0;
+}
+
+/* ----------------------------------------------------------------------
+   Hessian columns 3*node + alpha by central differences of the forces,
+   -(f(x + d e) - f(x - d e)) / 2d, batch displaced configurations per
+   model call on the graph of the reference configuration
+------------------------------------------------------------------------- */
+
+void DynamicalMatrixPHIN::fd_columns(PairPHIN *pair, const std::vector<int> &cols, double delta,
+                                     int batch, std::vector<double> &out)
+{
+  double **x = atom->x;
+  const std::vector<int> &node2i = pair->hessian_node2i;
+  const int n3 = 3 * node2i.size();
+  std::vector<double> x0(n3);
+  for (size_t n = 0; n < node2i.size(); n++)
+    for (int k = 0; k < 3; k++) x0[3*n+k] = x[node2i[n]][k];
+
+  // configuration 2c displaces column c by +delta, 2c+1 by -delta
+  const int nconf = 2 * cols.size();
+  out.assign(cols.size() * n3, 0.0);
+  std::vector<double> pos, energies, forces;
+  for (int first = 0; first < nconf; first += batch) {
+    const int nb = std::min(batch, nconf - first);
+    pos.resize((size_t) nb * n3);
+    for (int b = 0; b < nb; b++) {
+      const int conf = first + b;
+      std::copy(x0.begin(), x0.end(), &pos[(size_t) b * n3]);
+      pos[(size_t) b * n3 + cols[conf / 2]] += conf % 2 ? -delta : delta;
+    }
+    pair->evaluate_batch(nb, pos.data(), energies, forces);
+    for (int b = 0; b < nb; b++) {
+      const int conf = first + b;
+      const double sign = conf % 2 ? 1.0 : -1.0;
+      double *h = &out[(size_t) (conf / 2) * n3];
+      for (int k = 0; k < n3; k++) h[k] += sign * forces[(size_t) b * n3 + k] / (2.0 * delta);
+    }
+  }
+}
+
+/* ----------------------------------------------------------------------
+   neighbor lists and forces at the current configuration, as for run 0
+------------------------------------------------------------------------- */
+
+void DynamicalMatrixPHIN::setup()
+{
+  const int triclinic = domain->triclinic;
+  if (triclinic) domain->x2lamda(atom->nlocal);
+  domain->pbc();
+  domain->reset_box();
+  comm->setup();
+  if (neighbor->style) neighbor->setup_bins();
+  comm->exchange();
+  comm->borders();
+  if (triclinic) domain->lamda2x(atom->nlocal + atom->nghost);
+  domain->image_check();
+  domain->box_too_small_check();
+  neighbor->build(1);
+
+  force->pair->compute(1, 0);
+}
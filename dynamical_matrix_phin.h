@@ -0,0 +1,45 @@
+/* -*- c++ -*- ----------------------------------------------------------
+   LAMMPS - Large-scale Atomic/Molecular Massively Parallel Simulator
+   https://www.lammps.org/, Sandia National Laboratories
+   Steve Plimpton, sjplimp@sandia.gov
+
+   Copyright (2003) Sandia Corporation.  Under the terms of Contract
+   DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government retains
+   certain rights in this software.  This software is distributed under
+   the GNU General Public License.
+
+   See the README file in the top-level LAMMPS directory.
+------------------------------------------------------------------------- */
+
+#ifdef COMMAND_CLASS
+
+CommandStyle(dynamical_matrix/phin,DynamicalMatrixPHIN)
+
+#else
+
+#ifndef LMP_DYNAMICAL_MATRIX_PHIN_H
+#define LMP_DYNAMICAL_MATRIX_PHIN_H
+
+#include "command.h"
+
+#include <string>
+#include <vector>
+
+namespace LAMMPS_NS {
+
+class DynamicalMatrixPHIN : public Command {
+ public:
+  DynamicalMatrixPHIN(class LAMMPS *lmp) : Command(lmp) {}
+  void command(int, char **) override;
+
+ protected:
+  void setup();
+  double convert_units(const char *style);
+  void fd_columns(class PairPHIN *pair, const std::vector<int> &cols, double delta, int batch,
+                  std::vector<double> &out);
+};
+
+}
+
+#endif
+#endif
@@ -0,0 +1,185 @@
+/* ----------------------------------------------------------------------
+   LAMMPS - Large-scale Atomic/Molecular Massively Parallel Simulator
+   https://www.lammps.org/, Sandia National Laboratories
+   Steve Plimpton, sjplimp@sandia.gov
+
+   Copyright (2003) Sandia Corporation.  Under the terms of Contract
+   DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government retains
+   certain rights in this software.  This software is distributed under
+   the GNU General Public License.
+
+   See the README file in the top-level LAMMPS directory.
+------------------------------------------------------------------------- */
+
+/* ----------------------------------------------------------------------
+   fix ID group-ID phin/dt N dtmin dtmax xmax [uncertainty u] [grow g]
+
+   Every N steps, the timestep is set so that no atom of the group moves
+   more than xmax (as fix dt/reset, from v, f and m), then scaled by
+   min(1, u / umax) with umax the largest PHIN uncertainty of the group,
+   limited to grow times the previous timestep and clamped to
+   [dtmin, dtmax]. Forces and uncertainties are those the pair style
+   already computed; one reduction per update.
+
+   scalar: current dt; vector: dt, average dt / initial dt, max force,
+   max uncertainty
+------------------------------------------------------------------------- */
+
+#include "fix_phin_dt.h"
+#include "pair_phin.h"
+
+#include "atom.h"
+#include "comm.h"
+#include "error.h"
+#include "force.h"
+#include "integrate.h"
+#include "modify.h"
+#include "output.h"
+#include "update.h"
+
+#include <cmath>
+#include <cstring>
+
+using namespace LAMMPS_NS;
+using namespace FixConst;
+
+FixPHINDt::FixPHINDt(LAMMPS *lmp, int narg, char **arg) :
+  Fix(lmp, narg, arg), pair(nullptr), utarget(0.0), grow(1.05), dt_sum(0.0), nsteps(0),
+  umax_last(0.0), fmax_last(0.0)
+{
+  if (narg < 7) error->all(FLERR, "Illegal fix phin/dt command");
+
+  nevery = utils::inumeric(FLERR, arg[3], false, lmp);
+  dtmin = utils::numeric(FLERR, arg[4], false, lmp);
+  dtmax = utils::numeric(FLERR, arg[5], false, lmp);
+  xmax = utils::numeric(FLERR, arg[6], false, lmp);
+  if (nevery <= 0 || dtmin <= 0.0 || dtmax < dtmin || xmax <= 0.0)
+    error->all(FLERR, "Illegal fix phin/dt command");
+
+  int iarg = 7;
+  while (iarg < narg) {
+    if (iarg+2 > narg) error->all(FLERR, "Illegal fix phin/dt command");
+    if (strcmp(arg[iarg], "uncertainty") == 0) {
+      utarget = utils::numeric(FLERR, arg[iarg+1], false, lmp);
+      if (utarget <= 0.0) error->all(FLERR, "Illegal fix phin/dt command");
+    } else if (strcmp(arg[iarg], "grow") == 0) {
+      grow = utils::numeric(FLERR, arg[iarg+1], false, lmp);
+      if (grow < 1.0) error->all(FLERR, "Illegal fix phin/dt command");
+    } else error->all(FLERR, "Illegal fix phin/dt command");
+    iarg += 2;
+  }
+
+  scalar_flag = 1;
+  vector_flag = 1;
+  size_vector = 4;
+  global_freq = 1;
+  extscalar = 0;
+  extvector = 0;
+  dynamic_group_allow = 1;
+  time_depend = 1;
+
+  dt_ref = update->dt;
+}
+
+int FixPHINDt::setmask()
+{
+  int mask = 0;
+  mask |= END_OF_STEP;
+  return mask;
+}
+
+void FixPHINDt::init()
+{
+  pair = dynamic_cast<PairPHIN *>(force->pair_match("phin", 1));
+  if (!pair) error->all(FLERR, "Fix phin/dt requires pair_style phin");
+
+  respaflag = utils::strmatch(update->integrate_style, "^respa") ? 1 : 0;
+  if (respaflag) error->all(FLERR, "Fix phin/dt does not support run_style respa");
+  dt_sum = 0.0;
+  nsteps = 0;
+}
+
+void FixPHINDt::setup(int /*vflag*/)
+{
+  adjust();
+}
+
+void FixPHINDt::end_of_step()
+{
+  // the current dt was used for the last nevery steps
+  dt_sum += nevery * update->dt;
+  nsteps += nevery;
+  adjust();
+}
+
+void FixPHINDt::adjust()
+{
+  double **v = atom->v;
+  double **f = atom->f;
+  double *mass = atom->mass;
+  double *rmass = atom->rmass;
+  int *type = atom->type;
+  int *mask = atom->mask;
+  const int nlocal = atom->nlocal;
+  const double *u = pair->uncertainties;
+
+  // smallest local dt from the displacement limit, as 1/dt for a max reduction
+  double local[3] = {0.0, 0.0, 0.0};    // 1/dt, max |f|, max uncertainty
+  for (int i = 0; i < nlocal; i++) {
+    if (!(mask[i] & groupbit)) continue;
+    const double massone = rmass ? rmass[i] : mass[type[i]];
+    const double vsq = v[i][0]*v[i][0] + v[i][1]*v[i][1] + v[i][2]*v[i][2];
+    const double fsq = f[i][0]*f[i][0] + f[i][1]*f[i][1] + f[i][2]*f[i][2];
+    double dtv = dtmax, dtf = dtmax;
+    if (vsq > 0.0) dtv = xmax / sqrt(vsq);
+    if (fsq > 0.0) dtf = sqrt(2.0 * xmax / (force->ftm2v * sqrt(fsq) / massone));
+    double dt = std::min(dtv, dtf);
+    // displacement v dt + 1/2 f/m dt^2 must stay below xmax
+    const double dtsq = dt*dt;
+    const double delr = sqrt(dtsq*vsq) + 0.5 * dtsq * force->ftm2v * sqrt(fsq) / massone;
+    if (delr > xmax) dt *= xmax / delr;
+    local[0] = std::max(local[0], 1.0 / dt);
+    local[1] = std::max(local[1], fsq);
+    if (u) local[2] = std::max(local[2], u[i]);
+  }
+  double global[3];
+  MPI_Allreduce(local, global, 3, MPI_DOUBLE, MPI_MAX, world);
+  fmax_last = sqrt(global[1]);
+  umax_last = global[2];
+
+  double dt = global[0] > 0.0 ? 1.0 / global[0] : dtmax;
+  if (utarget > 0.0 && umax_last > utarget) dt *= utarget / umax_last;
+  if (update->ntimestep > update->beginstep)
+    dt = std::min(dt, grow * update->dt);    // grow gently, shrink at once
+  dt = std::min(std::max(dt, dtmin), dtmax);
+  if (dt == update->dt) return;
+
+  // as fix dt/reset: keep the elapsed time, then switch every dt consumer
+  update->update_time();
+  update->dt = dt;
+  update->dt_default = 0;
+  if (force->pair) force->pair->reset_dt();
+  for (auto &ifix : modify->get_fix_list()) ifix->reset_dt();
+  output->reset_dt();
+}
+
+void FixPHINDt::post_run()
+{
+  if (comm->me == 0 && nsteps > 0)
+    utils::logmesg(lmp, "Fix phin/dt: average timestep {:.6g} ({:.3f} x initial {:.6g}), "
+                   "final max force {:.6g}, max uncertainty {:.6g}\n",
+                   dt_sum / nsteps, dt_sum / nsteps / dt_ref, dt_ref, fmax_last, umax_last);
+}
+
+double FixPHINDt::compute_scalar()
+{
+  return update->dt;
+}
+
+double FixPHINDt::compute_vector(int n)
+{
+  if (n == 0) return update->dt;
+  if (n == 1) return nsteps > 0 ? dt_sum / nsteps / dt_ref : 1.0;
+  if (n == 2) return fmax_last;
+  return umax_last;
+}
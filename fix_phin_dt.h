@@ -0,0 +1,53 @@
+/* -*- c++ -*- ----------------------------------------------------------
+   LAMMPS - Large-scale Atomic/Molecular Massively Parallel Simulator
+   https://www.lammps.org/, Sandia National Laboratories
+   Steve Plimpton, sjplimp@sandia.gov
+
+   Copyright (2003) Sandia Corporation.  Under the terms of Contract
+   DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government retains
+   certain rights in this software.  This software is distributed under
+   the GNU General Public License.
+
+   See the README file in the top-level LAMMPS directory.
+------------------------------------------------------------------------- */
+
+#ifdef FIX_CLASS
+
+FixStyle(phin/dt,FixPHINDt)
+
+#else
+
+#ifndef LMP_FIX_PHIN_DT_H
+#define LMP_FIX_PHIN_DT_H
+
+#include "fix.h"
+
+namespace LAMMPS_NS {
+
+class FixPHINDt : public Fix {
+ public:
+  FixPHINDt(class LAMMPS *, int, char **);
+  int setmask() override;
+  void init() override;
+  void setup(int) override;
+  void end_of_step() override;
+  void post_run() override;
+  double compute_scalar() override;
+  double compute_vector(int) override;
+
+ protected:
+  class PairPHIN *pair;
+  double dtmin, dtmax, xmax;
+  double utarget, grow;
+  double dt_ref;                 // timestep when the fix was defined
+  double dt_sum;                 // sum of dt over the steps taken
+  bigint nsteps;
+  double umax_last, fmax_last;
+  int respaflag;
+  void adjust();
+};
+
+}
+
+#endif
+#endif
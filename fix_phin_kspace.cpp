@@ -0,0 +1,253 @@
+/* ----------------------------------------------------------------------
+   LAMMPS - Large-scale Atomic/Molecular Massively Parallel Simulator
+   https://www.lammps.org/, Sandia National Laboratories
+   Steve Plimpton, sjplimp@sandia.gov
+
+   Copyright (2003) Sandia Corporation.  Under the terms of Contract
+   DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government retains
+   certain rights in this software.  This software is distributed under
+   the GNU General Public License.
+
+   See the README file in the top-level LAMMPS directory.
+------------------------------------------------------------------------- */
+
+/* ----------------------------------------------------------------------
+   fix ID all phin/kspace [qmin value]
+
+   Completes the forces of pair_style phin kspace_charges: the Coulomb
+   energy (kspace plus the real-space coul/long part) depends on the
+   positions also through the predicted charges, which adds
+     -sum_i phi_i dq_i/dx_j,   phi_i = dE_coul/dq_i
+   to every atom j. The real-space potential is summed directly over a
+   full neighbor list (so no ghost contributions are lost with newton
+   on), phi_i = qqrd2e sum_j q_j (erfc(g r_ij) - (1 - special)) / r_ij.
+   The kspace energy is quadratic in the charges, and its per-atom
+   energies (self and neutralizing terms included) are q_i phi_i / 2, so
+   the kspace part of phi_i is 2 e_i / q_i from the per-atom energies of
+   the same step, which an internal compute pe/atom makes LAMMPS tally.
+   If any charge is below qmin, phi comes instead from two more kspace
+   solves with all charges shifted by +c and -c:
+     phi_i = (e+_i - e-_i) / c - q_i (e+_i + e-_i - 2 e_i) / c^2
+   which is exact for any charges. The term itself is one backward pass
+   through the model's charges, which also gives its virial (fix_modify
+   virial, on by default).
+------------------------------------------------------------------------- */
+
+#include "fix_phin_kspace.h"
+#include "pair_phin.h"
+
+#include "atom.h"
+#include "comm.h"
+#include "compute.h"
+#include "error.h"
+#include "force.h"
+#include "kspace.h"
+#include "memory.h"
+#include "modify.h"
+#include "neigh_list.h"
+#include "neigh_request.h"
+#include "neighbor.h"
+#include "pair_hybrid.h"
+#include "update.h"
+
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+using namespace LAMMPS_NS;
+using namespace FixConst;
+
+// eflag of KSpace::compute() for per-atom energies only (ENERGY_ATOM)
+static constexpr int EFLAG_ATOM = 2;
+
+static inline int sbmask(int j) { return j >> SBBITS & 3; }
+
+FixPHINKSpace::FixPHINKSpace(LAMMPS *lmp, int narg, char **arg) :
+  Fix(lmp, narg, arg), pair(nullptr), coul(nullptr), cut_coulsq(0.0), list(nullptr), pe_atom(nullptr),
+  qmin(0.01), nmax(0), phi(nullptr)
+{
+  if (igroup != 0) error->all(FLERR, "Fix phin/kspace must use group all");
+  int iarg = 3;
+  while (iarg < narg) {
+    if (strcmp(arg[iarg], "qmin") == 0) {
+      if (iarg + 2 > narg) error->all(FLERR, "Illegal fix phin/kspace command");
+      qmin = utils::numeric(FLERR, arg[iarg + 1], false, lmp);
+      if (qmin < 0.0) error->all(FLERR, "Fix phin/kspace qmin must be >= 0");
+      iarg += 2;
+    } else
+      error->all(FLERR, "Illegal fix phin/kspace command: unknown keyword {}", arg[iarg]);
+  }
+
+  virial_global_flag = 1;
+  thermo_virial = 1;
+
+  id_pe = std::string(id) + "_pe";
+  modify->add_compute(fmt::format("{} all pe/atom kspace", id_pe));
+}
+
+FixPHINKSpace::~FixPHINKSpace()
+{
+  if (modify->get_compute_by_id(id_pe)) modify->delete_compute(id_pe);
+  memory->destroy(phi);
+}
+
+int FixPHINKSpace::setmask()
+{
+  int mask = 0;
+  mask |= POST_FORCE;
+  mask |= MIN_POST_FORCE;
+  return mask;
+}
+
+void FixPHINKSpace::init()
+{
+  pair = dynamic_cast<PairPHIN *>(force->pair_match("phin", 1));
+  if (!pair || pair->charge_output.empty())
+    error->all(FLERR, "Fix phin/kspace requires pair_style phin with kspace_charges");
+  if (!force->kspace) error->all(FLERR, "Fix phin/kspace requires a kspace style");
+
+  // the real-space part, coul/long in pair_style hybrid/overlay; any other
+  // Coulomb style would leave its real-space term out of the charge forces
+  coul = force->pair_match("coul/long", 1);
+  auto hybrid = dynamic_cast<PairHybrid *>(force->pair);
+  const int nstyles = hybrid ? hybrid->nstyles : 1;
+  for (int m = 0; m < nstyles; m++) {
+    const char *style = hybrid ? hybrid->keywords[m] : force->pair_style;
+    if (strstr(style, "coul") && strcmp(style, "coul/long") != 0)
+      error->all(FLERR, "Fix phin/kspace supports coul/long as the real-space Coulomb style, "
+                 "not {}", style);
+  }
+  if (coul) {
+    int dim;
+    auto cut_coul = (double *) coul->extract("cut_coul", dim);
+    if (!cut_coul || dim != 0) error->all(FLERR, "Fix phin/kspace cannot get the coul/long cutoff");
+    cut_coulsq = (*cut_coul) * (*cut_coul);
+    neighbor->add_request(this, NeighConst::REQ_FULL)->set_cutoff(*cut_coul);
+  } else if (comm->me == 0)
+    error->warning(FLERR, "Fix phin/kspace found no Coulomb pair style; "
+                   "only the kspace part enters the charge forces");
+
+  pe_atom = modify->get_compute_by_id(id_pe);
+  if (!pe_atom) error->all(FLERR, "Fix phin/kspace lost its compute {}", id_pe);
+  pe_atom->addstep(update->ntimestep);
+}
+
+void FixPHINKSpace::init_list(int /*id*/, NeighList *ptr)
+{
+  list = ptr;
+}
+
+void FixPHINKSpace::setup(int vflag)
+{
+  post_force(vflag);
+}
+
+void FixPHINKSpace::min_setup(int vflag)
+{
+  post_force(vflag);
+}
+
+void FixPHINKSpace::post_force(int vflag)
+{
+  v_init(vflag);
+
+  // per-atom energies again on the next step
+  pe_atom->addstep(update->ntimestep + 1);
+
+  if (update->eflag_atom != update->ntimestep)
+    error->all(FLERR, "Fix phin/kspace: per-atom energies were not computed on this step");
+
+  if (atom->nmax > nmax) {
+    memory->destroy(phi);
+    nmax = atom->nmax;
+    memory->create(phi, nmax, "phin/kspace:phi");
+  }
+
+  double *q = atom->q;
+  const double *ek = force->kspace->eatom;
+  if (!ek) error->all(FLERR, "Fix phin/kspace: kspace style has no per-atom energies");
+  int small = 0;
+  for (int i = 0; i < atom->nlocal; i++)
+    if (fabs(q[i]) < qmin) small = 1;
+  MPI_Allreduce(MPI_IN_PLACE, &small, 1, MPI_INT, MPI_MAX, world);
+  if (small)
+    kspace_potential();
+  else
+    for (int i = 0; i < atom->nlocal; i++) phi[i] = 2.0 * ek[i] / q[i];
+
+  // real-space potential; ghost charges are current, pair phin sends them
+  if (coul) {
+    double **x = atom->x;
+    const double g_ewald = force->kspace->g_ewald;
+    const double *special_coul = force->special_coul;
+    for (int ii = 0; ii < list->inum; ii++) {
+      const int i = list->ilist[ii];
+      const int *jlist = list->firstneigh[i];
+      double sum = 0.0;
+      for (int jj = 0; jj < list->numneigh[i]; jj++) {
+        int j = jlist[jj];
+        const double factor_coul = special_coul[sbmask(j)];
+        j &= NEIGHMASK;
+        const double dx = x[i][0] - x[j][0];
+        const double dy = x[i][1] - x[j][1];
+        const double dz = x[i][2] - x[j][2];
+        const double rsq = dx*dx + dy*dy + dz*dz;
+        if (rsq >= cut_coulsq) continue;
+        const double r = sqrt(rsq);
+        sum += q[j] * (erfc(g_ewald * r) - (1.0 - factor_coul)) / r;
+      }
+      phi[i] += force->qqrd2e * sum;
+    }
+  }
+  pair->charge_forces(phi, vflag_global ? virial : nullptr);
+}
+
+/* ----------------------------------------------------------------------
+   kspace part of phi without dividing by the charges: the per-atom
+   energies are e_i(q) = q_i phi_i(q) / 2 with phi linear in q, so solves
+   at q + c and q - c give phi_i exactly. The step's forces, energy and
+   per-atom energies of the kspace style are restored afterwards.
+------------------------------------------------------------------------- */
+
+void FixPHINKSpace::kspace_potential()
+{
+  KSpace *kspace = force->kspace;
+  const int nlocal = atom->nlocal;
+  double *q = atom->q;
+  double **f = atom->f;
+
+  // shift by the rms charge, so that the three solves are of similar size
+  double c = sqrt(kspace->qsqsum / atom->natoms);
+  if (c == 0.0) c = 1.0;
+
+  std::vector<double> qsave(q, q + nlocal), ek(kspace->eatom, kspace->eatom + nlocal);
+  std::vector<double> fsave(3 * nlocal), eplus(nlocal);
+  for (int i = 0; i < nlocal; i++)
+    for (int k = 0; k < 3; k++) fsave[3 * i + k] = f[i][k];
+  const double energy = kspace->energy;
+
+  for (int sign = 1; sign >= -1; sign -= 2) {
+    for (int i = 0; i < nlocal; i++) q[i] = qsave[i] + sign * c;
+    kspace->qsum_qsq(0);
+    kspace->compute(EFLAG_ATOM, 0);
+    const double *e = kspace->eatom;
+    if (sign > 0)
+      for (int i = 0; i < nlocal; i++) eplus[i] = e[i];
+    else
+      for (int i = 0; i < nlocal; i++)
+        phi[i] = (eplus[i] - e[i]) / c - qsave[i] * (eplus[i] + e[i] - 2.0 * ek[i]) / (c * c);
+  }
+
+  for (int i = 0; i < nlocal; i++) {
+    q[i] = qsave[i];
+    kspace->eatom[i] = ek[i];
+    for (int k = 0; k < 3; k++) f[i][k] = fsave[3 * i + k];
+  }
+  kspace->qsum_qsq(0);
+  kspace->energy = energy;
+}
+
+void FixPHINKSpace::min_post_force(int vflag)
+{
+  post_force(vflag);
+}
@@ -0,0 +1,58 @@
+/* -*- c++ -*- ----------------------------------------------------------
+   LAMMPS - Large-scale Atomic/Molecular Massively Parallel Simulator
+   https://www.lammps.org/, Sandia National Laboratories
+   Steve Plimpton, sjplimp@sandia.gov
+
+   Copyright (2003) Sandia Corporation.  Under the terms of Contract
+   DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government retains
+   certain rights in this software.  This software is distributed under
+   the GNU General Public License.
+
+   See the README file in the top-level LAMMPS directory.
+------------------------------------------------------------------------- */
+
+#ifdef FIX_CLASS
+
+FixStyle(phin/kspace,FixPHINKSpace)
+
+#else
+
+#ifndef LMP_FIX_PHIN_KSPACE_H
+#define LMP_FIX_PHIN_KSPACE_H
+
+#include "fix.h"
+
+#include <string>
+
+namespace LAMMPS_NS {
+
+class FixPHINKSpace : public Fix {
+ public:
+  FixPHINKSpace(class LAMMPS *, int, char **);
+  ~FixPHINKSpace() override;
+  int setmask() override;
+  void init() override;
+  void init_list(int, class NeighList *) override;
+  void setup(int) override;
+  void min_setup(int) override;
+  void post_force(int) override;
+  void min_post_force(int) override;
+
+ protected:
+  void kspace_potential();
+
+  class PairPHIN *pair;
+  class Pair *coul;              // coul/long, the real-space Coulomb part
+  double cut_coulsq;
+  class NeighList *list;         // full list for the real-space potential
+  class Compute *pe_atom;        // only there to have kspace per-atom energies every step
+  std::string id_pe;
+  double qmin;                   // below this charge, phi comes from two extra kspace solves
+  int nmax;
+  double *phi;
+};
+
+}
+
+#endif
+#endif
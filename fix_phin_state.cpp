@@ -0,0 +1,82 @@
+/* ----------------------------------------------------------------------
+   LAMMPS - Large-scale Atomic/Molecular Massively Parallel Simulator
+   https://www.lammps.org/, Sandia National Laboratories
+   Steve Plimpton, sjplimp@sandia.gov
+
+   Copyright (2003) Sandia Corporation.  Under the terms of Contract
+   DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government retains
+   certain rights in this software.  This software is distributed under
+   the GNU General Public License.
+
+   See the README file in the top-level LAMMPS directory.
+------------------------------------------------------------------------- */
+
+/* ----------------------------------------------------------------------
+   fix ID group-ID phin/state ncol
+
+   Internal: pair_style phin adds it (as PHIN_STATE) for models with
+   state_outputs, so the state migrates, sorts and grows with the atoms.
+------------------------------------------------------------------------- */
+
+#include "fix_phin_state.h"
+
+#include "atom.h"
+#include "error.h"
+#include "memory.h"
+
+#include <cstring>
+
+using namespace LAMMPS_NS;
+
+FixPHINState::FixPHINState(LAMMPS *lmp, int narg, char **arg) :
+  Fix(lmp, narg, arg), state(nullptr)
+{
+  if (narg != 4) error->all(FLERR, "Illegal fix phin/state command");
+  ncol = utils::inumeric(FLERR, arg[3], false, lmp);
+  if (ncol < 1) error->all(FLERR, "Illegal fix phin/state command");
+
+  create_attribute = 1;
+  grow_arrays(atom->nmax);
+  atom->add_callback(Atom::GROW);
+
+  // nobody has a state yet
+  for (int i = 0; i < atom->nlocal; i++) set_arrays(i);
+}
+
+FixPHINState::~FixPHINState()
+{
+  atom->delete_callback(id, Atom::GROW);
+  memory->destroy(state);
+}
+
+void FixPHINState::grow_arrays(int nmax)
+{
+  memory->grow(state, nmax, ncol + 1, "phin/state:state");
+}
+
+void FixPHINState::copy_arrays(int i, int j, int /*delflag*/)
+{
+  memcpy(state[j], state[i], sizeof(double) * (ncol + 1));
+}
+
+void FixPHINState::set_arrays(int i)
+{
+  memset(state[i], 0, sizeof(double) * (ncol + 1));
+}
+
+int FixPHINState::pack_exchange(int i, double *buf)
+{
+  for (int k = 0; k <= ncol; k++) buf[k] = state[i][k];
+  return ncol + 1;
+}
+
+int FixPHINState::unpack_exchange(int nlocal, double *buf)
+{
+  for (int k = 0; k <= ncol; k++) state[nlocal][k] = buf[k];
+  return ncol + 1;
+}
+
+double FixPHINState::memory_usage()
+{
+  return (double) atom->nmax * (ncol + 1) * sizeof(double);
+}
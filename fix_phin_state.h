@@ -0,0 +1,50 @@
+/* -*- c++ -*- ----------------------------------------------------------
+   LAMMPS - Large-scale Atomic/Molecular Massively Parallel Simulator
+   https://www.lammps.org/, Sandia National Laboratories
+   Steve Plimpton, sjplimp@sandia.gov
+
+   Copyright (2003) Sandia Corporation.  Under the terms of Contract
+   DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government retains
+   certain rights in this software.  This software is distributed under
+   the GNU General Public License.
+
+   See the README file in the top-level LAMMPS directory.
+------------------------------------------------------------------------- */
+
+#ifdef FIX_CLASS
+
+FixStyle(phin/state,FixPHINState)
+
+#else
+
+#ifndef LMP_FIX_PHIN_STATE_H
+#define LMP_FIX_PHIN_STATE_H
+
+#include "fix.h"
+
+namespace LAMMPS_NS {
+
+// Per-atom model state carried between steps for pair_style phin; created
+// and filled by the pair style. Row i holds ncol state values followed by
+// a flag that is 1 once atom i has a state from a previous step.
+class FixPHINState : public Fix {
+ public:
+  FixPHINState(class LAMMPS *, int, char **);
+  ~FixPHINState() override;
+  int setmask() override { return 0; }
+
+  void grow_arrays(int) override;
+  void copy_arrays(int, int, int) override;
+  void set_arrays(int) override;
+  int pack_exchange(int, double *) override;
+  int unpack_exchange(int, double *) override;
+  double memory_usage() override;
+
+  int ncol;
+  double **state;
+};
+
+}
+
+#endif
+#endif
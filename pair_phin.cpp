@@ -16,30 +16,43 @@
 ------------------------------------------------------------------------- */
 
 #include <pair_phin.h>
+#include "phin_ops.h"
+#include "phin_weights.h"
 #include "atom.h"
 #include "comm.h"
 #include "domain.h"
 #include "error.h"
+#include "fix_phin_state.h"
 #include "force.h"
+#include "group.h"
+#include "kspace.h"
+#include "math_const.h"
 #include "memory.h"
+#include "modify.h"
 #include "neigh_list.h"
 #include "neigh_request.h"
 #include "neighbor.h"
+#include "pair_hybrid.h"
 #include "potential_file_reader.h"
+#include "region.h"
 #include "tokenizer.h"
 #include "timer.h"
 #include "update.h"
 
+#include <algorithm>
 #include <cmath>
 #include <cstring>
+#include <fstream>
 #include <numeric>
 #include <cassert>
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <torch/torch.h>
 #include <torch/script.h>
 #include <torch/csrc/jit/runtime/graph_executor.h>
+#include <unistd.h>
 //#include <c10/cuda/CUDACachingAllocator.h>
 
 
@@ -63,21 +76,94 @@
 
 
 using namespace LAMMPS_NS;
+using MathConst::MY_PI;
+
+// Fractional coordinates s of a displacement d in the lower-triangular
+// cell matrix (rows are the lattice vectors a, b, c as LAMMPS defines them)
+static inline void cart2frac(const double cellm[3][3], const double *d, double *s)
+{
+  s[2] = d[2] / cellm[2][2];
+  s[1] = (d[1] - s[2]*cellm[2][1]) / cellm[1][1];
+  s[0] = (d[0] - s[1]*cellm[1][0] - s[2]*cellm[2][0]) / cellm[0][0];
+}
+
+// Resident set size of this process, for load diagnostics
+static double resident_mb()
+{
+  long pages = 0, resident = 0;
+  std::ifstream statm("/proc/self/statm");
+  if (!(statm >> pages >> resident)) return 0.0;
+  return resident * (double) sysconf(_SC_PAGESIZE) / (1024.0*1024.0);
+}
+
+// FNV-1a hash of a file's bytes, to recognize a model across runs
+static std::string file_hash(const std::string &filename)
+{
+  uint64_t h = 14695981039346656037ULL;
+  std::ifstream in(filename, std::ios::binary);
+  char buf[1 << 16];
+  while (in.read(buf, sizeof(buf)) || in.gcount() > 0) {
+    for (std::streamsize k = 0; k < in.gcount(); k++) {
+      h ^= (unsigned char) buf[k];
+      h *= 1099511628211ULL;
+    }
+  }
+  return fmt::format("{:016x}", h);
+}
+
+#if !(TORCH_VERSION_MAJOR == 1 && TORCH_VERSION_MINOR <= 10)
+// Fusion strategy from its metadata form, e.g. "STATIC,2;DYNAMIC,10"
+static torch::jit::FusionStrategy parse_fusion_strategy(const std::string &text)
+{
+  torch::jit::FusionStrategy strategy;
+  std::stringstream strat_stream(text);
+  std::string fusion_type, fusion_depth;
+  while(std::getline(strat_stream, fusion_type, ',')) {
+    std::getline(strat_stream, fusion_depth, ';');
+    strategy.push_back({fusion_type == "STATIC" ? torch::jit::FusionBehavior::STATIC : torch::jit::FusionBehavior::DYNAMIC, std::stoi(fusion_depth)});
+  }
+  return strategy;
+}
+#endif
+
+// Read-only, seekable stream over a memory range, so that TorchScript
+// can deserialize an archive from the weight file mapping
+class MappedStreamBuf : public std::streambuf {
+ public:
+  MappedStreamBuf(char *data, size_t size) { setg(data, data, data + size); }
+
+ protected:
+  pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode) override
+  {
+    char *p = (dir == std::ios_base::beg ? eback() : dir == std::ios_base::cur ? gptr() : egptr()) + off;
+    if (p < eback() || p > egptr()) return pos_type(off_type(-1));
+    setg(eback(), p, egptr());
+    return pos_type(p - eback());
+  }
+  pos_type seekpos(pos_type pos, std::ios_base::openmode which) override
+  {
+    return seekoff(off_type(pos), std::ios_base::beg, which);
+  }
+};
 
 PairPHIN::PairPHIN(LAMMPS *lmp) : Pair(lmp) {
   restartinfo = 0;
   manybody_flag = 1;
+  // forces on images are already summed into the local atoms, so the
+  // virial cannot come from f dot r; it comes from the model or the edges
+  no_virial_fdotr_compute = 1;
   
   nmax = 0;
   uncertainties = nullptr;
 
-  if(torch::cuda::is_available()){
-    device = torch::kCUDA;
-  }
-  else {
-    device = torch::kCPU;
-  }
-  std::cout << "PHIN is using device " << device << "\n";
+  // make sure the torch.ops.phin custom operators are linked in and registered
+  phin::ops_linked();
+
+  // extra quantities for "compute pair phin":
+  // edges, candidate pairs tested, internal list rebuilds, edge build time,
+  // atoms whose edges were capped, edges dropped by the cap
+  nextra = 6;
+  pvector = new double[nextra];
 
   if(const char* env_p = std::getenv("PHIN_DEBUG")){
     std::cout << "PairPHIN is in DEBUG mode, since PHIN_DEBUG is in env\n";
@@ -89,11 +175,19 @@ enum{TLIMIT};
 
 PairPHIN::~PairPHIN(){
 
+  if (fix_state && modify->get_fix_by_id("PHIN_STATE")) modify->delete_fix("PHIN_STATE");
   memory->destroy(uncertainties);
+  for (auto &out : peratom_outputs) {
+    memory->destroy(out.vector);
+    memory->destroy(out.array);
+  }
+  delete[] pvector;
   if (allocated) {
     memory->destroy(setflag);
     memory->destroy(cutsq);
     memory->destroy(type_mapper);
+    memory->destroy(edge_cutsq);
+    memory->destroy(short_cutsq);
   }
 }
 
@@ -101,6 +195,78 @@ void PairPHIN::init_style(){
   if (atom->tag_enable == 0)
     error->all(FLERR,"Pair style PHIN requires atom IDs");
 
+  if (!charge_output.empty() && !atom->q_flag)
+    error->all(FLERR,"Pair style PHIN kspace_charges requires an atom style with charges");
+  // the Coulomb sub-style has to see this step's charges, and compute()
+  // sets the forces rather than adding to them, so phin must come first
+  if (!charge_output.empty() && force->pair != this) {
+    auto hybrid = dynamic_cast<PairHybrid *>(force->pair);
+    if (!hybrid || hybrid->nstyles < 1 || hybrid->styles[0] != this)
+      error->all(FLERR,"Pair style PHIN kspace_charges requires phin to be the first "
+                 "sub-style of pair_style hybrid/overlay");
+  }
+
+  // storage for the model state that travels with the atoms
+  if (state_ncol > 0) {
+    fix_state = dynamic_cast<FixPHINState *>(modify->get_fix_by_id("PHIN_STATE"));
+    if (fix_state && fix_state->ncol != state_ncol) {
+      modify->delete_fix("PHIN_STATE");
+      fix_state = nullptr;
+    }
+    if (!fix_state)
+      fix_state = dynamic_cast<FixPHINState *>(
+        modify->add_fix(fmt::format("PHIN_STATE all phin/state {}", state_ncol)));
+  }
+
+  if (smallcell && neigh_internal)
+    error->all(FLERR,"Pair style PHIN smallcell and neigh internal are mutually exclusive");
+  // the repeat unit builds its own edges, which max_neighbors does not cap
+  if (dedup && (!smallcell || sort_species || edge_forces_flag || state_ncol > 0
+                || !charge_output.empty() || max_neighbors > 0))
+    error->all(FLERR,"Pair style PHIN dedup requires smallcell and does not work with "
+               "sort_species, edge_forces, state_outputs, kspace_charges or max_neighbors");
+  dedup_factor = 1;
+  if (autotune && !blend_models.empty())
+    error->all(FLERR,"Pair style PHIN autotune does not work with blend");
+
+  // regions may be redefined between runs, so look them up here
+  if (!blend_models.empty() && (dedup || sort_species || edge_offsets_flag || edge_forces_flag))
+    error->all(FLERR,"Pair style PHIN blend does not work with dedup, sort_species, "
+               "edge_offsets or edge_forces");
+  for (auto &bm : blend_models) {
+    if (bm.region_id.empty()) continue;
+    bm.region = domain->get_region_by_id(bm.region_id);
+    if (!bm.region) error->all(FLERR,"PHIN blend region {} does not exist", bm.region_id);
+    if (!bm.region->interior || bm.region->dynamic_check())
+      error->all(FLERR,"PHIN blend region {} must be static and side in", bm.region_id);
+  }
+
+  if (neigh_internal) {
+    // The internal list is built from the ghost atoms LAMMPS keeps
+    // within cutoff + skin, so its own skin cannot exceed that shell
+    if (neigh_skin > neighbor->skin)
+      error->all(FLERR,"Pair style PHIN neigh/skin must not exceed the neighbor skin");
+    if (force->newton_pair == 1)
+      error->all(FLERR,"Pair style PHIN requires newton pair off");
+    nb_lastcall = -1;
+    nrebuilds = 0;
+    return;
+  }
+
+  if (smallcell) {
+    // Edges are built from periodic images of the local atoms,
+    // so every atom (and the whole box) has to live on this rank.
+    if (comm->nprocs != 1)
+      error->all(FLERR,"Pair style PHIN smallcell requires a single MPI rank");
+    if (!domain->xperiodic || !domain->yperiodic || !domain->zperiodic)
+      error->all(FLERR,"Pair style PHIN smallcell requires a fully periodic box");
+    if (force->newton_pair == 1)
+      error->all(FLERR,"Pair style PHIN requires newton pair off");
+    // No neighbor list (and hence no ghost images within the cutoff) is needed
+    sc_cell[0][0] = -1.0;
+    return;
+  }
+
   // need a full neighbor list
   // int irequest = neighbor->request(this,instance_me);
   neighbor->add_request(this, NeighConst::REQ_FULL);
@@ -122,7 +288,11 @@ void PairPHIN::init_style(){
 
 double PairPHIN::init_one(int i, int j)
 {
-  return cutoff;
+  // In smallcell mode the images are generated internally,
+  // so LAMMPS only has to keep a skin-sized ghost shell.
+  if (smallcell) return 0.0;
+  // Edges are directed, so the list has to cover both directions
+  return sqrt(std::max(edge_cutsq[i][j], edge_cutsq[j][i]));
 }
 
 void PairPHIN::allocate()
@@ -133,13 +303,85 @@ void PairPHIN::allocate()
   memory->create(setflag,n+1,n+1,"pair:setflag");
   memory->create(cutsq,n+1,n+1,"pair:cutsq");
   memory->create(type_mapper, n+1, "pair:type_mapper");
+  memory->create(edge_cutsq,n+1,n+1,"pair:edge_cutsq");
+  memory->create(short_cutsq,n+1,n+1,"pair:short_cutsq");
 
 }
 
-void PairPHIN::settings(int narg, char ** /*arg*/) {
-  // "flare" should be the only word after "pair_style" in the input file.
-  if (narg > 0)
-    error->all(FLERR, "Illegal pair_style command");
+void PairPHIN::settings(int narg, char **arg) {
+  // optional keyword/value pairs after "pair_style phin"
+  int iarg = 0;
+  while (iarg < narg) {
+    if (strcmp(arg[iarg], "smallcell") == 0) {
+      if (iarg+2 > narg) error->all(FLERR, "Illegal pair_style command");
+      smallcell = utils::logical(FLERR, arg[iarg+1], false, lmp);
+      iarg += 2;
+    } else if (strcmp(arg[iarg], "max_neighbors") == 0) {
+      if (iarg+2 > narg) error->all(FLERR, "Illegal pair_style command");
+      max_neighbors_keyword = utils::inumeric(FLERR, arg[iarg+1], false, lmp);
+      if (max_neighbors_keyword < 0) error->all(FLERR, "Illegal pair_style command");
+      iarg += 2;
+    } else if (strcmp(arg[iarg], "sort_species") == 0) {
+      if (iarg+2 > narg) error->all(FLERR, "Illegal pair_style command");
+      sort_species = utils::logical(FLERR, arg[iarg+1], false, lmp);
+      iarg += 2;
+    } else if (strcmp(arg[iarg], "edge_forces") == 0) {
+      if (iarg+2 > narg) error->all(FLERR, "Illegal pair_style command");
+      edge_forces_flag = utils::logical(FLERR, arg[iarg+1], false, lmp);
+      iarg += 2;
+    } else if (strcmp(arg[iarg], "dedup") == 0) {
+      if (iarg+2 > narg) error->all(FLERR, "Illegal pair_style command");
+      dedup = utils::logical(FLERR, arg[iarg+1], false, lmp);
+      iarg += 2;
+    } else if (strcmp(arg[iarg], "autotune") == 0) {
+      if (iarg+2 > narg) error->all(FLERR, "Illegal pair_style command");
+      autotune = utils::logical(FLERR, arg[iarg+1], false, lmp);
+      iarg += 2;
+    } else if (strcmp(arg[iarg], "autotune/cache") == 0) {
+      if (iarg+2 > narg) error->all(FLERR, "Illegal pair_style command");
+      autotune_cache = arg[iarg+1];
+      iarg += 2;
+    } else if (strcmp(arg[iarg], "autotune/steps") == 0) {
+      if (iarg+2 > narg) error->all(FLERR, "Illegal pair_style command");
+      autotune_steps = utils::inumeric(FLERR, arg[iarg+1], false, lmp);
+      if (autotune_steps < 1) error->all(FLERR, "Illegal pair_style command");
+      iarg += 2;
+    } else if (strcmp(arg[iarg], "dedup/tol") == 0) {
+      if (iarg+2 > narg) error->all(FLERR, "Illegal pair_style command");
+      dedup_tol = utils::numeric(FLERR, arg[iarg+1], false, lmp);
+      if (dedup_tol <= 0.0) error->all(FLERR, "Illegal pair_style command");
+      iarg += 2;
+    } else if (strcmp(arg[iarg], "kspace_charges") == 0) {
+      if (iarg+2 > narg) error->all(FLERR, "Illegal pair_style command");
+      charge_output = arg[iarg+1];
+      if (charge_output == "none") charge_output.clear();
+      comm_forward = charge_output.empty() ? 0 : 1;
+      iarg += 2;
+    } else if (strcmp(arg[iarg], "edge_offsets") == 0) {
+      if (iarg+2 > narg) error->all(FLERR, "Illegal pair_style command");
+      edge_offsets_flag = utils::logical(FLERR, arg[iarg+1], false, lmp);
+      iarg += 2;
+    } else if (strcmp(arg[iarg], "neigh") == 0) {
+      if (iarg+2 > narg) error->all(FLERR, "Illegal pair_style command");
+      if (strcmp(arg[iarg+1], "lammps") == 0) neigh_internal = 0;
+      else if (strcmp(arg[iarg+1], "internal") == 0) neigh_internal = 1;
+      else error->all(FLERR, "Illegal pair_style command");
+      iarg += 2;
+    } else if (strcmp(arg[iarg], "neigh/skin") == 0) {
+      if (iarg+2 > narg) error->all(FLERR, "Illegal pair_style command");
+      neigh_skin = utils::numeric(FLERR, arg[iarg+1], false, lmp);
+      if (neigh_skin < 0.0) error->all(FLERR, "Illegal pair_style command");
+      iarg += 2;
+    } else error->all(FLERR, "Illegal pair_style command");
+  }
+
+  if(torch::cuda::is_available()){
+    device = torch::kCUDA;
+  }
+  else {
+    device = torch::kCPU;
+  }
+  std::cout << "PHIN is using device " << device << "\n";
 }
 
 void PairPHIN::coeff(int narg, char **arg) {
@@ -149,8 +391,9 @@ void PairPHIN::coeff(int narg, char **arg) {
 
   int ntypes = atom->ntypes;
 
-  // Should be exactly 3 arguments following "pair_coeff" in the input file.
-  if (narg != (3+ntypes))
+  // Should be exactly 3 arguments following "pair_coeff" in the input file,
+  // optionally followed by blend clauses for further models
+  if (narg < (3+ntypes))
     error->all(FLERR, "Incorrect args for pair coefficients");
 
   // Ensure I,J args are "* *".
@@ -184,14 +427,29 @@ void PairPHIN::coeff(int narg, char **arg) {
     {"type_names", ""},
     {"_jit_bailout_depth", ""},
     {"_jit_fusion_strategy", ""},
-    {"allow_tf32", ""}
+    {"allow_tf32", ""},
+    {"per_edge_type_cutoff", ""},
+    {"max_neighbors", ""},
+    {"per_atom_outputs", ""},
+    {"state_outputs", ""},
+    {"long_range_cutoff", ""},
+    {"num_layers", ""}
   };
-  model = torch::jit::load(std::string(arg[2]), device, metadata);
+  const double t_load = MPI_Wtime();
+  if (phin::is_weight_file(arg[2])) model = load_mapped(arg[2], metadata);
+  else model = torch::jit::load(std::string(arg[2]), device, metadata);
   model.eval();
 
   // If the model is not already frozen, we should freeze it:
   // This is the check used by PyTorch: https://github.com/pytorch/pytorch/blob/master/torch/csrc/jit/api/module.cpp#L476
+  hess_model_ok = false;
   if (model.hasattr("training")) {
+    // keep the unfrozen module for Hessians, blending and kspace_charges.
+    // Freezing works on a clone that shares the tensors, so this costs no
+    // copy; training mode, set once frozen, makes it build its forces with
+    // create_graph
+    torch::jit::Module unfrozen = model;
+
     std::cout << "Freezing TorchScript model...\n";
     #ifdef DO_TORCH_FREEZE_HACK
       // Do the hack
@@ -211,6 +469,9 @@ void PairPHIN::coeff(int narg, char **arg) {
       // Do it normally
       model = torch::jit::freeze(model);
     #endif
+    hess_model = unfrozen;
+    hess_model.train();
+    hess_model_ok = true;
   }
 
   #if (TORCH_VERSION_MAJOR == 1 && TORCH_VERSION_MINOR <= 10)
@@ -225,19 +486,13 @@ void PairPHIN::coeff(int narg, char **arg) {
     torch::jit::getBailoutDepth() = jit_bailout_depth;
   #else
     // In PyTorch >=1.11, this is now set_fusion_strategy
-    torch::jit::FusionStrategy strategy;
     if (metadata["_jit_fusion_strategy"].empty()) {
       // This is the default used in the Python code
-      strategy = {{torch::jit::FusionBehavior::DYNAMIC, 3}};
+      tune.fusion = "DYNAMIC,3";
     } else {
-      std::stringstream strat_stream(metadata["_jit_fusion_strategy"]);
-      std::string fusion_type, fusion_depth;
-      while(std::getline(strat_stream, fusion_type, ',')) {
-        std::getline(strat_stream, fusion_depth, ';');
-        strategy.push_back({fusion_type == "STATIC" ? torch::jit::FusionBehavior::STATIC : torch::jit::FusionBehavior::DYNAMIC, std::stoi(fusion_depth)});
-      }
+      tune.fusion = metadata["_jit_fusion_strategy"];
     }
-    torch::jit::setFusionStrategy(strategy);
+    torch::jit::setFusionStrategy(parse_fusion_strategy(tune.fusion));
   #endif
 
   // Set whether to allow TF32:
@@ -253,7 +508,12 @@ void PairPHIN::coeff(int narg, char **arg) {
   at::globalContext().setAllowTF32CuBLAS(allow_tf32);
   at::globalContext().setAllowTF32CuDNN(allow_tf32);
 
-  
+  if (screen)
+    fprintf(screen, "PHIN Coeff: model loaded in %.3f s, resident memory %.1f MB\n",
+            MPI_Wtime() - t_load, resident_mb());
+  if (autotune) model_hash = file_hash(arg[2]);
+  tuned = 0;
+
   std::cout << "Information from model: " << metadata.size() << " key-value pairs\n";
   for( const auto& n : metadata ) {
     std::cout << "Key:[" << n.first << "] Value:[" << n.second << "]\n";
@@ -264,6 +524,7 @@ void PairPHIN::coeff(int narg, char **arg) {
   // match the type names in the pair_coeff to the metadata
   // to construct a type mapper from LAMMPS type to NequIP atom_types
   int n_species = std::stod(metadata["n_species"]);
+  nspecies = n_species;
   std::stringstream ss;
   ss << metadata["type_names"];
   for (int i = 0; i < n_species; i++){
@@ -274,6 +535,174 @@ void PairPHIN::coeff(int narg, char **arg) {
               type_mapper[itype] = i;
   }
 
+  // Per-type-pair edge cutoffs: an optional n_species x n_species matrix
+  // (row-major, in type_names order), none of them larger than r_max
+  for (int i = 1; i <= ntypes; i++)
+    for (int j = 1; j <= ntypes; j++)
+      edge_cutsq[i][j] = cutoff*cutoff;
+  if (!metadata["per_edge_type_cutoff"].empty()) {
+    std::vector<double> species_cutoff;
+    std::stringstream cs(metadata["per_edge_type_cutoff"]);
+    double rc;
+    while (cs >> rc) species_cutoff.push_back(rc);
+    if (species_cutoff.size() != (size_t) n_species*n_species)
+      error->all(FLERR,"PHIN model per_edge_type_cutoff must have n_species^2 entries");
+    for (int i = 1; i <= ntypes; i++)
+      for (int j = 1; j <= ntypes; j++) {
+        if ((type_mapper[i] < 0) || (type_mapper[j] < 0)) continue;
+        rc = species_cutoff[type_mapper[i]*n_species + type_mapper[j]];
+        if (rc > cutoff)
+          error->all(FLERR,"PHIN model per_edge_type_cutoff entries must not exceed r_max");
+        edge_cutsq[i][j] = rc*rc;
+      }
+  }
+
+  // Dual cutoff: edges are built once at long_range_cutoff, and the ones
+  // within the (per-pair) short cutoffs above are passed as a subset
+  dual_cutoff = !metadata["long_range_cutoff"].empty();
+  if (dual_cutoff) {
+    const double rlong = std::stod(metadata["long_range_cutoff"]);
+    if (rlong < cutoff)
+      error->all(FLERR,"PHIN model long_range_cutoff must not be smaller than r_max");
+    for (int i = 1; i <= ntypes; i++)
+      for (int j = 1; j <= ntypes; j++) {
+        short_cutsq[i][j] = edge_cutsq[i][j];
+        edge_cutsq[i][j] = rlong*rlong;
+      }
+    cutoff = rlong;
+    if (screen)
+      fprintf(screen, "PHIN Coeff: edges up to %g, short-range subset up to r_max\n", rlong);
+  }
+
+  // Cap on the number of edges per atom; the pair style keyword wins
+  if (max_neighbors_keyword >= 0) max_neighbors = max_neighbors_keyword;
+  else if (!metadata["max_neighbors"].empty()) max_neighbors = std::stoi(metadata["max_neighbors"]);
+  else max_neighbors = 0;
+  if (max_neighbors > 0 && screen)
+    fprintf(screen, "PHIN Coeff: keeping at most %d nearest neighbors per atom\n", max_neighbors);
+
+  // Extra per-atom outputs; storage is (re)allocated with the atom arrays
+  for (auto &out : peratom_outputs) {
+    memory->destroy(out.vector);
+    memory->destroy(out.array);
+  }
+  peratom_outputs.clear();
+  nmax = 0;
+  std::stringstream outs(metadata["per_atom_outputs"]);
+  std::string entry;
+  while (outs >> entry) {
+    PerAtomOutput out;
+    const size_t colon = entry.find(':');
+    out.name = entry.substr(0, colon);
+    out.ncol = 0;
+    if (colon != std::string::npos) {
+      const std::string ncol = entry.substr(colon+1);
+      if (!utils::is_integer(ncol))
+        error->all(FLERR, "PHIN model per_atom_outputs entry {} is invalid", entry);
+      out.ncol = std::stoi(ncol);
+    }
+    if (out.name.empty() || out.ncol < 0 || out.ncol == 1 || out.name == "uncertainties")
+      error->all(FLERR, "PHIN model per_atom_outputs entry {} is invalid", entry);
+    peratom_outputs.push_back(out);
+  }
+  if (!peratom_outputs.empty() && screen)
+    fprintf(screen, "PHIN Coeff: model declares %d extra per-atom outputs\n", (int) peratom_outputs.size());
+
+  // Per-atom state carried over between steps
+  state_outputs.clear();
+  state_ncol = 0;
+  std::stringstream states(metadata["state_outputs"]);
+  while (states >> entry) {
+    StateOutput st;
+    const size_t colon = entry.find(':');
+    st.name = entry.substr(0, colon);
+    st.ncol = 0;
+    if (colon != std::string::npos) {
+      const std::string ncol = entry.substr(colon+1);
+      if (!utils::is_integer(ncol))
+        error->all(FLERR, "PHIN model state_outputs entry {} is invalid", entry);
+      st.ncol = std::stoi(ncol);
+    }
+    if (st.name.empty() || st.ncol < 0 || st.ncol == 1)
+      error->all(FLERR, "PHIN model state_outputs entry {} is invalid", entry);
+    st.offset = state_ncol;
+    state_ncol += std::max(st.ncol, 1);
+    state_outputs.push_back(st);
+  }
+  if (!charge_output.empty() && !hess_model_ok)
+    error->all(FLERR, "PHIN kspace_charges needs a TorchScript model deployed without freezing");
+
+  // Further models, each blended in on a group or a region:
+  //   blend <model> group <group-ID>
+  //   blend <model> region <region-ID> <shell width>
+  blend_models.clear();
+  int iarg = 3+ntypes;
+  while (iarg < narg) {
+    if (strcmp(arg[iarg], "blend") != 0 || iarg+4 > narg)
+      error->all(FLERR, "Incorrect args for pair coefficients");
+    BlendModel bm;
+    bm.file = arg[iarg+1];
+    if (strcmp(arg[iarg+2], "group") == 0) {
+      bm.group_id = arg[iarg+3];
+      const int igroup = group->find(bm.group_id);
+      if (igroup < 0) error->all(FLERR, "PHIN blend group {} does not exist", bm.group_id);
+      bm.groupbit = group->bitmask[igroup];
+      iarg += 4;
+    } else if (strcmp(arg[iarg+2], "region") == 0) {
+      if (iarg+5 > narg) error->all(FLERR, "Incorrect args for pair coefficients");
+      bm.region_id = arg[iarg+3];
+      bm.width = utils::numeric(FLERR, arg[iarg+4], false, lmp);
+      if (bm.width <= 0.0) error->all(FLERR, "PHIN blend shell width must be positive");
+      iarg += 5;
+    } else error->all(FLERR, "Incorrect args for pair coefficients");
+    blend_models.push_back(bm);
+  }
+
+  if (!blend_models.empty()) {
+    if (!hess_model_ok)
+      error->all(FLERR, "PHIN blend needs TorchScript models deployed without freezing");
+    if (dual_cutoff || state_ncol > 0 || !charge_output.empty())
+      error->all(FLERR, "PHIN blend does not support long_range_cutoff, state_outputs or kspace_charges");
+    if (metadata["num_layers"].empty())
+      error->all(FLERR, "PHIN blend needs num_layers in the model metadata");
+    blend_layers = std::stoi(metadata["num_layers"]);
+  }
+  for (auto &bm : blend_models) {
+    if (phin::is_weight_file(bm.file))
+      error->all(FLERR, "PHIN blend models must be TorchScript files, not {}", bm.file);
+    std::unordered_map<std::string, std::string> bmeta = {
+      {"r_max", ""}, {"n_species", ""}, {"type_names", ""}, {"per_edge_type_cutoff", ""},
+      {"long_range_cutoff", ""}, {"num_layers", ""}, {"state_outputs", ""}};
+    std::cout << "Loading blend model from " << bm.file << "\n";
+    bm.model = torch::jit::load(bm.file, device, bmeta);
+    if (!bm.model.hasattr("training"))
+      error->all(FLERR, "PHIN blend model {} must be deployed without freezing", bm.file);
+    bm.model.train();
+
+    // edges are shared, so the models have to agree on what an edge is
+    if (bmeta["r_max"].empty() || std::stod(bmeta["r_max"]) != std::stod(metadata["r_max"])
+        || bmeta["per_edge_type_cutoff"] != metadata["per_edge_type_cutoff"])
+      error->all(FLERR, "PHIN blend model {} must have the same r_max and per_edge_type_cutoff", bm.file);
+    if (!bmeta["long_range_cutoff"].empty() || !bmeta["state_outputs"].empty())
+      error->all(FLERR, "PHIN blend model {} must not use long_range_cutoff or state_outputs", bm.file);
+    if (bmeta["num_layers"].empty())
+      error->all(FLERR, "PHIN blend needs num_layers in the model metadata");
+    blend_layers = std::max(blend_layers, std::stoi(bmeta["num_layers"]));
+
+    bm.type_mapper.assign(ntypes+1, -1);
+    std::stringstream bs(bmeta["type_names"]);
+    std::string ele;
+    for (int i = 0; bs >> ele; i++)
+      for (int itype = 1; itype <= ntypes; itype++)
+        if (ele == elements[itype]) bm.type_mapper[itype] = i;
+    for (int itype = 1; itype <= ntypes; itype++)
+      if (type_mapper[itype] >= 0 && bm.type_mapper[itype] < 0)
+        error->all(FLERR, "PHIN blend model {} has no species {}", bm.file, elements[itype]);
+  }
+  if (!blend_models.empty() && screen)
+    fprintf(screen, "PHIN Coeff: blending %d further models over %d layers\n",
+            (int) blend_models.size(), blend_layers);
+
   // set setflag i,j for type pairs where both are mapped to elements
   for (int i = 1; i <= ntypes; i++)
     for (int j = i; j <= ntypes; j++)
@@ -298,8 +727,19 @@ void PairPHIN::compute(int eflag, int vflag){
     memory->destroy(uncertainties);
     nmax = atom->nmax;
     memory->create(uncertainties,nmax,"pair:rho");
+    for (auto &out : peratom_outputs) {
+      memory->destroy(out.vector);
+      memory->destroy(out.array);
+      if (out.ncol == 0) memory->create(out.vector,nmax,"pair:peratom_output");
+      else memory->create(out.array,nmax,out.ncol,"pair:peratom_output");
+    }
   }
 
+  if (ugrid) ugrid->nsteps++;
+
+  // settings of an earlier tuning for this machine, model and size
+  if (autotune && !tuned) tuned = tune_lookup();
+
   // Atom positions, including ghost atoms
   double **x = atom->x;
   // Atom forces
@@ -317,140 +757,141 @@ void PairPHIN::compute(int eflag, int vflag){
   if (newton_pair==1)
     error->all(FLERR,"Pair style PHIN requires 'newton off'");
 
+  // Whether edges come from the LAMMPS neighbor list
+  const bool use_list = !(smallcell || neigh_internal);
   // Number of local/real atoms
-  int inum = list->inum;
+  // (without a LAMMPS neighbor list, ilist is the identity)
+  int inum = use_list ? list->inum : nlocal;
   assert(inum==nlocal); // This should be true, if my understanding is correct
-  // Number of ghost atoms
-  int nghost = list->gnum;
-  // Total number of atoms
-  int ntotal = inum + nghost;
   // Mapping from neigh list ordering to x/f ordering
-  int *ilist = list->ilist;
-  // Number of neighbors per atom
-  int *numneigh = list->numneigh;
-  // Neighbor list per atom
-  int **firstneigh = list->firstneigh;
-
-  // Total number of bonds (sum of number of neighbors)
-  int nedges = std::accumulate(numneigh, numneigh+ntotal, 0);
-
-  // std::cout << "Number of Edges: " << nedges  << "\n";
-  if(nedges==0) {
-    std::cout << "No Edges Detected\n";
-    // error->all(FLERR,"No Edges Detected");
-    if (comm->me == 0) error->message(FLERR,"No Edges Detected");
-    timer->force_timeout();
-  }
-
-  torch::Tensor pos_tensor = torch::zeros({nlocal, 3});
-  torch::Tensor tag2type_tensor = torch::zeros({nlocal}, torch::TensorOptions().dtype(torch::kInt64));
-  // torch::Tensor tag2type_tensor = torch::zeros({nlocal}, torch::TensorOptions().dtype(torch::int64_t));
-  // auto data = T.data<int64_t>();
-  torch::Tensor periodic_shift_tensor = torch::zeros({3});
-  torch::Tensor cell_tensor = torch::zeros({3,3});
+  int *ilist = use_list ? list->ilist : nullptr;
 
-  auto pos = pos_tensor.accessor<float, 2>();
-  // long edges[2*nedges];
-  int64_t edges[2*nedges];
-  float edge_cell_shifts[3*nedges];
-  // auto tag2type = tag2type_tensor.accessor<long, 1>();
-  auto tag2type = tag2type_tensor.accessor<int64_t, 1>();
-  // auto data = T.data<int64_t>();
-  auto periodic_shift = periodic_shift_tensor.accessor<float, 1>();
-  auto cell = cell_tensor.accessor<float,2>();
-
-  // Inverse mapping from tag to "real" atom index
-  std::vector<int> tag2i(inum);
-
-  // Loop over real atoms to store tags, types and positions
+  // Inverse mapping from graph node to "real" atom index.
+  // Nodes are tag-1 unless they get reordered below.
+  std::vector<int> node2i(inum);
+  // Model species of every node; the tensors are only made once the graph
+  // is complete
+  std::vector<int64_t> node_species(inum);
+
+  // Loop over real atoms to store tags and types
   for(int ii = 0; ii < inum; ii++){
-    int i = ilist[ii];
+    int i = ilist ? ilist[ii] : ii;
     int itag = tag[i];
     int itype = type[i];
 
     // Inverse mapping from tag to x/f atom index
-    tag2i[itag-1] = i; // tag is probably 1-based
-    tag2type[itag-1] = type_mapper[itype];
-    pos[itag-1][0] = x[i][0];
-    pos[itag-1][1] = x[i][1];
-    pos[itag-1][2] = x[i][2];
+    node2i[itag-1] = i; // tag is probably 1-based
+    node_species[itag-1] = type_mapper[itype];
   }
 
-  // Get cell
-  cell[0][0] = domain->boxhi[0] - domain->boxlo[0];
-
-  cell[1][0] = domain->xy;
-  cell[1][1] = domain->boxhi[1] - domain->boxlo[1];
-
-  cell[2][0] = domain->xz;
-  cell[2][1] = domain->yz;
-  cell[2][2] = domain->boxhi[2] - domain->boxlo[2];
+  // Cell rows a, b, c
+  const double cellm[3][3] = {
+    {domain->boxhi[0] - domain->boxlo[0], 0.0, 0.0},
+    {domain->xy, domain->boxhi[1] - domain->boxlo[1], 0.0},
+    {domain->xz, domain->yz, domain->boxhi[2] - domain->boxlo[2]}};
 
-  /*
-  std::cout << "cell: " << cell_tensor << "\n";
-  std::cout << "tag2i: " << "\n";
-  for(int itag = 0; itag < inum; itag++){
-    std::cout << tag2i[itag] << " ";
-  }
-  std::cout << std::endl;
-  */
+  // Configurations that repeat along the lattice vectors are evaluated
+  // on the repeating unit and the results copied to the equivalent atoms
+  if (dedup && compute_dedup(cellm)) return;
 
-  auto cell_inv = cell_tensor.inverse().transpose(0,1);
-
-  // Loop over atoms and neighbors,
-  // store edges and _cell_shifts
-  // ii follows the order of the neighbor lists,
-  // i follows the order of x, f, etc.
+  double t_edges = MPI_Wtime();
   int edge_counter = 0;
   if (debug_mode) printf("PHIN edges: i j xi[:] xj[:] cell_shift[:] rij\n");
-  for(int ii = 0; ii < nlocal; ii++){
-    int i = ilist[ii];
-    int itag = tag[i];
-    int itype = type[i];
-
-    int jnum = numneigh[i];
-    int *jlist = firstneigh[i];
-    for(int jj = 0; jj < jnum; jj++){
-      int j = jlist[jj];
-      j &= NEIGHMASK;
-      int jtag = tag[j];
-      int jtype = type[j];
-
-      // TODO: check sign
-      periodic_shift[0] = x[j][0] - pos[jtag-1][0];
-      periodic_shift[1] = x[j][1] - pos[jtag-1][1];
-      periodic_shift[2] = x[j][2] - pos[jtag-1][2];
-
-      double dx = x[i][0] - x[j][0];
-      double dy = x[i][1] - x[j][1];
-      double dz = x[i][2] - x[j][2];
-
-      double rsq = dx*dx + dy*dy + dz*dz;
-      if (rsq < cutoff*cutoff){
-          torch::Tensor cell_shift_tensor = cell_inv.matmul(periodic_shift_tensor);
-          auto cell_shift = cell_shift_tensor.accessor<float, 1>();
-          float * e_vec = &edge_cell_shifts[edge_counter*3];
-          e_vec[0] = std::round(cell_shift[0]);
-          e_vec[1] = std::round(cell_shift[1]);
-          e_vec[2] = std::round(cell_shift[2]);
-          //std::cout << "cell shift: " << cell_shift_tensor << "\n";
-
-          // TODO: double check order
-          edges[edge_counter*2] = itag - 1; // tag is probably 1-based
-          edges[edge_counter*2+1] = jtag - 1; // tag is probably 1-based
-          edge_counter++;
-
-          if (debug_mode){
-              printf("%d %d %.10g %.10g %.10g %.10g %.10g %.10g %.10g %.10g %.10g %.10g\n", itag-1, jtag-1,
-                pos[itag-1][0],pos[itag-1][1],pos[itag-1][2],pos[jtag-1][0],pos[jtag-1][1],pos[jtag-1][2],
-                e_vec[0],e_vec[1],e_vec[2],sqrt(rsq));
-          }
+  if (smallcell) {
+    edge_counter = build_edges_smallcell(node2i, cellm);
+  } else if (neigh_internal) {
+    edge_counter = build_edges_internal(node2i, cellm);
+  } else {
+    // Number of ghost atoms
+    int nghost = list->gnum;
+    // Total number of atoms
+    int ntotal = inum + nghost;
+    // Number of neighbors per atom
+    int *numneigh = list->numneigh;
+    // Neighbor list per atom
+    int **firstneigh = list->firstneigh;
+
+    // Total number of bonds (sum of number of neighbors)
+    int nedges = std::accumulate(numneigh, numneigh+ntotal, 0);
+    ncandidates = nedges;
+
+    // std::cout << "Number of Edges: " << nedges  << "\n";
+    if(nedges==0) {
+      std::cout << "No Edges Detected\n";
+      // error->all(FLERR,"No Edges Detected");
+      if (comm->me == 0) error->message(FLERR,"No Edges Detected");
+      timer->force_timeout();
+    }
 
+    // long edges[2*nedges];
+    edges.resize(2*nedges);
+    edge_cell_shifts.resize(3*nedges);
+
+    // the cell is lower triangular, so the lattice shift of an image
+    // follows from the image offset by forward substitution
+    const double inv_a = 1.0/cellm[0][0], inv_b = 1.0/cellm[1][1], inv_c = 1.0/cellm[2][2];
+
+    // Loop over atoms and neighbors,
+    // store edges and _cell_shifts
+    // ii follows the order of the neighbor lists,
+    // i follows the order of x, f, etc.
+    for(int ii = 0; ii < nlocal; ii++){
+      int i = ilist[ii];
+      int itag = tag[i];
+      int itype = type[i];
+
+      int jnum = numneigh[i];
+      int *jlist = firstneigh[i];
+      for(int jj = 0; jj < jnum; jj++){
+        int j = jlist[jj];
+        j &= NEIGHMASK;
+        int jtag = tag[j];
+        int jtype = type[j];
+
+        // TODO: check sign
+        const double *xjn = x[node2i[jtag-1]];
+        const double periodic_shift[3] = {x[j][0] - xjn[0], x[j][1] - xjn[1], x[j][2] - xjn[2]};
+
+        double dx = x[i][0] - x[j][0];
+        double dy = x[i][1] - x[j][1];
+        double dz = x[i][2] - x[j][2];
+
+        double rsq = dx*dx + dy*dy + dz*dz;
+        if (rsq < edge_cutsq[itype][jtype]){
+            const double s2 = periodic_shift[2]*inv_c;
+            const double s1 = (periodic_shift[1] - s2*cellm[2][1])*inv_b;
+            const double s0 = (periodic_shift[0] - s1*cellm[1][0] - s2*cellm[2][0])*inv_a;
+            float * e_vec = &edge_cell_shifts[edge_counter*3];
+            e_vec[0] = std::round(s0);
+            e_vec[1] = std::round(s1);
+            e_vec[2] = std::round(s2);
+
+            // TODO: double check order
+            edges[edge_counter*2] = itag - 1; // tag is probably 1-based
+            edges[edge_counter*2+1] = jtag - 1; // tag is probably 1-based
+            edge_counter++;
+
+            if (debug_mode){
+                printf("%d %d %.10g %.10g %.10g %.10g %.10g %.10g %.10g %.10g %.10g %.10g\n", itag-1, jtag-1,
+                  x[i][0],x[i][1],x[i][2],xjn[0],xjn[1],xjn[2],
+                  e_vec[0],e_vec[1],e_vec[2],sqrt(rsq));
+            }
+
+        }
       }
     }
   }
   if (debug_mode) printf("end PHIN edges\n");
 
+  ncapped = ndropped = 0;
+  if (max_neighbors > 0) edge_counter = cap_neighbors(edge_counter, node2i, cellm);
+  if (ncapped > 0 && !cap_warned) {
+    if (comm->me == 0)
+      error->warning(FLERR, "PHIN max_neighbors truncated the edges of {} atoms; "
+                     "see compute pair phin for statistics", ncapped);
+    cap_warned = 1;
+  }
+
   std::string message = fmt::format("Number of edges equal to {}",edge_counter);
 
   // Could improve this to make it a soft error
@@ -461,25 +902,76 @@ void PairPHIN::compute(int eflag, int vflag){
     // timer->force_timeout();
   }
 
-  // shorten the list before sending to phin
-  torch::Tensor edges_tensor = torch::zeros({2,edge_counter}, torch::TensorOptions().dtype(torch::kInt64));
-  torch::Tensor edge_cell_shifts_tensor = torch::zeros({edge_counter,3});
-  // auto new_edges = edges_tensor.accessor<long, 2>();
-  auto new_edges = edges_tensor.accessor<int64_t, 2>();
-  auto new_edge_cell_shifts = edge_cell_shifts_tensor.accessor<float, 2>();
-  for (int i=0; i<edge_counter; i++){
+  // Optionally order the nodes species-major (spatially blocked within
+  // each species) and hand the per-species node ranges to the model.
+  // From here on node2i follows the new node order.
+  // (autotune may pick the spatial blocking alone, with the edges then
+  // regrouped by receiver)
+  if (sort_species || tune.spatial) {
+    std::vector<int64_t> order = sort_nodes(node2i, node_species.data(), edge_counter, cellm, sort_species);
+    std::vector<int64_t> sorted_species(inum);
+    for (int inode = 0; inode < inum; inode++) sorted_species[inode] = node_species[order[inode]];
+    node_species.swap(sorted_species);
+    if (!sort_species) sort_edges(edge_counter, inum);
+  }
+
+  // Optionally group the edges by receiver node in ascending order, so the
+  // model can aggregate messages with phin::segment_sum over edge_offsets
+  if (edge_offsets_flag) sort_edges(edge_counter, inum);
+
+  // Indices of the short-range edges within the (long-range) edge list
+  if (dual_cutoff) {
+    std::vector<const double *> xnode(inum);
+    std::vector<int> tnode(inum);
+    for (int inode = 0; inode < inum; inode++) {
+      xnode[inode] = x[node2i[inode]];
+      tnode[inode] = type[node2i[inode]];
+    }
+    short_edge_ids.clear();
+    select_short_edges(edge_counter, edges.data(), edge_cell_shifts.data(), xnode.data(),
+                       tnode.data(), cellm, 0, short_edge_ids);
+  }
 
-      // long *e=&edges[i*2];
-      int64_t *e=&edges[i*2];
-      new_edges[0][i] = e[0];
-      new_edges[1][i] = e[1];
+  pvector[0] = edge_counter;
+  pvector[1] = ncandidates;
+  pvector[2] = nrebuilds;
+  pvector[3] = MPI_Wtime() - t_edges;
+  pvector[4] = ncapped;
+  pvector[5] = ndropped;
 
-      float *ev = &edge_cell_shifts[i*3];
-      new_edge_cell_shifts[i][0] = ev[0];
-      new_edge_cell_shifts[i][1] = ev[1];
-      new_edge_cell_shifts[i][2] = ev[2];
+  if (!blend_models.empty()) {
+    compute_blend(edge_counter, node2i, cellm);
+    return;
   }
 
+  // Model inputs, in the final node order
+  // (from_blob does not copy, so take ownership with contiguous()/clone())
+  torch::Tensor pos_tensor = torch::empty({inum, 3});
+  auto pos = pos_tensor.accessor<float, 2>();
+  for (int inode = 0; inode < inum; inode++)
+    for (int k = 0; k < 3; k++) pos[inode][k] = x[node2i[inode]][k];
+  torch::Tensor tag2type_tensor = torch::from_blob(node_species.data(), {inum},
+    torch::TensorOptions().dtype(torch::kInt64)).clone();
+  torch::Tensor cell_tensor = torch::empty({3,3});
+  auto cell = cell_tensor.accessor<float, 2>();
+  for (int a = 0; a < 3; a++)
+    for (int k = 0; k < 3; k++) cell[a][k] = cellm[a][k];
+
+  torch::Tensor species_offsets_tensor, edge_offsets_tensor, short_edge_ids_tensor;
+  if (sort_species)
+    species_offsets_tensor = torch::from_blob(species_offsets.data(), {nspecies+1},
+      torch::TensorOptions().dtype(torch::kInt64)).clone();
+  if (edge_offsets_flag)
+    edge_offsets_tensor = torch::from_blob(edge_offsets.data(), {inum+1},
+      torch::TensorOptions().dtype(torch::kInt64)).clone();
+  if (dual_cutoff)
+    short_edge_ids_tensor = torch::from_blob(short_edge_ids.data(), {(int64_t) short_edge_ids.size()},
+      torch::TensorOptions().dtype(torch::kInt64)).clone();
+
+  // shorten the list before sending to phin
+  torch::Tensor edges_tensor = torch::from_blob(edges.data(), {edge_counter,2},
+    torch::TensorOptions().dtype(torch::kInt64)).t().contiguous();
+  torch::Tensor edge_cell_shifts_tensor = torch::from_blob(edge_cell_shifts.data(), {edge_counter,3}).clone();
 
   c10::Dict<std::string, torch::Tensor> input;
   input.insert("pos", pos_tensor.to(device));
@@ -487,7 +979,33 @@ void PairPHIN::compute(int eflag, int vflag){
   input.insert("edge_cell_shift", edge_cell_shifts_tensor.to(device));
   input.insert("cell", cell_tensor.to(device));
   input.insert("atom_types", tag2type_tensor.to(device));
+  if (sort_species) input.insert("species_offsets", species_offsets_tensor.to(device));
+  if (edge_offsets_flag) input.insert("edge_offsets", edge_offsets_tensor.to(device));
+  if (dual_cutoff) input.insert("short_edge_ids", short_edge_ids_tensor.to(device));
+
+  // state from the previous step, zero (and not valid) for new atoms
+  if (state_ncol > 0) {
+    double **st = fix_state->state;
+    torch::Tensor valid = torch::empty({inum}, torch::TensorOptions().dtype(torch::kBool));
+    bool *v = valid.data_ptr<bool>();
+    for (int inode = 0; inode < inum; inode++) v[inode] = st[node2i[inode]][state_ncol] != 0.0;
+    for (const auto &so : state_outputs) {
+      const int ncol = std::max(so.ncol, 1);
+      torch::Tensor t = so.ncol == 0 ? torch::empty({inum}) : torch::empty({inum, ncol});
+      float *data = t.data_ptr<float>();
+      for (int inode = 0; inode < inum; inode++)
+        for (int k = 0; k < ncol; k++) data[inode*ncol + k] = st[node2i[inode]][so.offset + k];
+      input.insert(so.name + "_state", t.to(device));
+    }
+    input.insert("state_valid", valid.to(device));
+  }
+
+  if (autotune && !tuned) run_autotune(input, node2i, edge_counter, cellm);
+
   std::vector<torch::IValue> input_vector(1, input);
+  last_input = input;
+  hessian_node2i = node2i;
+  hess_grad = hess_pos = torch::Tensor();
 
   if(debug_mode){
     std::cout << "PHIN model input:\n";
@@ -499,9 +1017,33 @@ void PairPHIN::compute(int eflag, int vflag){
   }
 
 
-  auto output = model.forward(input_vector).toGenericDict();
+  c10::Dict<c10::IValue, c10::IValue> output;
+  if (charge_output.empty() && tune.bucket > 0) {
+    std::vector<torch::IValue> padded_vector(1, pad_input(input, tune.bucket));
+    output = model.forward(padded_vector).toGenericDict();
+  } else if (charge_output.empty()) output = model.forward(input_vector).toGenericDict();
+  else {
+    // keep the graph from the positions to the charges for the chain-rule
+    // forces of fix phin/kspace (training mode keeps the force graph too)
+    charge_pos = input.at("pos").detach().clone().requires_grad_(true);
+    charge_cell = input.at("cell").detach().clone().requires_grad_(true);
+    c10::Dict<std::string, torch::Tensor> charge_input = input.copy();
+    charge_input.insert_or_assign("pos", charge_pos);
+    charge_input.insert_or_assign("cell", charge_cell);
+    std::vector<torch::IValue> charge_vector(1, charge_input);
+    torch::AutoGradMode enable_grad(true);
+    output = hess_model.forward(charge_vector).toGenericDict();
+    if (!output.contains(charge_output))
+      error->all(FLERR,"PHIN model did not return the kspace_charges output {}", charge_output);
+    charge_q = output.at(charge_output).toTensor().reshape({-1});
+    if (charge_q.numel() != inum || !charge_q.requires_grad())
+      error->all(FLERR,"PHIN kspace_charges output {} must be [num_atoms] and depend on the positions",
+                 charge_output);
+    charge_node2i = node2i;
+  }
 
-  torch::Tensor forces_tensor = output.at("forces").toTensor().cpu();
+  // (narrow() drops the padding nodes of autotune buckets)
+  torch::Tensor forces_tensor = output.at("forces").toTensor().cpu().narrow(0, 0, inum);
   auto forces = forces_tensor.accessor<float, 2>();
 
   torch::Tensor total_energy_tensor = output.at("total_energy").toTensor().cpu();
@@ -509,13 +1051,23 @@ void PairPHIN::compute(int eflag, int vflag){
   // store the total energy where LAMMPS wants it
   eng_vdwl = total_energy_tensor.data_ptr<float>()[0];
 
-  torch::Tensor atomic_energy_tensor = output.at("atomic_energy").toTensor().cpu();
+  torch::Tensor atomic_energy_tensor = output.at("atomic_energy").toTensor().cpu().narrow(0, 0, inum);
   auto atomic_energies = atomic_energy_tensor.accessor<float, 2>();
   float atomic_energy_sum = atomic_energy_tensor.sum().data_ptr<float>()[0];
-  torch::Tensor uncertainties_tensor = output.at("uncertainties").toTensor().cpu();
+  if (tune.bucket > 0) eng_vdwl = atomic_energy_sum;
+  torch::Tensor uncertainties_tensor = output.at("uncertainties").toTensor().cpu().narrow(0, 0, inum);
   auto uncertainties_itag = uncertainties_tensor.accessor<float, 2>();
 
-  if(vflag){
+  // With edge forces the global and per-atom virials are tallied per edge
+  // below; otherwise only the global virial of the model is available
+  if(edge_forces_flag){
+    if (!output.contains("edge_forces"))
+      error->all(FLERR,"PHIN model does not return edge_forces (pair_style phin edge_forces yes)");
+    torch::Tensor edge_forces_tensor = output.at("edge_forces").toTensor().to(torch::kCPU, torch::kDouble).contiguous();
+    if (edge_forces_tensor.numel() != 3*edge_counter)
+      error->all(FLERR,"PHIN model edge_forces must have shape [num_edges, 3]");
+    if (vflag) tally_edge_forces(edge_counter, node2i, edge_forces_tensor.data_ptr<double>(), cellm);
+  } else if(vflag){
     torch::Tensor v_tensor = output.at("virial").toTensor().cpu();
     auto v = v_tensor.accessor<float, 3>();
     // Convert from 3x3 symmetric tensor format, which NequIP outputs, to the flattened form LAMMPS expects
@@ -527,8 +1079,8 @@ void PairPHIN::compute(int eflag, int vflag){
     virial[4] = v[0][0][2];
     virial[5] = v[0][1][2];
   }
-  if(vflag_atom) {
-    error->all(FLERR,"Pair style NEQUIP does not support per-atom virial");
+  if(vflag_atom && !edge_forces_flag) {
+    error->all(FLERR,"Pair style PHIN needs edge_forces yes for per-atom virial");
   }
 
   if(debug_mode){
@@ -544,15 +1096,64 @@ void PairPHIN::compute(int eflag, int vflag){
   //std::cout << "atomic energy shape: " << atomic_energy_tensor.sizes()[0] << "," << atomic_energy_tensor.sizes()[1] << std::endl;
   //std::cout << "atomic energies: " << atomic_energy_tensor << std::endl;
 
-  // Write forces and per-atom energies (0-based tags here)
-  for(int itag = 0; itag < inum; itag++){
-    int i = tag2i[itag];
-    f[i][0] = forces[itag][0];
-    f[i][1] = forces[itag][1];
-    f[i][2] = forces[itag][2];
-    if (eflag_atom) eatom[i] = atomic_energies[itag][0];
-    uncertainties[i] = uncertainties_itag[itag][0];
-    //printf("%d %d %g %g %g %g %g %g\n", i, type[i], pos[itag][0], pos[itag][1], pos[itag][2], f[i][0], f[i][1], f[i][2]);
+  // Write forces and per-atom energies (graph node order here, i.e. 0-based
+  // tags unless the nodes were reordered)
+  for(int inode = 0; inode < inum; inode++){
+    int i = node2i[inode];
+    f[i][0] = forces[inode][0];
+    f[i][1] = forces[inode][1];
+    f[i][2] = forces[inode][2];
+    if (eflag_atom) eatom[i] = atomic_energies[inode][0];
+    uncertainties[i] = uncertainties_itag[inode][0];
+    if (ugrid) tally_grid(i, uncertainties[i]);
+    //printf("%d %d %g %g %g %g %g %g\n", i, type[i], pos[inode][0], pos[inode][1], pos[inode][2], f[i][0], f[i][1], f[i][2]);
+  }
+
+  // Extra per-atom outputs, only those somebody asked for
+  for (auto &out : peratom_outputs) {
+    if (!out.requested) continue;
+    if (!output.contains(out.name))
+      error->all(FLERR,"PHIN model did not return its per-atom output {}", out.name);
+    torch::Tensor t = output.at(out.name).toTensor().to(torch::kCPU, torch::kDouble);
+    if (tune.bucket > 0) t = t.narrow(0, 0, inum);
+    t = t.contiguous();
+    const int ncol = std::max(out.ncol, 1);
+    if (t.numel() != (int64_t) inum*ncol)
+      error->all(FLERR,"PHIN model per-atom output {} must have shape [num_atoms, {}]", out.name, ncol);
+    const double *data = t.data_ptr<double>();
+    for (int inode = 0; inode < inum; inode++) {
+      const int i = node2i[inode];
+      if (out.ncol == 0) out.vector[i] = data[inode];
+      else std::copy(data + inode*ncol, data + (inode+1)*ncol, out.array[i]);
+    }
+  }
+
+  // Predicted charges for kspace (and any pair style with a Coulomb part),
+  // including the ghost atoms, whose charges otherwise only change when
+  // the atoms are reneighbored
+  if (!charge_output.empty()) {
+    torch::Tensor qt = charge_q.detach().to(torch::kCPU, torch::kDouble).contiguous();
+    const double *qd = qt.data_ptr<double>();
+    for (int inode = 0; inode < inum; inode++) atom->q[node2i[inode]] = qd[inode];
+    comm->forward_comm(this);
+    if (force->kspace) force->kspace->qsum_qsq(0);
+  }
+
+  // Keep the state outputs for the next step
+  if (state_ncol > 0) {
+    double **st = fix_state->state;
+    for (const auto &so : state_outputs) {
+      if (!output.contains(so.name))
+        error->all(FLERR,"PHIN model did not return its state output {}", so.name);
+      torch::Tensor t = output.at(so.name).toTensor().to(torch::kCPU, torch::kDouble).contiguous();
+      const int ncol = std::max(so.ncol, 1);
+      if (t.numel() != (int64_t) inum*ncol)
+        error->all(FLERR,"PHIN model state output {} must have shape [num_atoms, {}]", so.name, ncol);
+      const double *data = t.data_ptr<double>();
+      for (int inode = 0; inode < inum; inode++)
+        std::copy(data + inode*ncol, data + (inode+1)*ncol, st[node2i[inode]] + so.offset);
+    }
+    for (int inode = 0; inode < inum; inode++) st[node2i[inode]][state_ncol] = 1.0;
   }
 
   // TODO: Virial stuff? (If there even is a pairwise force concept here)
@@ -570,6 +1171,1531 @@ void PairPHIN::compute(int eflag, int vflag){
   */
 }
 
+/* ----------------------------------------------------------------------
+   small periodic cells: the nodes are binned in fractional coordinates
+   and every bin offset that can reach the cutoff, including offsets into
+   neighboring lattice images, is enumerated once per box change.
+   Edges are then emitted directly as (i, j, cell shift) triples.
+------------------------------------------------------------------------- */
+
+void PairPHIN::setup_smallcell(const double cellm[3][3])
+{
+  const double lx = cellm[0][0], ly = cellm[1][1], lz = cellm[2][2];
+  const double xy = cellm[1][0], xz = cellm[2][0], yz = cellm[2][1];
+  const double vol = lx*ly*lz;
+
+  // Perpendicular width of the cell along each lattice direction,
+  // i.e. volume over the area of the face spanned by the other two
+  double width[3];
+  width[0] = vol / sqrt(ly*lz*ly*lz + xy*lz*xy*lz + (xy*yz - ly*xz)*(xy*yz - ly*xz));
+  width[1] = vol / sqrt(lz*lx*lz*lx + yz*lx*yz*lx);
+  width[2] = lz;
+
+  int reach[3];
+  for (int d = 0; d < 3; d++) {
+    sc_nbin[d] = std::max(1, static_cast<int>(width[d] / cutoff));
+    // Two points within the cutoff differ by at most cutoff/width[d]
+    // in fractional coordinate d, which may span several images
+    reach[d] = static_cast<int>(ceil(cutoff * sc_nbin[d] / width[d]));
+  }
+
+  sc_stencil.clear();
+  for (int i = -reach[0]; i <= reach[0]; i++)
+    for (int j = -reach[1]; j <= reach[1]; j++)
+      for (int k = -reach[2]; k <= reach[2]; k++)
+        sc_stencil.push_back({i, j, k});
+
+  sc_binstart.assign(sc_nbin[0]*sc_nbin[1]*sc_nbin[2] + 1, 0);
+  memcpy(sc_cell, cellm, sizeof(sc_cell));
+
+  if (debug_mode)
+    printf("PHIN smallcell: %d x %d x %d bins, %d bin offsets\n",
+           sc_nbin[0], sc_nbin[1], sc_nbin[2], (int) sc_stencil.size());
+}
+
+int PairPHIN::build_edges_smallcell(const std::vector<int> &node2i, const double cellm[3][3])
+{
+  double **x = atom->x;
+  int *type = atom->type;
+  const int nnodes = node2i.size();
+  sc_pos.resize(3*nnodes);
+  sc_type.resize(nnodes);
+  for (int a = 0; a < nnodes; a++) {
+    for (int k = 0; k < 3; k++) sc_pos[3*a+k] = x[node2i[a]][k];
+    sc_type[a] = type[node2i[a]];
+  }
+  return build_edges_periodic(nnodes, sc_pos.data(), sc_type.data(), domain->boxlo, cellm);
+}
+
+// Edges of nnodes nodes with positions pos[3*a] and LAMMPS types ptype[a]
+// in the periodic cell with origin boxlo
+int PairPHIN::build_edges_periodic(int nnodes, const double *pos, const int *ptype,
+                                   const double *boxlo, const double cellm[3][3])
+{
+  if (memcmp(cellm, sc_cell, sizeof(sc_cell)) != 0) setup_smallcell(cellm);
+
+  const int nbx = sc_nbin[0], nby = sc_nbin[1];
+
+  // Wrap every node back into the cell, remembering which image it came
+  // from, and count the nodes per bin
+  std::vector<int> nodebin(nnodes);
+  sc_xwrap.resize(3*nnodes);
+  sc_image.resize(3*nnodes);
+  std::fill(sc_binstart.begin(), sc_binstart.end(), 0);
+  for (int a = 0; a < nnodes; a++) {
+    const double *xa = &pos[3*a];
+    const double d[3] = {xa[0] - boxlo[0], xa[1] - boxlo[1], xa[2] - boxlo[2]};
+    double s[3];
+    cart2frac(cellm, d, s);
+
+    int *img = &sc_image[3*a];
+    int b[3];
+    for (int d = 0; d < 3; d++) {
+      img[d] = static_cast<int>(floor(s[d]));
+      b[d] = std::min(static_cast<int>((s[d] - img[d]) * sc_nbin[d]), sc_nbin[d]-1);
+    }
+    sc_xwrap[3*a+0] = xa[0] - img[0]*cellm[0][0] - img[1]*cellm[1][0] - img[2]*cellm[2][0];
+    sc_xwrap[3*a+1] = xa[1] - img[1]*cellm[1][1] - img[2]*cellm[2][1];
+    sc_xwrap[3*a+2] = xa[2] - img[2]*cellm[2][2];
+
+    nodebin[a] = (b[2]*nby + b[1])*nbx + b[0];
+    sc_binstart[nodebin[a]+1]++;
+  }
+
+  // CSR cell list
+  std::partial_sum(sc_binstart.begin(), sc_binstart.end(), sc_binstart.begin());
+  std::vector<int> binfill(sc_binstart.begin(), sc_binstart.end()-1);
+  sc_binatoms.resize(nnodes);
+  for (int a = 0; a < nnodes; a++)
+    sc_binatoms[binfill[nodebin[a]]++] = a;
+
+  edges.clear();
+  edge_cell_shifts.clear();
+  int edge_counter = 0;
+  ncandidates = 0;
+
+  for (int a = 0; a < nnodes; a++) {
+    const int ba = nodebin[a];
+    const int bin[3] = {ba % nbx, (ba / nbx) % nby, ba / (nbx*nby)};
+    const double *xa = &sc_xwrap[3*a];
+    const int *ka = &sc_image[3*a];
+    const double *cutsq_a = edge_cutsq[ptype[a]];
+
+    for (const auto &o : sc_stencil) {
+      // Target bin, split into the lattice image and the bin within the cell
+      int n[3], w[3];
+      for (int d = 0; d < 3; d++) {
+        int g = bin[d] + o[d];
+        n[d] = (g >= 0) ? g / sc_nbin[d] : -((sc_nbin[d] - 1 - g) / sc_nbin[d]);
+        w[d] = g - n[d]*sc_nbin[d];
+      }
+      const bool home = (n[0] == 0 && n[1] == 0 && n[2] == 0);
+      const double tx = n[0]*cellm[0][0] + n[1]*cellm[1][0] + n[2]*cellm[2][0];
+      const double ty = n[1]*cellm[1][1] + n[2]*cellm[2][1];
+      const double tz = n[2]*cellm[2][2];
+
+      const int wb = (w[2]*nby + w[1])*nbx + w[0];
+      ncandidates += sc_binstart[wb+1] - sc_binstart[wb];
+      for (int m = sc_binstart[wb]; m < sc_binstart[wb+1]; m++) {
+        const int c = sc_binatoms[m];
+        if (home && c == a) continue;
+
+        const double *xc = &sc_xwrap[3*c];
+        const double dx = xc[0] + tx - xa[0];
+        const double dy = xc[1] + ty - xa[1];
+        const double dz = xc[2] + tz - xa[2];
+        const double rsq = dx*dx + dy*dy + dz*dz;
+        if (rsq >= cutsq_a[ptype[c]]) continue;
+
+        // Shift relative to the unwrapped positions that go into pos
+        const int *kc = &sc_image[3*c];
+        edges.push_back(a);
+        edges.push_back(c);
+        edge_cell_shifts.push_back(n[0] - kc[0] + ka[0]);
+        edge_cell_shifts.push_back(n[1] - kc[1] + ka[1]);
+        edge_cell_shifts.push_back(n[2] - kc[2] + ka[2]);
+        edge_counter++;
+
+        if (debug_mode) {
+          const double *xi = &pos[3*a], *xj = &pos[3*c];
+          const float *e_vec = &edge_cell_shifts[3*(edge_counter-1)];
+          printf("%d %d %.10g %.10g %.10g %.10g %.10g %.10g %.10g %.10g %.10g %.10g\n", a, c,
+                 xi[0],xi[1],xi[2],xj[0],xj[1],xj[2],
+                 e_vec[0],e_vec[1],e_vec[2],sqrt(rsq));
+        }
+      }
+    }
+  }
+
+  return edge_counter;
+}
+
+/* ----------------------------------------------------------------------
+   internal neighbor builder: a Verlet list of candidate pairs within
+   cutoff + neigh/skin over local and ghost atoms, binned with bins of
+   that size. The cell shift of each ghost is resolved once per build,
+   so every step only re-tests the distance of the stored candidates.
+------------------------------------------------------------------------- */
+
+void PairPHIN::build_neigh_internal(const std::vector<int> &node2i, const double cellm[3][3])
+{
+  double **x = atom->x;
+  tagint *tag = atom->tag;
+  const int nlocal = atom->nlocal;
+  const int nall = nlocal + atom->nghost;
+  int *type = atom->type;
+  const int ntypes = atom->ntypes;
+  const double cutneigh = cutoff + neigh_skin;
+
+  // Candidate cutoff per type pair: edge cutoff plus our own skin
+  std::vector<double> cutneighsq((ntypes+1)*(ntypes+1));
+  for (int it = 1; it <= ntypes; it++)
+    for (int jt = 1; jt <= ntypes; jt++) {
+      const double rc = sqrt(edge_cutsq[it][jt]) + neigh_skin;
+      cutneighsq[it*(ntypes+1) + jt] = rc*rc;
+    }
+
+  // Bounding box of local + ghost atoms, split into bins of at least cutneigh
+  double lo[3], hi[3];
+  for (int d = 0; d < 3; d++) lo[d] = hi[d] = (nall > 0) ? x[0][d] : 0.0;
+  for (int j = 1; j < nall; j++)
+    for (int d = 0; d < 3; d++) {
+      lo[d] = std::min(lo[d], x[j][d]);
+      hi[d] = std::max(hi[d], x[j][d]);
+    }
+  int nbin[3];
+  double bininv[3];
+  for (int d = 0; d < 3; d++) {
+    const double extent = hi[d] - lo[d];
+    nbin[d] = std::max(1, static_cast<int>(extent / cutneigh));
+    bininv[d] = (extent > 0.0) ? nbin[d] / extent : 0.0;
+  }
+
+  std::vector<int> atombin(nall), binstart(nbin[0]*nbin[1]*nbin[2] + 1, 0), binatoms(nall);
+  for (int j = 0; j < nall; j++) {
+    int b[3];
+    for (int d = 0; d < 3; d++)
+      b[d] = std::min(static_cast<int>((x[j][d] - lo[d]) * bininv[d]), nbin[d]-1);
+    atombin[j] = (b[2]*nbin[1] + b[1])*nbin[0] + b[0];
+    binstart[atombin[j]+1]++;
+  }
+  std::partial_sum(binstart.begin(), binstart.end(), binstart.begin());
+  std::vector<int> binfill(binstart.begin(), binstart.end()-1);
+  for (int j = 0; j < nall; j++)
+    binatoms[binfill[atombin[j]]++] = j;
+
+  // Cell shift of every atom relative to the local atom with the same tag
+  std::vector<float> shift(3*nall, 0.0f);
+  for (int j = nlocal; j < nall; j++) {
+    const double *xo = x[node2i[tag[j]-1]];
+    const double d[3] = {x[j][0] - xo[0], x[j][1] - xo[1], x[j][2] - xo[2]};
+    double s[3];
+    cart2frac(cellm, d, s);
+    for (int d = 0; d < 3; d++) shift[3*j+d] = std::round(s[d]);
+  }
+
+  nb_pairs.clear();
+  nb_shifts.clear();
+  for (int i = 0; i < nlocal; i++) {
+    const int bi = atombin[i];
+    const int b[3] = {bi % nbin[0], (bi / nbin[0]) % nbin[1], bi / (nbin[0]*nbin[1])};
+    for (int oz = std::max(b[2]-1, 0); oz <= std::min(b[2]+1, nbin[2]-1); oz++)
+      for (int oy = std::max(b[1]-1, 0); oy <= std::min(b[1]+1, nbin[1]-1); oy++)
+        for (int ox = std::max(b[0]-1, 0); ox <= std::min(b[0]+1, nbin[0]-1); ox++) {
+          const int ob = (oz*nbin[1] + oy)*nbin[0] + ox;
+          for (int m = binstart[ob]; m < binstart[ob+1]; m++) {
+            const int j = binatoms[m];
+            if (j == i) continue;
+            const double dx = x[j][0] - x[i][0];
+            const double dy = x[j][1] - x[i][1];
+            const double dz = x[j][2] - x[i][2];
+            if (dx*dx + dy*dy + dz*dz >= cutneighsq[type[i]*(ntypes+1) + type[j]]) continue;
+            nb_pairs.push_back(i);
+            nb_pairs.push_back(j);
+            nb_shifts.insert(nb_shifts.end(), &shift[3*j], &shift[3*j] + 3);
+          }
+        }
+  }
+
+  if (nlocal > 0) nb_xhold.assign(&x[0][0], &x[0][0] + 3*nlocal);
+  else nb_xhold.clear();
+  nb_nlocal = nlocal;
+  nb_lastcall = neighbor->lastcall;
+  nrebuilds++;
+}
+
+int PairPHIN::build_edges_internal(const std::vector<int> &node2i, const double cellm[3][3])
+{
+  double **x = atom->x;
+  tagint *tag = atom->tag;
+  const int nlocal = atom->nlocal;
+
+  // Rebuild if LAMMPS reneighbored (the ghosts changed), or if any local
+  // atom moved more than half of our own skin since the last build
+  bool rebuild = (neighbor->lastcall != nb_lastcall) || (nlocal != nb_nlocal);
+  const double trigger = 0.25*neigh_skin*neigh_skin;
+  for (int i = 0; i < nlocal && !rebuild; i++) {
+    const double dx = x[i][0] - nb_xhold[3*i+0];
+    const double dy = x[i][1] - nb_xhold[3*i+1];
+    const double dz = x[i][2] - nb_xhold[3*i+2];
+    if (dx*dx + dy*dy + dz*dz > trigger) rebuild = true;
+  }
+  if (rebuild) build_neigh_internal(node2i, cellm);
+
+  int *type = atom->type;
+  const int npairs = nb_pairs.size() / 2;
+  edges.clear();
+  edge_cell_shifts.clear();
+  ncandidates = npairs;
+  int edge_counter = 0;
+
+  for (int p = 0; p < npairs; p++) {
+    const int i = nb_pairs[2*p], j = nb_pairs[2*p+1];
+    const double dx = x[j][0] - x[i][0];
+    const double dy = x[j][1] - x[i][1];
+    const double dz = x[j][2] - x[i][2];
+    const double rsq = dx*dx + dy*dy + dz*dz;
+    if (rsq >= edge_cutsq[type[i]][type[j]]) continue;
+
+    const int itag = tag[i], jtag = tag[j];
+    edges.push_back(itag - 1);
+    edges.push_back(jtag - 1);
+    const float *e_vec = &nb_shifts[3*p];
+    edge_cell_shifts.insert(edge_cell_shifts.end(), e_vec, e_vec + 3);
+    edge_counter++;
+
+    if (debug_mode) {
+      const double *xj = x[node2i[jtag-1]];
+      printf("%d %d %.10g %.10g %.10g %.10g %.10g %.10g %.10g %.10g %.10g %.10g\n", itag-1, jtag-1,
+             x[i][0],x[i][1],x[i][2],xj[0],xj[1],xj[2],
+             e_vec[0],e_vec[1],e_vec[2],sqrt(rsq));
+    }
+  }
+
+  return edge_counter;
+}
+
+/* ----------------------------------------------------------------------
+   keep only the max_neighbors nearest edges of every atom.
+   All edge builders emit the edges of one atom contiguously, so each
+   group is reduced with a partial selection and compacted in place.
+------------------------------------------------------------------------- */
+
+int PairPHIN::cap_neighbors(int nedge, const std::vector<int> &node2i, const double cellm[3][3])
+{
+  double **x = atom->x;
+  std::vector<std::pair<double,int>> group;
+  int nout = 0;
+
+  int first = 0;
+  while (first < nedge) {
+    const int64_t a = edges[2*first];
+    int last = first;
+    while (last < nedge && edges[2*last] == a) last++;
+
+    const int n = last - first;
+    if (n <= max_neighbors) {
+      for (int e = first; e < last; e++, nout++) {
+        if (nout == e) continue;
+        edges[2*nout] = edges[2*e];
+        edges[2*nout+1] = edges[2*e+1];
+        std::copy_n(&edge_cell_shifts[3*e], 3, &edge_cell_shifts[3*nout]);
+      }
+    } else {
+      const double *xa = x[node2i[a]];
+      group.resize(n);
+      for (int e = first; e < last; e++) {
+        const double *xc = x[node2i[edges[2*e+1]]];
+        const float *s = &edge_cell_shifts[3*e];
+        const double dx = xc[0] + s[0]*cellm[0][0] + s[1]*cellm[1][0] + s[2]*cellm[2][0] - xa[0];
+        const double dy = xc[1] + s[1]*cellm[1][1] + s[2]*cellm[2][1] - xa[1];
+        const double dz = xc[2] + s[2]*cellm[2][2] - xa[2];
+        group[e-first] = {dx*dx + dy*dy + dz*dz, e};
+      }
+      // K nearest (ties broken by edge index), then back in edge order
+      std::nth_element(group.begin(), group.begin() + max_neighbors, group.end());
+      std::sort(group.begin(), group.begin() + max_neighbors,
+                [](const std::pair<double,int> &l, const std::pair<double,int> &r) { return l.second < r.second; });
+      // kept indices are ascending and >= first >= nout, so this never overwrites unread edges
+      for (int k = 0; k < max_neighbors; k++, nout++) {
+        const int e = group[k].second;
+        edges[2*nout] = edges[2*e];
+        edges[2*nout+1] = edges[2*e+1];
+        std::copy_n(&edge_cell_shifts[3*e], 3, &edge_cell_shifts[3*nout]);
+      }
+      ncapped++;
+      ndropped += n - max_neighbors;
+    }
+    first = last;
+  }
+
+  if (ncapped > 0 && debug_mode)
+    printf("PHIN max_neighbors: capped %d atoms, dropped %d edges\n", ncapped, ndropped);
+
+  return nout;
+}
+
+/* ----------------------------------------------------------------------
+   order the graph nodes by PHIN species and, within each species, by
+   spatial block (blocks of about the cutoff), so that models can run one
+   contiguous GEMM per species. Edges are renumbered and node2i permuted
+   in place; returns the previous index of every new node. Without
+   by_species the nodes are only blocked spatially (autotune).
+------------------------------------------------------------------------- */
+
+std::vector<int64_t> PairPHIN::sort_nodes(std::vector<int> &node2i, const int64_t *species,
+                                          int nedge, const double cellm[3][3], bool by_species)
+{
+  double **x = atom->x;
+  const double *boxlo = domain->boxlo;
+  const int nnodes = node2i.size();
+
+  int nblk[3];
+  for (int d = 0; d < 3; d++)
+    nblk[d] = std::max(1, static_cast<int>(cellm[d][d] / cutoff));
+  const int64_t nblocks = (int64_t) nblk[0]*nblk[1]*nblk[2];
+
+  std::vector<int64_t> key(nnodes);
+  for (int a = 0; a < nnodes; a++) {
+    const double *xa = x[node2i[a]];
+    const double d[3] = {xa[0] - boxlo[0], xa[1] - boxlo[1], xa[2] - boxlo[2]};
+    double s[3];
+    cart2frac(cellm, d, s);
+    int b[3];
+    for (int k = 0; k < 3; k++)
+      b[k] = std::min(static_cast<int>((s[k] - floor(s[k])) * nblk[k]), nblk[k]-1);
+    key[a] = (by_species ? species[a]*nblocks : 0) + (b[2]*nblk[1] + b[1])*nblk[0] + b[0];
+  }
+
+  // stable, so atoms keep their tag order within a block
+  std::vector<int64_t> order(nnodes);
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(),
+                   [&key](int64_t l, int64_t r) { return key[l] < key[r]; });
+
+  std::vector<int64_t> newidx(nnodes);
+  for (int n = 0; n < nnodes; n++) newidx[order[n]] = n;
+  for (int e = 0; e < 2*nedge; e++) edges[e] = newidx[edges[e]];
+
+  std::vector<int> oldnode2i(node2i);
+  for (int n = 0; n < nnodes; n++) node2i[n] = oldnode2i[order[n]];
+  if (!by_species) return order;
+
+  // node range [species_offsets[s], species_offsets[s+1]) of every species
+  species_offsets.assign(nspecies+1, 0);
+  for (int a = 0; a < nnodes; a++) species_offsets[species[a]+1]++;
+  std::partial_sum(species_offsets.begin(), species_offsets.end(), species_offsets.begin());
+
+  return order;
+}
+
+/* ----------------------------------------------------------------------
+   Hessian of the total energy. The unfrozen model is evaluated once more
+   on the last input with positions that require grad, in training mode so
+   that its forces keep their graph; every Hessian column is then one
+   backward pass through the forces (a Hessian-vector product with a unit
+   vector), so memory stays at one graph whatever the number of atoms.
+------------------------------------------------------------------------- */
+
+void PairPHIN::hessian_setup()
+{
+  if (!hess_model_ok)
+    error->all(FLERR, "PHIN Hessians need a model that was deployed without freezing");
+  if (!last_input.contains("pos"))
+    error->all(FLERR, "PHIN Hessian requested before the forces were computed");
+
+  torch::Tensor pos = last_input.at("pos").detach().clone().requires_grad_(true);
+  c10::Dict<std::string, torch::Tensor> input = last_input.copy();
+  input.insert_or_assign("pos", pos);
+  std::vector<torch::IValue> input_vector(1, input);
+
+  torch::AutoGradMode enable_grad(true);
+  auto output = hess_model.forward(input_vector).toGenericDict();
+  hess_grad = -output.at("forces").toTensor();
+  if (!hess_grad.requires_grad())
+    error->all(FLERR, "PHIN model forces are not differentiable with respect to the positions");
+  hess_pos = pos;
+}
+
+void PairPHIN::hessian_columns(const std::vector<int> &cols, std::vector<double> &out)
+{
+  if (!hess_grad.defined()) hessian_setup();
+
+  const int64_t n = hess_pos.numel();
+  out.resize(cols.size() * n);
+  torch::AutoGradMode enable_grad(true);
+  for (size_t c = 0; c < cols.size(); c++) {
+    torch::Tensor unit = torch::zeros_like(hess_grad);
+    unit.view(-1)[cols[c]] = 1.0;
+    torch::Tensor col = torch::autograd::grad({hess_grad}, {hess_pos}, {unit}, true, false, true)[0];
+    if (!col.defined()) col = torch::zeros_like(hess_pos);
+    col = col.to(torch::kCPU, torch::kDouble).contiguous();
+    std::copy(col.data_ptr<double>(), col.data_ptr<double>() + n, &out[c * n]);
+  }
+}
+
+/* ----------------------------------------------------------------------
+   Batched evaluation of displaced copies of the last configuration. The
+   copies become disjoint graphs of one model input with the usual batch
+   and ptr keys, reusing the edges and cell shifts of the last compute(),
+   which stay valid for displacements well below the neighbor skin.
+------------------------------------------------------------------------- */
+
+void PairPHIN::evaluate_batch(int nconf, const double *pos, std::vector<double> &energies,
+                              std::vector<double> &forces)
+{
+  if (sort_species) error->all(FLERR, "PHIN batched evaluation does not support sort_species");
+  if (!last_input.contains("pos"))
+    error->all(FLERR, "PHIN batched evaluation requested before the forces were computed");
+
+  const torch::Tensor edge_index = last_input.at("edge_index");
+  const int64_t nnode = last_input.at("pos").size(0);
+  const int64_t nedge = edge_index.size(1);
+  const auto long_opts = torch::TensorOptions().dtype(torch::kInt64).device(edge_index.device());
+
+  torch::Tensor pos_tensor = torch::from_blob(const_cast<double *>(pos), {nconf*nnode, 3},
+    torch::TensorOptions().dtype(torch::kFloat64)).to(torch::kFloat32);
+  torch::Tensor node_shift = torch::arange(nconf, long_opts) * nnode;
+
+  torch::Tensor edge_offsets_b;
+  if (last_input.contains("edge_offsets")) {
+    torch::Tensor offsets = last_input.at("edge_offsets");
+    torch::Tensor batched = (offsets.slice(0, 0, -1).unsqueeze(0)
+                             + (torch::arange(nconf, long_opts) * nedge).unsqueeze(1)).reshape({-1});
+    edge_offsets_b = torch::cat({batched, torch::full({1}, nconf*nedge, long_opts)});
+  }
+
+  torch::Tensor short_edge_ids_b;
+  if (last_input.contains("short_edge_ids")) {
+    torch::Tensor ids = last_input.at("short_edge_ids");
+    short_edge_ids_b = (ids.unsqueeze(0) + (torch::arange(nconf, long_opts) * nedge).unsqueeze(1)).reshape({-1});
+  }
+
+  auto output = forward_batch(pos_tensor,
+                              (edge_index.unsqueeze(1) + node_shift.view({1, nconf, 1})).reshape({2, -1}),
+                              last_input.at("edge_cell_shift").repeat({nconf, 1}),
+                              last_input.at("cell").unsqueeze(0).repeat({nconf, 1, 1}),
+                              last_input.at("atom_types").repeat({nconf}),
+                              torch::arange(nconf+1, long_opts) * nnode, edge_offsets_b,
+                              short_edge_ids_b);
+  torch::Tensor e = output.at("total_energy").toTensor().to(torch::kCPU, torch::kDouble).reshape({-1});
+  torch::Tensor f = output.at("forces").toTensor().to(torch::kCPU, torch::kDouble).contiguous();
+  if (e.numel() != nconf || f.numel() != nconf*nnode*3)
+    error->all(FLERR, "PHIN model did not return one energy per configuration; "
+               "it may not support batched (batch/ptr) inputs");
+  energies.assign(e.data_ptr<double>(), e.data_ptr<double>() + nconf);
+  forces.assign(f.data_ptr<double>(), f.data_ptr<double>() + f.numel());
+}
+
+/* ----------------------------------------------------------------------
+   one model call on several disjoint graphs; ptr[k]:ptr[k+1] are the
+   nodes of graph k, and batch holds the graph of every node
+------------------------------------------------------------------------- */
+
+c10::Dict<c10::IValue, c10::IValue> PairPHIN::forward_batch(
+  const torch::Tensor &pos, const torch::Tensor &edge_index, const torch::Tensor &shifts,
+  const torch::Tensor &cell, const torch::Tensor &atom_types, const torch::Tensor &ptr,
+  const torch::Tensor &edge_offsets, const torch::Tensor &short_edge_ids)
+{
+  const int64_t ngraph = ptr.size(0) - 1;
+  torch::Tensor counts = ptr.slice(0, 1) - ptr.slice(0, 0, -1);
+
+  c10::Dict<std::string, torch::Tensor> input;
+  input.insert("pos", pos.to(device));
+  input.insert("edge_index", edge_index.to(device));
+  input.insert("edge_cell_shift", shifts.to(device));
+  input.insert("cell", cell.to(device));
+  input.insert("atom_types", atom_types.to(device));
+  input.insert("batch", torch::repeat_interleave(torch::arange(ngraph, ptr.options()), counts).to(device));
+  input.insert("ptr", ptr.to(device));
+  if (edge_offsets.defined()) input.insert("edge_offsets", edge_offsets.to(device));
+  if (short_edge_ids.defined()) input.insert("short_edge_ids", short_edge_ids.to(device));
+  std::vector<torch::IValue> input_vector(1, input);
+  return model.forward(input_vector).toGenericDict();
+}
+
+/* ----------------------------------------------------------------------
+   independent periodic configurations (e.g. frames of a trajectory),
+   nframes at a time in one model call; edges are built per frame with
+   the small cell builder, so frames of any size and cell are fine
+------------------------------------------------------------------------- */
+
+void PairPHIN::evaluate_frames(const std::vector<Frame> &frames, std::vector<FrameResult> &results)
+{
+  if (!allocated) error->all(FLERR, "PHIN batched evaluation requested before pair_coeff");
+  if (sort_species || max_neighbors > 0 || !blend_models.empty())
+    error->all(FLERR, "PHIN batched evaluation does not support sort_species, max_neighbors or blend");
+
+  const int nframes = frames.size();
+  std::vector<int64_t> all_edges, all_offsets(1, 0), all_short, ptr(1, 0), types;
+  std::vector<float> all_shifts, pos, cells;
+  for (const auto &fr : frames) {
+    const int n = fr.type.size();
+    const int64_t first = ptr.back();
+    const int nedge = build_edges_periodic(n, fr.x.data(), fr.type.data(), fr.origin, fr.cell);
+    for (int e = 0; e < 2*nedge; e++) all_edges.push_back(edges[e] + first);
+    // the builder emits the edges of each receiver together, in node order
+    if (edge_offsets_flag) {
+      std::vector<int64_t> count(n, 0);
+      for (int e = 0; e < nedge; e++) count[edges[2*e]]++;
+      for (int a = 0; a < n; a++) all_offsets.push_back(all_offsets.back() + count[a]);
+    }
+    if (dual_cutoff) {
+      std::vector<const double *> xnode(n);
+      for (int a = 0; a < n; a++) xnode[a] = &fr.x[3*a];
+      select_short_edges(nedge, edges.data(), edge_cell_shifts.data(), xnode.data(), fr.type.data(),
+                         fr.cell, all_edges.size()/2 - nedge, all_short);
+    }
+    all_shifts.insert(all_shifts.end(), edge_cell_shifts.begin(), edge_cell_shifts.begin() + 3*nedge);
+    pos.insert(pos.end(), fr.x.begin(), fr.x.end());
+    for (int a = 0; a < n; a++) {
+      if (type_mapper[fr.type[a]] < 0)
+        error->all(FLERR, "PHIN batched evaluation: atom type {} is not mapped to a model species", fr.type[a]);
+      types.push_back(type_mapper[fr.type[a]]);
+    }
+    for (int r = 0; r < 3; r++)
+      for (int c = 0; c < 3; c++) cells.push_back(fr.cell[r][c]);
+    ptr.push_back(first + n);
+  }
+  const int64_t nnode = ptr.back(), nedge = all_edges.size() / 2;
+  const auto long_opts = torch::TensorOptions().dtype(torch::kInt64);
+
+  auto output = forward_batch(
+    torch::from_blob(pos.data(), {nnode, 3}),
+    torch::from_blob(all_edges.data(), {nedge, 2}, long_opts).t().contiguous(),
+    torch::from_blob(all_shifts.data(), {nedge, 3}).clone(),
+    torch::from_blob(cells.data(), {nframes, 3, 3}).clone(),
+    torch::from_blob(types.data(), {nnode}, long_opts).clone(),
+    torch::from_blob(ptr.data(), {nframes+1}, long_opts).clone(),
+    edge_offsets_flag ? torch::from_blob(all_offsets.data(), {nnode+1}, long_opts).clone()
+                      : torch::Tensor(),
+    dual_cutoff ? torch::from_blob(all_short.data(), {(int64_t) all_short.size()}, long_opts).clone()
+                : torch::Tensor());
+
+  torch::Tensor e = output.at("total_energy").toTensor().to(torch::kCPU, torch::kDouble).reshape({-1});
+  torch::Tensor ea = output.at("atomic_energy").toTensor().to(torch::kCPU, torch::kDouble).reshape({-1});
+  torch::Tensor f = output.at("forces").toTensor().to(torch::kCPU, torch::kDouble).contiguous();
+  torch::Tensor u = output.contains("uncertainties")
+    ? output.at("uncertainties").toTensor().to(torch::kCPU, torch::kDouble).reshape({-1})
+    : torch::zeros({nnode}, torch::kDouble);
+  if (e.numel() != nframes || f.numel() != 3*nnode)
+    error->all(FLERR, "PHIN model did not return one energy per configuration; "
+               "it may not support batched (batch/ptr) inputs");
+
+  results.resize(nframes);
+  for (int k = 0; k < nframes; k++) {
+    const int64_t a0 = ptr[k], a1 = ptr[k+1];
+    FrameResult &r = results[k];
+    r.energy = e.data_ptr<double>()[k];
+    r.atomic_energy.assign(ea.data_ptr<double>() + a0, ea.data_ptr<double>() + a1);
+    r.forces.assign(f.data_ptr<double>() + 3*a0, f.data_ptr<double>() + 3*a1);
+    r.uncertainty.assign(u.data_ptr<double>() + a0, u.data_ptr<double>() + a1);
+  }
+}
+
+/* ----------------------------------------------------------------------
+   TorchScript model from a .phinw file (tools/phin_export.py): the module
+   is stored without its tensors, and every parameter and buffer is set to
+   a tensor over the mapped file, so nothing is copied on CPU.
+------------------------------------------------------------------------- */
+
+torch::jit::Module PairPHIN::load_mapped(const std::string &filename,
+                                         std::unordered_map<std::string, std::string> &metadata)
+{
+  static const std::unordered_map<std::string, torch::ScalarType> dtypes = {
+    {"float32", torch::kFloat32}, {"float64", torch::kFloat64}, {"float16", torch::kFloat16},
+    {"bfloat16", torch::kBFloat16}, {"int64", torch::kInt64}, {"int32", torch::kInt32},
+    {"int8", torch::kInt8}, {"uint8", torch::kUInt8}, {"bool", torch::kBool}};
+
+  try {
+    weight_file.reset(new phin::WeightFile(filename));
+  } catch (std::exception &e) {
+    error->all(FLERR, "PHIN: {}", e.what());
+  }
+
+  const phin::WeightEntry *archive = nullptr;
+  for (const auto &e : weight_file->tensors())
+    if (e.name == "__torchscript__") archive = &e;
+  if (!archive)
+    error->all(FLERR, "PHIN weight file {} holds no TorchScript module; "
+               "write it with tools/phin_export.py", filename);
+
+  MappedStreamBuf buf(static_cast<char *>(archive->data), archive->nbytes);
+  std::istream in(&buf);
+  torch::jit::Module module = torch::jit::load(in, torch::kCPU, metadata);
+
+  for (const auto &e : weight_file->tensors()) {
+    if (&e == archive) continue;
+    torch::Tensor t = torch::from_blob(e.data, e.shape, torch::TensorOptions().dtype(dtypes.at(e.dtype)));
+    // walk down to the submodule that owns the tensor
+    torch::jit::Module owner = module;
+    std::string name = e.name;
+    size_t dot;
+    while ((dot = name.find('.')) != std::string::npos) {
+      owner = owner.attr(name.substr(0, dot)).toModule();
+      name = name.substr(dot + 1);
+    }
+    owner.setattr(name, t);
+  }
+
+  // only CPU tensors can stay in the mapping
+  if (device != torch::kCPU) module.to(device);
+  return module;
+}
+
+/* ----------------------------------------------------------------------
+   blend: atom i has weight w_ik for each further model k, 0/1 from its
+   group or a cosine switch across a shell around the region surface, and
+   the primary model gets w_i0 = 1 - sum_k w_ik. Every model only sees
+   the nodes it weights and their blend_layers-hop neighborhood on the
+   shared edges, which is all their energies depend on. With
+   E = sum_i sum_k w_ik E_ik the forces pick up the switching term
+   -sum_k E_ik grad w_ik, and the virial of each model comes from its
+   gradients with respect to the positions and the cell.
+------------------------------------------------------------------------- */
+
+void PairPHIN::compute_blend(int nedge, const std::vector<int> &node2i, const double cellm[3][3])
+{
+  double **x = atom->x;
+  double **f = atom->f;
+  int *type = atom->type;
+  int *mask = atom->mask;
+  const int nnodes = node2i.size();
+  const int nmodel = blend_models.size() + 1;
+
+  if (vflag_atom) error->all(FLERR,"Pair style PHIN blend does not support per-atom virial");
+  for (const auto &out : peratom_outputs)
+    if (out.requested) error->all(FLERR,"PHIN blend does not provide per-atom output {}", out.name);
+
+  // weights and their gradients, model-major
+  std::vector<double> w((size_t) nmodel*nnodes, 0.0), dw((size_t) 3*nmodel*nnodes, 0.0);
+  for (int k = 1; k < nmodel; k++) {
+    const BlendModel &bm = blend_models[k-1];
+    if (bm.region) bm.region->prematch();
+    for (int a = 0; a < nnodes; a++) {
+      const int i = node2i[a];
+      if (bm.region) w[k*nnodes+a] = blend_weight(bm, x[i], &dw[3*(k*nnodes+a)]);
+      else w[k*nnodes+a] = (mask[i] & bm.groupbit) ? 1.0 : 0.0;
+    }
+  }
+  for (int a = 0; a < nnodes; a++) {
+    double rest = 1.0;
+    for (int k = 1; k < nmodel; k++) {
+      rest -= w[k*nnodes+a];
+      for (int d = 0; d < 3; d++) dw[3*a+d] -= dw[3*(k*nnodes+a)+d];
+    }
+    if (rest < -1.0e-9)
+      error->one(FLERR,"PHIN blend groups or regions overlap at atom {}", atom->tag[node2i[a]]);
+    w[a] = std::max(rest, 0.0);
+  }
+
+  // undirected adjacency of the nodes, for the receptive fields
+  std::vector<int> adjstart(nnodes+1, 0), adj(2*nedge);
+  for (int e = 0; e < 2*nedge; e++) adjstart[edges[e]+1]++;
+  for (int a = 0; a < nnodes; a++) adjstart[a+1] += adjstart[a];
+  std::vector<int> cursor(adjstart.begin(), adjstart.end()-1);
+  for (int e = 0; e < nedge; e++) {
+    adj[cursor[edges[2*e]]++] = edges[2*e+1];
+    adj[cursor[edges[2*e+1]]++] = edges[2*e];
+  }
+
+  for (int a = 0; a < nnodes; a++) {
+    const int i = node2i[a];
+    f[i][0] = f[i][1] = f[i][2] = 0.0;
+    uncertainties[i] = 0.0;
+  }
+  eng_vdwl = 0.0;
+  double v[3][3] = {{0.0}};
+  std::vector<int> sub(nnodes), frontier, next;
+  std::vector<int64_t> sub_edges;
+  std::vector<float> sub_shifts;
+
+  for (int k = 0; k < nmodel; k++) {
+    const double *wk = &w[k*nnodes];
+    const double *dwk = &dw[3*k*nnodes];
+    torch::jit::Module &module = k ? blend_models[k-1].model : hess_model;
+    const int *mapper = k ? blend_models[k-1].type_mapper.data() : type_mapper;
+
+    // nodes this model weights (or whose weight changes), then
+    // blend_layers hops around them
+    std::fill(sub.begin(), sub.end(), -1);
+    frontier.clear();
+    for (int a = 0; a < nnodes; a++)
+      if (wk[a] > 0.0 || dwk[3*a] != 0.0 || dwk[3*a+1] != 0.0 || dwk[3*a+2] != 0.0) {
+        sub[a] = 0;
+        frontier.push_back(a);
+      }
+    if (frontier.empty()) continue;
+    for (int hop = 0; hop < blend_layers && !frontier.empty(); hop++) {
+      next.clear();
+      for (int a : frontier)
+        for (int m = adjstart[a]; m < adjstart[a+1]; m++)
+          if (sub[adj[m]] < 0) {
+            sub[adj[m]] = 0;
+            next.push_back(adj[m]);
+          }
+      frontier.swap(next);
+    }
+    std::vector<int> nodes;
+    for (int a = 0; a < nnodes; a++)
+      if (sub[a] >= 0) {
+        sub[a] = nodes.size();
+        nodes.push_back(a);
+      }
+    const int64_t n = nodes.size();
+
+    sub_edges.clear();
+    sub_shifts.clear();
+    for (int e = 0; e < nedge; e++) {
+      const int r = sub[edges[2*e]], s = sub[edges[2*e+1]];
+      if (r < 0 || s < 0) continue;
+      sub_edges.push_back(r);
+      sub_edges.push_back(s);
+      sub_shifts.insert(sub_shifts.end(), &edge_cell_shifts[3*e], &edge_cell_shifts[3*e+3]);
+    }
+    const int64_t m = sub_edges.size() / 2;
+
+    torch::Tensor pos_t = torch::empty({n, 3});
+    torch::Tensor types_t = torch::empty({n}, torch::TensorOptions().dtype(torch::kInt64));
+    torch::Tensor weight_t = torch::empty({n}, torch::kDouble);
+    torch::Tensor cell_t = torch::empty({3, 3});
+    float *p = pos_t.data_ptr<float>();
+    int64_t *t = types_t.data_ptr<int64_t>();
+    double *wt = weight_t.data_ptr<double>();
+    for (int64_t s = 0; s < n; s++) {
+      const int i = node2i[nodes[s]];
+      for (int d = 0; d < 3; d++) p[3*s+d] = x[i][d];
+      t[s] = mapper[type[i]];
+      wt[s] = wk[nodes[s]];
+    }
+    for (int r = 0; r < 3; r++)
+      for (int c = 0; c < 3; c++) cell_t.data_ptr<float>()[3*r+c] = cellm[r][c];
+
+    torch::AutoGradMode enable_grad(true);
+    torch::Tensor pos_g = pos_t.to(device).requires_grad_(true);
+    torch::Tensor cell_g = cell_t.to(device).requires_grad_(true);
+    c10::Dict<std::string, torch::Tensor> input;
+    input.insert("pos", pos_g);
+    input.insert("edge_index", torch::from_blob(sub_edges.data(), {m, 2},
+      torch::TensorOptions().dtype(torch::kInt64)).t().contiguous().to(device));
+    input.insert("edge_cell_shift", torch::from_blob(sub_shifts.data(), {m, 3}).clone().to(device));
+    input.insert("cell", cell_g);
+    input.insert("atom_types", types_t.to(device));
+    std::vector<torch::IValue> input_vector(1, input);
+    auto output = module.forward(input_vector).toGenericDict();
+
+    torch::Tensor ei = output.at("atomic_energy").toTensor().reshape({-1});
+    torch::Tensor e = (ei.to(torch::kDouble) * weight_t.to(device)).sum();
+    auto grads = torch::autograd::grad({e}, {pos_g, cell_g}, {}, false, false, true);
+
+    torch::Tensor ed = ei.detach().to(torch::kCPU, torch::kDouble).contiguous();
+    torch::Tensor ud = output.at("uncertainties").toTensor().reshape({-1}).to(torch::kCPU, torch::kDouble).contiguous();
+    const double *eptr = ed.data_ptr<double>();
+    const double *uptr = ud.data_ptr<double>();
+    torch::Tensor gpos = grads[0].defined() ? grads[0].to(torch::kCPU, torch::kDouble).contiguous()
+                                            : torch::zeros({n, 3}, torch::kDouble);
+    const double *g = gpos.data_ptr<double>();
+    for (int64_t s = 0; s < n; s++) {
+      const int a = nodes[s];
+      const int i = node2i[a];
+      for (int d = 0; d < 3; d++) {
+        // model forces, then the switching term
+        const double fd = -g[3*s+d] - eptr[s]*dwk[3*a+d];
+        f[i][d] += fd;
+        if (vflag)
+          for (int c = 0; c < 3; c++) v[c][d] += x[i][c]*fd;
+      }
+      if (wt[s] == 0.0) continue;
+      eng_vdwl += wt[s]*eptr[s];
+      if (eflag_atom) eatom[i] += wt[s]*eptr[s];
+      uncertainties[i] += wt[s]*uptr[s];
+    }
+
+    // W = -sum_e r_e dE/dr_e = sum_i x_i F_i - cell^T dE/dcell
+    if (vflag && grads[1].defined()) {
+      torch::Tensor gc = grads[1].to(torch::kCPU, torch::kDouble).contiguous();
+      const double *gcell = gc.data_ptr<double>();
+      for (int c = 0; c < 3; c++)
+        for (int d = 0; d < 3; d++)
+          for (int r = 0; r < 3; r++) v[c][d] -= cellm[r][c]*gcell[3*r+d];
+    }
+  }
+
+  if (vflag) {
+    virial[0] = v[0][0];
+    virial[1] = v[1][1];
+    virial[2] = v[2][2];
+    virial[3] = 0.5*(v[0][1] + v[1][0]);
+    virial[4] = 0.5*(v[0][2] + v[2][0]);
+    virial[5] = 0.5*(v[1][2] + v[2][1]);
+  }
+  if (ugrid)
+    for (int a = 0; a < nnodes; a++) tally_grid(node2i[a], uncertainties[node2i[a]]);
+
+  // no single model input to reuse for Hessians or batched evaluations
+  last_input = c10::Dict<std::string, torch::Tensor>();
+}
+
+// Weight of a region model at xi, from a cosine switch over the signed
+// distance d to the region surface (positive inside): 0 at d <= -width/2,
+// 1 at d >= width/2; grad gets its gradient
+
+double PairPHIN::blend_weight(const BlendModel &bm, const double *xi, double *grad)
+{
+  Region *region = bm.region;
+  const double h = 0.5*bm.width;
+  double xv[3] = {xi[0], xi[1], xi[2]};
+  grad[0] = grad[1] = grad[2] = 0.0;
+
+  const bool inside = region->match(xv[0], xv[1], xv[2]);
+  const int ncontact = inside ? region->surface_interior(xv, h) : region->surface_exterior(xv, h);
+  if (ncontact == 0) return inside ? 1.0 : 0.0;
+  int c = 0;
+  for (int m = 1; m < ncontact; m++)
+    if (region->contact[m].r < region->contact[c].r) c = m;
+  const double r = region->contact[c].r;
+
+  // contact del points from the surface to the atom
+  const double d = inside ? r : -r;
+  const double s = 0.25*MY_PI*(d + h)/h;
+  if (r > 0.0) {
+    const double dwdd = 0.5*MY_PI/h * sin(s)*cos(s) * (inside ? 1.0 : -1.0) / r;
+    grad[0] = dwdd*region->contact[c].delx;
+    grad[1] = dwdd*region->contact[c].dely;
+    grad[2] = dwdd*region->contact[c].delz;
+  }
+  return sin(s)*sin(s);
+}
+
+/* ----------------------------------------------------------------------
+   dedup: find the largest n[d] along each lattice vector such that the
+   translation by a_d / n[d] maps every atom onto an atom of the same
+   type (within dedup_tol). Atoms are hashed by type and quantized
+   fractional coordinates, so every candidate translation costs one
+   lookup per atom and fails at the first atom without an image. The
+   configuration is then exactly periodic in the cell of rows a_d / n[d]
+   and evaluating that cell with the small cell builder gives the same
+   per-atom energies and forces, for any receptive field.
+------------------------------------------------------------------------- */
+
+bool PairPHIN::compute_dedup(const double cellm[3][3])
+{
+  double **x = atom->x;
+  double **f = atom->f;
+  int *type = atom->type;
+  const int natom = atom->nlocal;
+  if (natom < 2) return false;
+
+  // quantization of each fractional coordinate, at most 2^18 steps
+  const double width[3] = {cellm[0][0], cellm[1][1], cellm[2][2]};
+  int64_t Q[3];
+  for (int d = 0; d < 3; d++)
+    Q[d] = std::max<int64_t>(1, std::min<int64_t>(1 << 18, (int64_t) floor(width[d] / dedup_tol)));
+
+  std::vector<double> s(3*natom);
+  for (int i = 0; i < natom; i++) {
+    const double d[3] = {x[i][0] - domain->boxlo[0], x[i][1] - domain->boxlo[1], x[i][2] - domain->boxlo[2]};
+    cart2frac(cellm, d, &s[3*i]);
+    for (int k = 0; k < 3; k++) s[3*i+k] -= floor(s[3*i+k]);
+  }
+  auto key = [&](int t, const int64_t q[3]) {
+    return ((uint64_t) t << 54) | ((uint64_t) q[0] << 36) | ((uint64_t) q[1] << 18) | (uint64_t) q[2];
+  };
+  std::unordered_map<uint64_t, int> grid;
+  grid.reserve(2*natom);
+  for (int i = 0; i < natom; i++) {
+    int64_t q[3];
+    for (int k = 0; k < 3; k++) q[k] = ((int64_t) llround(s[3*i+k] * Q[k])) % Q[k];
+    grid[key(type[i], q)] = i;
+  }
+
+  // atom of type t at fractional position p (any image), or -1
+  auto find = [&](int t, const double p[3]) {
+    double w[3];
+    int64_t q0[3];
+    for (int k = 0; k < 3; k++) {
+      w[k] = p[k] - floor(p[k]);
+      q0[k] = llround(w[k] * Q[k]);
+    }
+    for (int o = 0; o < 27; o++) {
+      const int64_t off[3] = {o % 3 - 1, (o / 3) % 3 - 1, o / 9 - 1};
+      int64_t q[3];
+      for (int k = 0; k < 3; k++) q[k] = ((q0[k] + off[k]) % Q[k] + Q[k]) % Q[k];
+      auto it = grid.find(key(t, q));
+      if (it == grid.end()) continue;
+      double dr[3];
+      for (int k = 0; k < 3; k++) {
+        double ds = s[3*it->second+k] - w[k];
+        ds -= std::round(ds);
+        dr[k] = ds;
+      }
+      const double dx = dr[0]*cellm[0][0] + dr[1]*cellm[1][0] + dr[2]*cellm[2][0];
+      const double dy = dr[1]*cellm[1][1] + dr[2]*cellm[2][1];
+      const double dz = dr[2]*cellm[2][2];
+      if (dx*dx + dy*dy + dz*dz <= dedup_tol*dedup_tol) return it->second;
+    }
+    return -1;
+  };
+
+  int n[3] = {1, 1, 1};
+  for (int d = 0; d < 3; d++) {
+    for (int m = natom; m >= 2; m--) {
+      if (natom % (n[0]*n[1]*n[2]*m) != 0) continue;
+      bool symmetric = true;
+      for (int i = 0; i < natom && symmetric; i++) {
+        double p[3] = {s[3*i], s[3*i+1], s[3*i+2]};
+        p[d] += 1.0 / m;
+        symmetric = find(type[i], p) >= 0;
+      }
+      if (symmetric) {
+        n[d] = m;
+        break;
+      }
+    }
+  }
+  const int factor = n[0]*n[1]*n[2];
+  if (factor != dedup_factor && screen && comm->me == 0)
+    fprintf(screen, "PHIN dedup: configuration repeats %d x %d x %d times\n", n[0], n[1], n[2]);
+  dedup_factor = factor;
+  if (factor == 1) return false;
+
+  // representative of every atom: its image in the first repeat unit
+  std::vector<int> rep_of(natom), node_of(natom, -1), reps;
+  for (int i = 0; i < natom; i++) {
+    double p[3];
+    for (int k = 0; k < 3; k++) p[k] = s[3*i+k] - floor(s[3*i+k] * n[k] + 1.0e-9) / n[k];
+    const int r = find(type[i], p);
+    if (r < 0) return false;
+    rep_of[i] = r;
+    if (node_of[r] < 0) {
+      node_of[r] = reps.size();
+      reps.push_back(r);
+    }
+  }
+  const int nrep = reps.size();
+  if (nrep * factor != natom) return false;
+
+  double cellr[3][3];
+  for (int d = 0; d < 3; d++)
+    for (int k = 0; k < 3; k++) cellr[d][k] = cellm[d][k] / n[d];
+  std::vector<double> rpos(3*nrep);
+  std::vector<int> rtype(nrep);
+  for (int a = 0; a < nrep; a++) {
+    for (int k = 0; k < 3; k++) rpos[3*a+k] = x[reps[a]][k];
+    rtype[a] = type[reps[a]];
+  }
+  const double t_edges = MPI_Wtime();
+  const int nedge = build_edges_periodic(nrep, rpos.data(), rtype.data(), domain->boxlo, cellr);
+  if (nedge == 0) error->all(FLERR,"No Edges Detected");
+
+  const auto long_opts = torch::TensorOptions().dtype(torch::kInt64);
+  std::vector<float> posf(rpos.begin(), rpos.end());
+  std::vector<int64_t> species(nrep);
+  for (int a = 0; a < nrep; a++) species[a] = type_mapper[rtype[a]];
+  std::vector<float> cellf(9);
+  for (int d = 0; d < 3; d++)
+    for (int k = 0; k < 3; k++) cellf[3*d+k] = cellr[d][k];
+
+  c10::Dict<std::string, torch::Tensor> input;
+  input.insert("pos", torch::from_blob(posf.data(), {nrep, 3}).clone().to(device));
+  input.insert("edge_index", torch::from_blob(edges.data(), {nedge, 2}, long_opts).t().contiguous().to(device));
+  input.insert("edge_cell_shift", torch::from_blob(edge_cell_shifts.data(), {nedge, 3}).clone().to(device));
+  input.insert("cell", torch::from_blob(cellf.data(), {3, 3}).clone().to(device));
+  input.insert("atom_types", torch::from_blob(species.data(), {nrep}, long_opts).clone().to(device));
+  if (edge_offsets_flag) {
+    // the builder emits the edges of each receiver together, in node order
+    edge_offsets.assign(nrep+1, 0);
+    for (int e = 0; e < nedge; e++) edge_offsets[edges[2*e]+1]++;
+    std::partial_sum(edge_offsets.begin(), edge_offsets.end(), edge_offsets.begin());
+    input.insert("edge_offsets", torch::from_blob(edge_offsets.data(), {nrep+1}, long_opts).clone().to(device));
+  }
+  if (dual_cutoff) {
+    std::vector<const double *> xnode(nrep);
+    for (int a = 0; a < nrep; a++) xnode[a] = &rpos[3*a];
+    short_edge_ids.clear();
+    select_short_edges(nedge, edges.data(), edge_cell_shifts.data(), xnode.data(), rtype.data(),
+                       cellr, 0, short_edge_ids);
+    input.insert("short_edge_ids", torch::from_blob(short_edge_ids.data(),
+      {(int64_t) short_edge_ids.size()}, long_opts).clone().to(device));
+  }
+  last_input = c10::Dict<std::string, torch::Tensor>();
+  hess_grad = hess_pos = torch::Tensor();
+
+  pvector[0] = nedge;
+  pvector[1] = ncandidates;
+  pvector[2] = nrebuilds;
+  pvector[3] = MPI_Wtime() - t_edges;
+  pvector[4] = pvector[5] = 0;
+
+  std::vector<torch::IValue> input_vector(1, input);
+  auto output = model.forward(input_vector).toGenericDict();
+
+  torch::Tensor forces = output.at("forces").toTensor().to(torch::kCPU, torch::kDouble).contiguous();
+  torch::Tensor energies = output.at("atomic_energy").toTensor().to(torch::kCPU, torch::kDouble).contiguous();
+  torch::Tensor u = output.at("uncertainties").toTensor().to(torch::kCPU, torch::kDouble).contiguous();
+  eng_vdwl = factor * output.at("total_energy").toTensor().to(torch::kCPU, torch::kDouble).item<double>();
+  if (vflag) {
+    torch::Tensor v = output.at("virial").toTensor().to(torch::kCPU, torch::kDouble).reshape({3, 3});
+    auto va = v.accessor<double, 2>();
+    virial[0] = factor * va[0][0];
+    virial[1] = factor * va[1][1];
+    virial[2] = factor * va[2][2];
+    virial[3] = factor * va[0][1];
+    virial[4] = factor * va[0][2];
+    virial[5] = factor * va[1][2];
+  }
+  if (vflag_atom) error->all(FLERR,"Pair style PHIN needs edge_forces yes for per-atom virial");
+
+  const double *fd = forces.data_ptr<double>(), *ed = energies.data_ptr<double>(), *ud = u.data_ptr<double>();
+  for (int i = 0; i < natom; i++) {
+    const int a = node_of[rep_of[i]];
+    for (int k = 0; k < 3; k++) f[i][k] = fd[3*a+k];
+    if (eflag_atom) eatom[i] = ed[a];
+    uncertainties[i] = ud[a];
+    if (ugrid) tally_grid(i, uncertainties[i]);
+  }
+
+  for (auto &out : peratom_outputs) {
+    if (!out.requested) continue;
+    if (!output.contains(out.name))
+      error->all(FLERR,"PHIN model did not return its per-atom output {}", out.name);
+    torch::Tensor t = output.at(out.name).toTensor().to(torch::kCPU, torch::kDouble).contiguous();
+    const int ncol = std::max(out.ncol, 1);
+    if (t.numel() != (int64_t) nrep*ncol)
+      error->all(FLERR,"PHIN model per-atom output {} must have shape [num_atoms, {}]", out.name, ncol);
+    const double *data = t.data_ptr<double>();
+    for (int i = 0; i < natom; i++) {
+      const int a = node_of[rep_of[i]];
+      if (out.ncol == 0) out.vector[i] = data[a];
+      else std::copy(data + a*ncol, data + (a+1)*ncol, out.array[i]);
+    }
+  }
+  return true;
+}
+
+/* ----------------------------------------------------------------------
+   append base + e for every edge e within the short cutoff of its type
+   pair; xnode and tnode are the position and LAMMPS type of each node
+------------------------------------------------------------------------- */
+
+void PairPHIN::select_short_edges(int nedge, const int64_t *edge, const float *shift,
+                                  const double *const *xnode, const int *tnode,
+                                  const double cellm[3][3], int64_t base, std::vector<int64_t> &out)
+{
+  for (int e = 0; e < nedge; e++) {
+    const int64_t a = edge[2*e], b = edge[2*e+1];
+    const float *s = &shift[3*e];
+    double rsq = 0.0;
+    for (int k = 0; k < 3; k++) {
+      const double d = xnode[b][k] + s[0]*cellm[0][k] + s[1]*cellm[1][k] + s[2]*cellm[2][k] - xnode[a][k];
+      rsq += d*d;
+    }
+    if (rsq < short_cutsq[tnode[a]][tnode[b]]) out.push_back(base + e);
+  }
+}
+
+/* ----------------------------------------------------------------------
+   add the uncertainty of local atom i to its bin of the uncertainty grid
+------------------------------------------------------------------------- */
+
+void PairPHIN::tally_grid(int i, double u)
+{
+  if (!(atom->mask[i] & ugrid->groupbit)) return;
+  const double *x = atom->x[i], *lo = domain->boxlo, *h_inv = domain->h_inv;
+  const double d[3] = {x[0] - lo[0], x[1] - lo[1], x[2] - lo[2]};
+  const double s[3] = {h_inv[0]*d[0] + h_inv[5]*d[1] + h_inv[4]*d[2],
+                       h_inv[1]*d[1] + h_inv[3]*d[2], h_inv[2]*d[2]};
+  int b[3];
+  for (int k = 0; k < 3; k++) {
+    // atoms may have drifted out of the box since the last reneighboring
+    const int n = ugrid->nbin[k];
+    b[k] = static_cast<int>(floor((s[k] - floor(s[k])) * n));
+    b[k] = std::min(std::max(b[k], 0), n - 1);
+  }
+  const int bin = (b[2]*ugrid->nbin[1] + b[1])*ugrid->nbin[0] + b[0];
+  ugrid->count[bin] += 1.0;
+  ugrid->sum[bin] += u;
+  ugrid->max[bin] = std::max(ugrid->max[bin], u);
+}
+
+/* ----------------------------------------------------------------------
+   global and per-atom virial from the edge forces g_e = dE/dr_e, with
+   r_e = x_j + shift_e . cell - x_i from receiver i to sender j; the edge
+   pushes i by +g_e and j by -g_e, and each end gets half of -r_e g_e.
+   Both ends are local atoms, so no reverse communication is needed.
+------------------------------------------------------------------------- */
+
+void PairPHIN::tally_edge_forces(int nedge, const std::vector<int> &node2i, const double *g,
+                                 const double cellm[3][3])
+{
+  double **x = atom->x;
+  const int nlocal = atom->nlocal;
+  for (int e = 0; e < nedge; e++) {
+    const int i = node2i[edges[2*e]], j = node2i[edges[2*e+1]];
+    const float *s = &edge_cell_shifts[3*e];
+    double del[3];
+    for (int k = 0; k < 3; k++)
+      del[k] = x[i][k] - x[j][k] - (s[0]*cellm[0][k] + s[1]*cellm[1][k] + s[2]*cellm[2][k]);
+    ev_tally_xyz(i, j, nlocal, 0, 0.0, 0.0, g[3*e], g[3*e+1], g[3*e+2], del[0], del[1], del[2]);
+  }
+}
+
+/* ----------------------------------------------------------------------
+   stable counting sort of the edges by receiver node edge_index[0].
+   Edges of node n end up in [edge_offsets[n], edge_offsets[n+1]).
+------------------------------------------------------------------------- */
+
+void PairPHIN::sort_edges(int nedge, int nnodes)
+{
+  edge_offsets.assign(nnodes+1, 0);
+  for (int e = 0; e < nedge; e++) edge_offsets[edges[2*e]+1]++;
+  std::partial_sum(edge_offsets.begin(), edge_offsets.end(), edge_offsets.begin());
+
+  // the builders emit each node's edges contiguously, usually already in
+  // node order (always without sort_species), so skip the copy if we can
+  bool sorted = true;
+  for (int e = 1; e < nedge && sorted; e++) sorted = edges[2*e-2] <= edges[2*e];
+  if (sorted) return;
+
+  std::vector<int64_t> next(edge_offsets.begin(), edge_offsets.end()-1);
+  std::vector<int64_t> sedges(2*nedge);
+  std::vector<float> sshifts(3*nedge);
+  for (int e = 0; e < nedge; e++) {
+    const int64_t s = next[edges[2*e]]++;
+    sedges[2*s] = edges[2*e];
+    sedges[2*s+1] = edges[2*e+1];
+    for (int k = 0; k < 3; k++) sshifts[3*s+k] = edge_cell_shifts[3*e+k];
+  }
+  std::copy(sedges.begin(), sedges.end(), edges.begin());
+  std::copy(sshifts.begin(), sshifts.end(), edge_cell_shifts.begin());
+}
+
+/* ----------------------------------------------------------------------
+   autotune: at the first compute() without a cached choice, time the
+   model on the live graph, varying one setting at a time and keeping the
+   fastest: intra-op threads (CPU), fusion strategy (each on a clone of
+   the model sharing its tensors, so it is profiled anew), spatial node order, and padding
+   of the edge count to a bucket size. Each timed call drops a few more
+   trailing edges, so that it sees a new edge count as in MD, which is
+   what static fusion and buckets are sensitive to. Padded results are
+   checked against unpadded ones, and timings are maxed over the ranks,
+   so that all ranks make the same choice.
+------------------------------------------------------------------------- */
+
+bool PairPHIN::tune_layout_ok() const
+{
+  // node order and padding only for the plain model inputs
+  return !sort_species && !edge_offsets_flag && !dual_cutoff && state_ncol == 0
+    && charge_output.empty() && !edge_forces_flag;
+}
+
+std::string PairPHIN::tune_key() const
+{
+  char host[256] = "unknown";
+  gethostname(host, sizeof(host)-1);
+  // size class, so that small and large systems are tuned separately
+  int size_class = 0;
+  for (bigint n = atom->natoms; n > 1; n /= 2) size_class++;
+  return fmt::format("{}:{}:{}:{}:torch{}.{}:{}:{}", host, std::thread::hardware_concurrency(),
+                     comm->nprocs, device.str(), TORCH_VERSION_MAJOR, TORCH_VERSION_MINOR,
+                     model_hash, size_class);
+}
+
+std::string PairPHIN::tune_cache_file() const
+{
+  if (!autotune_cache.empty()) return autotune_cache;
+  if (const char *xdg = std::getenv("XDG_CACHE_HOME")) return std::string(xdg) + "/phin_autotune.txt";
+  if (const char *home = std::getenv("HOME")) return std::string(home) + "/.cache/phin_autotune.txt";
+  return "phin_autotune.txt";
+}
+
+bool PairPHIN::tune_lookup()
+{
+  const std::string file = tune_cache_file();
+  if (file == "none") return false;
+  const std::string key = tune_key();
+
+  // one line per tuning, "key threads fusion order bucket"; the last one wins
+  std::ifstream in(file);
+  std::string line;
+  bool found = false;
+  TuneChoice choice;
+  while (std::getline(in, line)) {
+    std::istringstream ls(line);
+    std::string k, order;
+    TuneChoice c;
+    if (!(ls >> k >> c.threads >> c.fusion >> order >> c.bucket) || k != key) continue;
+    c.spatial = order == "spatial";
+    choice = c;
+    found = true;
+  }
+  if (!found) return false;
+
+  if (!tune_layout_ok()) choice.spatial = choice.bucket = 0;
+  tune = choice;
+  if (tune.threads > 0) at::set_num_threads(tune.threads);
+  #if !(TORCH_VERSION_MAJOR == 1 && TORCH_VERSION_MINOR <= 10)
+    torch::jit::setFusionStrategy(parse_fusion_strategy(tune.fusion));
+  #endif
+  if (comm->me == 0)
+    utils::logmesg(lmp, "PHIN autotune: threads {} fusion {} order {} bucket {} (cached in {})\n",
+                   tune.threads, tune.fusion, tune.spatial ? "spatial" : "tag", tune.bucket, file);
+  return true;
+}
+
+// Median time of one call over the inputs, after nwarm calls on the first
+double PairPHIN::time_forward(torch::jit::Module &module,
+                              const std::vector<c10::Dict<std::string, torch::Tensor>> &inputs, int nwarm)
+{
+  std::vector<torch::IValue> warm(1, inputs[0]);
+  for (int k = 0; k < nwarm; k++) module.forward(warm).toGenericDict().at("forces").toTensor().cpu();
+  std::vector<double> t;
+  for (const auto &in : inputs) {
+    std::vector<torch::IValue> iv(1, in);
+    const double t0 = MPI_Wtime();
+    // copying the forces back waits for the device
+    module.forward(iv).toGenericDict().at("forces").toTensor().cpu();
+    t.push_back(MPI_Wtime() - t0);
+  }
+  std::sort(t.begin(), t.end());
+  return t[t.size()/2];
+}
+
+// Two extra nodes, 2 * cutoff apart and joined by as many edges as it
+// takes to reach a multiple of bucket edges; the real nodes see no
+// difference, only outputs summed over the whole graph do
+c10::Dict<std::string, torch::Tensor> PairPHIN::pad_input(const c10::Dict<std::string, torch::Tensor> &input,
+                                                          int bucket) const
+{
+  c10::Dict<std::string, torch::Tensor> padded = input.copy();
+  const torch::Tensor pos = input.at("pos"), types = input.at("atom_types");
+  const torch::Tensor edge_index = input.at("edge_index"), shifts = input.at("edge_cell_shift");
+  const int64_t n = pos.size(0), e = edge_index.size(1);
+  const int64_t npad = (e + bucket - 1) / bucket * bucket - e;
+
+  torch::Tensor dpos = torch::zeros({2, 3}, pos.options());
+  dpos[1][2] = 2.0*cutoff;
+  torch::Tensor dedge = torch::tensor(std::vector<int64_t>{n, n+1}, edge_index.options()).view({2, 1});
+  padded.insert_or_assign("pos", torch::cat({pos, dpos}));
+  padded.insert_or_assign("atom_types", torch::cat({types, torch::zeros({2}, types.options())}));
+  padded.insert_or_assign("edge_index", torch::cat({edge_index, dedge.expand({2, npad})}, 1));
+  padded.insert_or_assign("edge_cell_shift", torch::cat({shifts, torch::zeros({npad, 3}, shifts.options())}));
+  return padded;
+}
+
+void PairPHIN::run_autotune(const c10::Dict<std::string, torch::Tensor> &input,
+                            const std::vector<int> &node2i, int nedge, const double cellm[3][3])
+{
+  typedef c10::Dict<std::string, torch::Tensor> Input;
+  const double t_start = MPI_Wtime();
+  const int nwarm = 3;
+  const bool layout = tune_layout_ok();
+
+  // autotune_steps inputs with 0, 1, 2, ... times a few trailing edges
+  // dropped (only for the plain inputs, where nothing indexes the edges)
+  auto variants = [&](const Input &base, int bucket) {
+    std::vector<Input> out;
+    const int64_t ne = base.at("edge_index").size(1);
+    const int64_t step = layout ? std::max<int64_t>(1, ne / 1000) : 0;
+    for (int v = 0; v < autotune_steps; v++) {
+      Input in = base.copy();
+      const int64_t keep = std::max<int64_t>(0, ne - v*step);
+      in.insert_or_assign("edge_index", base.at("edge_index").narrow(1, 0, keep));
+      in.insert_or_assign("edge_cell_shift", base.at("edge_cell_shift").narrow(0, 0, keep));
+      out.push_back(bucket > 0 ? pad_input(in, bucket) : in);
+    }
+    return out;
+  };
+  // the slowest rank decides
+  auto fastest = [&](std::vector<double> &t) {
+    MPI_Allreduce(MPI_IN_PLACE, t.data(), t.size(), MPI_DOUBLE, MPI_MAX, world);
+    return (int) (std::min_element(t.begin(), t.end()) - t.begin());
+  };
+
+  const std::vector<Input> base = variants(input, 0);
+  std::vector<double> t(1, time_forward(model, base, nwarm));
+  fastest(t);
+  const double t_default = t[0];
+  double t_best = t_default;
+
+  // intra-op threads, powers of two up to the current number
+  if (device.is_cpu()) {
+    const int nmax = at::get_num_threads();
+    std::vector<int> cands;
+    for (int n = 1; n < nmax; n *= 2) cands.push_back(n);
+    cands.push_back(nmax);
+    t.clear();
+    for (int n : cands) {
+      at::set_num_threads(n);
+      t.push_back(time_forward(model, base, 1));
+    }
+    const int k = fastest(t);
+    tune.threads = cands[k];
+    at::set_num_threads(tune.threads);
+    t_best = t[k];
+  }
+
+  #if !(TORCH_VERSION_MAJOR == 1 && TORCH_VERSION_MINOR <= 10)
+  {
+    std::vector<std::string> cands = {tune.fusion};
+    for (const char *c : {"DYNAMIC,3", "STATIC,2", "STATIC,2;DYNAMIC,10", "DYNAMIC,10"})
+      if (std::find(cands.begin(), cands.end(), c) == cands.end()) cands.push_back(c);
+    // a clone has its own graph executors, so it is profiled anew under the
+    // strategy; clone(true) shares the (possibly mapped) tensors, and only
+    // the fastest clone so far is kept
+    torch::jit::Module best = model;
+    double t_fusion = HUGE_VAL;
+    for (const auto &c : cands) {
+      torch::jit::setFusionStrategy(parse_fusion_strategy(c));
+      torch::jit::Module candidate = model.clone(true);
+      std::vector<double> tc(1, time_forward(candidate, base, nwarm));
+      fastest(tc);
+      if (tc[0] < t_fusion) {
+        t_fusion = tc[0];
+        tune.fusion = c;
+        best = candidate;
+      }
+    }
+    torch::jit::setFusionStrategy(parse_fusion_strategy(tune.fusion));
+    model = best;
+    t_best = t_fusion;
+  }
+  #endif
+
+  if (layout) {
+    // nodes in spatial blocks; the edge buffers are put back afterwards
+    std::vector<int64_t> saved_edges(edges.begin(), edges.begin() + 2*nedge);
+    std::vector<float> saved_shifts(edge_cell_shifts.begin(), edge_cell_shifts.begin() + 3*nedge);
+    std::vector<int> spatial_node2i(node2i);
+    torch::Tensor types = input.at("atom_types").cpu().contiguous();
+    std::vector<int64_t> order = sort_nodes(spatial_node2i, types.data_ptr<int64_t>(), nedge, cellm, false);
+    sort_edges(nedge, node2i.size());
+    torch::Tensor order_tensor = torch::from_blob(order.data(), {(int64_t) order.size()},
+      torch::TensorOptions().dtype(torch::kInt64)).to(device);
+    Input spatial = input.copy();
+    spatial.insert_or_assign("pos", input.at("pos").index_select(0, order_tensor));
+    spatial.insert_or_assign("atom_types", input.at("atom_types").index_select(0, order_tensor));
+    spatial.insert_or_assign("edge_index", torch::from_blob(edges.data(), {nedge, 2},
+      torch::TensorOptions().dtype(torch::kInt64)).t().contiguous().to(device));
+    spatial.insert_or_assign("edge_cell_shift", torch::from_blob(edge_cell_shifts.data(), {nedge, 3}).clone().to(device));
+    std::copy(saved_edges.begin(), saved_edges.end(), edges.begin());
+    std::copy(saved_shifts.begin(), saved_shifts.end(), edge_cell_shifts.begin());
+
+    t = {t_best, time_forward(model, variants(spatial, 0), nwarm)};
+    tune.spatial = fastest(t);
+    t_best = t[tune.spatial];
+    const Input &best = tune.spatial ? spatial : input;
+
+    // edge buckets, where the padded result matches the unpadded one
+    std::vector<torch::IValue> full(1, best);
+    auto ref = model.forward(full).toGenericDict();
+    torch::Tensor ref_f = ref.at("forces").toTensor().to(torch::kCPU, torch::kDouble);
+    const double ref_e = ref.at("total_energy").toTensor().to(torch::kCPU, torch::kDouble).sum().item<double>();
+    const int64_t n = ref_f.size(0);
+    const double fscale = 1.0 + ref_f.abs().max().item<double>();
+    const std::vector<int> cands = {0, 64, 256, 1024, 4096};
+    t = {t_best};
+    for (size_t c = 1; c < cands.size(); c++) {
+      std::vector<torch::IValue> padded(1, pad_input(best, cands[c]));
+      auto out = model.forward(padded).toGenericDict();
+      torch::Tensor f = out.at("forces").toTensor().to(torch::kCPU, torch::kDouble).narrow(0, 0, n);
+      const double e = out.at("atomic_energy").toTensor().to(torch::kCPU, torch::kDouble).narrow(0, 0, n).sum().item<double>();
+      const bool same = (f - ref_f).abs().max().item<double>() <= 1.0e-4*fscale
+        && fabs(e - ref_e) <= 1.0e-5*(1.0 + fabs(ref_e));
+      t.push_back(same ? time_forward(model, variants(best, cands[c]), nwarm) : HUGE_VAL);
+    }
+    const int k = fastest(t);
+    tune.bucket = cands[k];
+    t_best = t[k];
+  }
+
+  if (comm->me == 0) {
+    utils::logmesg(lmp, "PHIN autotune: threads {} fusion {} order {} bucket {}: {:.3f} ms per call, "
+                   "{:.2f}x faster than before tuning ({:.1f} s of tuning)\n",
+                   tune.threads, tune.fusion.empty() ? "-" : tune.fusion, tune.spatial ? "spatial" : "tag",
+                   tune.bucket, 1000.0*t_best, t_default / t_best, MPI_Wtime() - t_start);
+    const std::string file = tune_cache_file();
+    if (file != "none") {
+      std::ofstream out(file, std::ios::app);
+      if (out)
+        out << tune_key() << " " << tune.threads << " " << (tune.fusion.empty() ? "-" : tune.fusion)
+            << " " << (tune.spatial ? "spatial" : "tag") << " " << tune.bucket << "\n";
+      else error->warning(FLERR, "PHIN autotune: cannot write the cache file {}", file);
+    }
+  }
+  tuned = 1;
+}
+
+/* ----------------------------------------------------------------------
+   chain-rule forces of kspace_charges: with phi_i = dE_coul/dq_i from
+   fix phin/kspace, add -sum_i phi_i dq_i/dx_j to every atom j, by one
+   backward pass through the charges of the last compute(). Their virial
+   is -d(sum_i phi_i q_i)/d(strain), from the same pass with the cell as
+   in compute_blend(): W = sum_j x_j F_j - cell^T d(phi.q)/dcell
+------------------------------------------------------------------------- */
+
+void PairPHIN::charge_forces(const double *phi, double *vcharge)
+{
+  if (!charge_q.defined()) error->all(FLERR, "PHIN charge forces requested before the charges were computed");
+
+  const int64_t n = charge_node2i.size();
+  torch::Tensor phi_tensor = torch::empty({n}, torch::kDouble);
+  double *p = phi_tensor.data_ptr<double>();
+  for (int64_t inode = 0; inode < n; inode++) p[inode] = phi[charge_node2i[inode]];
+
+  torch::AutoGradMode enable_grad(true);
+  auto grads = torch::autograd::grad({charge_q}, {charge_pos, charge_cell},
+    {phi_tensor.to(charge_q.device(), charge_q.scalar_type())}, false, false, true);
+  charge_q = charge_pos = charge_cell = torch::Tensor();
+
+  double v[3][3] = {{0.0, 0.0, 0.0}, {0.0, 0.0, 0.0}, {0.0, 0.0, 0.0}};
+  if (grads[0].defined()) {
+    torch::Tensor g = grads[0].to(torch::kCPU, torch::kDouble).contiguous();
+    const double *gd = g.data_ptr<double>();
+    double **x = atom->x;
+    double **f = atom->f;
+    for (int64_t inode = 0; inode < n; inode++) {
+      const int i = charge_node2i[inode];
+      for (int d = 0; d < 3; d++) {
+        f[i][d] -= gd[3*inode + d];
+        for (int c = 0; c < 3; c++) v[c][d] -= x[i][c]*gd[3*inode + d];
+      }
+    }
+  }
+  if (!vcharge) return;
+
+  if (grads[1].defined()) {
+    const double cellm[3][3] = {
+      {domain->boxhi[0] - domain->boxlo[0], 0.0, 0.0},
+      {domain->xy, domain->boxhi[1] - domain->boxlo[1], 0.0},
+      {domain->xz, domain->yz, domain->boxhi[2] - domain->boxlo[2]}};
+    torch::Tensor gc = grads[1].to(torch::kCPU, torch::kDouble).contiguous();
+    const double *gcell = gc.data_ptr<double>();
+    for (int c = 0; c < 3; c++)
+      for (int d = 0; d < 3; d++)
+        for (int r = 0; r < 3; r++) v[c][d] -= cellm[r][c]*gcell[3*r+d];
+  }
+  vcharge[0] = v[0][0];
+  vcharge[1] = v[1][1];
+  vcharge[2] = v[2][2];
+  vcharge[3] = 0.5*(v[0][1] + v[1][0]);
+  vcharge[4] = 0.5*(v[0][2] + v[2][0]);
+  vcharge[5] = 0.5*(v[1][2] + v[2][1]);
+}
+
+int PairPHIN::pack_forward_comm(int n, int *list, double *buf, int /*pbc_flag*/, int * /*pbc*/)
+{
+  double *q = atom->q;
+  for (int k = 0; k < n; k++) buf[k] = q[list[k]];
+  return n;
+}
+
+void PairPHIN::unpack_forward_comm(int n, int first, double *buf)
+{
+  double *q = atom->q;
+  for (int k = 0; k < n; k++) q[first + k] = buf[k];
+}
+
 void *PairPHIN::extract_peratom(const char *str, int &ncol)
 {
   if (strcmp(str,"uncertainties") == 0) {
@@ -577,6 +2703,14 @@ void *PairPHIN::extract_peratom(const char *str, int &ncol)
     return (void *) uncertainties;
   }
 
+  // asking for an output is what makes compute() copy it
+  for (auto &out : peratom_outputs) {
+    if (out.name != str) continue;
+    out.requested = 1;
+    ncol = out.ncol;
+    return out.ncol == 0 ? (void *) out.vector : (void *) out.array;
+  }
+
   return nullptr;
 }
 
@@ -24,6 +24,14 @@ PairStyle(phin,PairPHIN)
 
 #include <torch/torch.h>
 
+#include <array>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace phin { class WeightFile; }
+
 namespace LAMMPS_NS {
 
 class PairPHIN : public Pair {
@@ -40,17 +48,232 @@ class PairPHIN : public Pair {
 
   double cutoff;
   double *uncertainties;
+
+  // Extra per-atom outputs declared by the model metadata key
+  // per_atom_outputs ("name" or "name:ncol" entries); only those that
+  // were asked for through extract_peratom() are copied out each step
+  struct PerAtomOutput {
+    std::string name;
+    int ncol;                  // 0 for one value per atom
+    int requested = 0;
+    double *vector = nullptr;
+    double **array = nullptr;
+  };
+  std::vector<PerAtomOutput> peratom_outputs;
+
+  // Running per-bin count, sum and maximum of the uncertainties of the
+  // atoms in groupbit, on an nbin[0] x nbin[1] x nbin[2] grid in
+  // fractional box coordinates; filled while the uncertainties are
+  // written, reduced and reset by compute phin/grid
+  struct UncertaintyGrid {
+    int nbin[3];
+    int groupbit;
+    int nsteps = 0;
+    std::vector<double> count, sum, max;
+  };
+  UncertaintyGrid *ugrid = nullptr;    // owned by the compute
+
+  // Per-atom state (metadata state_outputs, "name" or "name:ncol"): each
+  // output is handed back to the model as input <name>_state on the next
+  // step, with state_valid marking atoms that have one; stored in fix
+  // PHIN_STATE so it moves with the atoms
+  struct StateOutput {
+    std::string name;
+    int ncol;                  // 0 for one value per atom
+    int offset;                // first column in the fix
+  };
+  std::vector<StateOutput> state_outputs;
+  int state_ncol = 0;
+  class FixPHINState *fix_state = nullptr;
+
+  // Charges output of the model written into atom->q every step
+  // (pair_style keyword kspace_charges) for kspace and Coulomb pair
+  // styles; fix phin/kspace feeds dE_coul/dq back through charge_forces(),
+  // which also returns the virial of those forces if vcharge is not null
+  std::string charge_output;
+  void charge_forces(const double *phi, double *vcharge = nullptr);
   double tlimit();
   torch::jit::Module model;
   torch::Device device = torch::kCPU;
   void *extract_peratom(const char *, int &) override;
+  int pack_forward_comm(int, int *, double *, int, int *) override;
+  void unpack_forward_comm(int, int, double *) override;
   double value, tratio;
+
+  // Second derivatives of the total energy at the configuration of the
+  // last compute(), by double backward through the model. Columns are
+  // 3*node + direction; graph node n is atom hessian_node2i[n].
+  void hessian_setup();
+  void hessian_columns(const std::vector<int> &cols, std::vector<double> &out);
+  std::vector<int> hessian_node2i;
+
+  // Energies [nconf] and forces [nconf, nnode, 3] of nconf configurations
+  // with node positions pos [nconf, nnode, 3] on the graph of the last
+  // compute(), evaluated in batched model calls (for small displacements)
+  void evaluate_batch(int nconf, const double *pos, std::vector<double> &energies,
+                      std::vector<double> &forces);
+
+  // Independent periodic configurations: positions x [natom, 3], LAMMPS
+  // types, cell rows a, b, c and the cell origin
+  struct Frame {
+    std::vector<double> x;
+    std::vector<int> type;
+    double cell[3][3];
+    double origin[3];
+  };
+  struct FrameResult {
+    double energy;
+    std::vector<double> atomic_energy, forces, uncertainty;
+  };
+  void evaluate_frames(const std::vector<Frame> &frames, std::vector<FrameResult> &results);
   
  protected:
   int nmax;    // allocated size of per-atom arrays
   int * type_mapper;
+  double **edge_cutsq;   // squared edge cutoff per LAMMPS type pair
+
+  // dual cutoff (metadata long_range_cutoff): edges go up to the long
+  // cutoff, and short_edge_ids selects those within short_cutsq
+  int dual_cutoff = 0;
+  double **short_cutsq;
+  std::vector<int64_t> short_edge_ids;
+  void select_short_edges(int nedge, const int64_t *edge, const float *shift,
+                          const double *const *xnode, const int *tnode,
+                          const double cellm[3][3], int64_t base, std::vector<int64_t> &out);
   int debug_mode = 0;
 
+  // edge buffers, reused between steps: (i, j) node pairs and cell shifts
+  std::vector<int64_t> edges;
+  std::vector<float> edge_cell_shifts;
+
+  // small periodic cells: build edges from lattice images of the local
+  // atoms instead of from the LAMMPS ghost neighbor list
+  int smallcell = 0;
+  int sc_nbin[3];                              // bins along each lattice vector
+  double sc_cell[3][3];                        // cell the stencil was built for
+  std::vector<std::array<int,3>> sc_stencil;   // bin offsets within the cutoff
+  std::vector<int> sc_binstart, sc_binatoms;   // CSR cell list of nodes
+  std::vector<double> sc_xwrap;                // node positions wrapped into the cell
+  std::vector<int> sc_image;                   // lattice image each node was wrapped from
+  void setup_smallcell(const double cellm[3][3]);
+  std::vector<double> sc_pos;                  // node positions and LAMMPS types
+  std::vector<int> sc_type;
+  int build_edges_smallcell(const std::vector<int> &node2i, const double cellm[3][3]);
+  int build_edges_periodic(int nnodes, const double *pos, const int *ptype,
+                           const double *boxlo, const double cellm[3][3]);
+
+  // internal Verlet list over local+ghost atoms, kept in edge format
+  // with its own (small) skin instead of the LAMMPS neighbor list
+  int neigh_internal = 0;
+  double neigh_skin = 0.0;
+  bigint nb_lastcall = -1;             // LAMMPS reneighboring the list belongs to
+  int nb_nlocal = 0;
+  std::vector<int> nb_pairs;           // candidate (i, j) atom index pairs
+  std::vector<float> nb_shifts;        // cell shift of each candidate j
+  std::vector<double> nb_xhold;        // local positions at the last build
+  void build_neigh_internal(const std::vector<int> &node2i, const double cellm[3][3]);
+  int build_edges_internal(const std::vector<int> &node2i, const double cellm[3][3]);
+
+  // keep at most this many nearest edges per atom (0 = no cap);
+  // from the pair style keyword, else from the model metadata
+  int max_neighbors = 0;
+  int max_neighbors_keyword = -1;
+  int ncapped = 0, ndropped = 0;
+  int cap_warned = 0;
+  int cap_neighbors(int nedge, const std::vector<int> &node2i, const double cellm[3][3]);
+
+  // evaluate configurations that repeat along the lattice vectors on one
+  // repeat unit (smallcell only); dedup_factor is the number of repeats
+  int dedup = 0;
+  double dedup_tol = 1.0e-6;
+  int dedup_factor = 1;
+  bool compute_dedup(const double cellm[3][3]);
+
+  // further models from pair_coeff ... blend, each weighted on a group or
+  // on a region with a switching shell; the primary model gets the rest
+  struct BlendModel {
+    std::string file;
+    torch::jit::Module model;          // unfrozen, in training mode
+    std::vector<int> type_mapper;      // LAMMPS type -> species of this model
+    std::string group_id, region_id;
+    int groupbit = 0;
+    class Region *region = nullptr;
+    double width = 0.0;                // of the switching shell
+  };
+  std::vector<BlendModel> blend_models;
+  int blend_layers = 0;                // receptive field, in edges
+  void compute_blend(int nedge, const std::vector<int> &node2i, const double cellm[3][3]);
+  double blend_weight(const BlendModel &bm, const double *xi, double *grad);
+
+  // order nodes species-major and pass species_offsets to the model
+  int sort_species = 0;
+  int nspecies = 0;
+  std::vector<int64_t> species_offsets;
+  std::vector<int64_t> sort_nodes(std::vector<int> &node2i, const int64_t *species,
+                                  int nedge, const double cellm[3][3], bool by_species = true);
+
+  // the model also returns edge_forces dE/dr_e [num_edges, 3], from which
+  // the global and per-atom virials are tallied
+  int edge_forces_flag = 0;
+  void tally_grid(int i, double u);
+  void tally_edge_forces(int nedge, const std::vector<int> &node2i, const double *g,
+                         const double cellm[3][3]);
+
+  // order edges by receiver edge_index[0] and pass edge_offsets to the model
+  int edge_offsets_flag = 0;
+  std::vector<int64_t> edge_offsets;
+  void sort_edges(int nedge, int nnodes);
+
+  // .phinw file whose mapped tensors the TorchScript model uses in place
+  std::unique_ptr<phin::WeightFile> weight_file;
+  torch::jit::Module load_mapped(const std::string &filename,
+                                 std::unordered_map<std::string, std::string> &metadata);
+
+  // model input of the last compute(), and the energy gradient built
+  // from it with create_graph for hessian_columns()
+  c10::Dict<std::string, torch::Tensor> last_input;
+  torch::Tensor hess_pos, hess_grad;
+  torch::Tensor charge_q, charge_pos, charge_cell;
+  std::vector<int> charge_node2i;
+  c10::Dict<c10::IValue, c10::IValue> forward_batch(
+    const torch::Tensor &pos, const torch::Tensor &edge_index, const torch::Tensor &shifts,
+    const torch::Tensor &cell, const torch::Tensor &atom_types, const torch::Tensor &ptr,
+    const torch::Tensor &edge_offsets = torch::Tensor(),
+    const torch::Tensor &short_edge_ids = torch::Tensor());
+  // the model before freezing (no copy, it shares the frozen model's
+  // tensors), in training mode, so its forces keep their graph
+  torch::jit::Module hess_model;
+  bool hess_model_ok = false;
+
+  // startup tuning of intra-op threads, fusion strategy, node order and
+  // edge bucket size on the live graph, cached per machine and model
+  int autotune = 0;
+  int autotune_steps = 5;
+  std::string autotune_cache;          // file; empty for the default, "none" for no cache
+  std::string model_hash;
+  int tuned = 0;
+  struct TuneChoice {
+    int threads = 0;                   // 0 = leave as is
+    std::string fusion;                // "DYNAMIC,3", "STATIC,2;DYNAMIC,10", ...
+    int spatial = 0;                   // nodes in spatial blocks instead of tag order
+    int bucket = 0;                    // pad the edges to a multiple of this
+  };
+  TuneChoice tune;
+  bool tune_layout_ok() const;
+  std::string tune_key() const;
+  std::string tune_cache_file() const;
+  bool tune_lookup();
+  void run_autotune(const c10::Dict<std::string, torch::Tensor> &input,
+                    const std::vector<int> &node2i, int nedge, const double cellm[3][3]);
+  double time_forward(torch::jit::Module &module,
+                      const std::vector<c10::Dict<std::string, torch::Tensor>> &inputs, int nwarm);
+  c10::Dict<std::string, torch::Tensor> pad_input(const c10::Dict<std::string, torch::Tensor> &input,
+                                                  int bucket) const;
+
+  // edge statistics for this step, see pvector
+  bigint ncandidates = 0;
+  int nrebuilds = 0;
+
 };
 
 }
@@ -0,0 +1,959 @@
+/* ----------------------------------------------------------------------
+   Custom TorchScript operators shipped with pair_style phin.
+
+   This file does not depend on LAMMPS, so it can also be built on its
+   own as a PyTorch extension (see tests/test_phin_ops.py).
+
+   Every operator has a fused, vectorized and threaded CPU kernel for the
+   forward and the backward pass. Tensors on other devices, and double
+   backward (create_graph=True), fall back to differentiating the
+   reference composition of plain torch operations.
+------------------------------------------------------------------------- */
+
+#include "phin_ops.h"
+
+#include <ATen/Parallel.h>
+#include <ATen/cpu/vec/vec.h>
+#include <torch/script.h>
+#include <torch/torch.h>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <numeric>
+#include <tuple>
+#include <vector>
+
+using torch::Tensor;
+using torch::autograd::AutogradContext;
+using torch::autograd::variable_list;
+
+namespace phin {
+
+void ops_linked() {}
+
+namespace {
+
+// Edges per parallel_for chunk
+constexpr int64_t EDGE_GRAIN = 1024;
+
+// Inputs that need a graph for the reference backward: keep the original
+// when building a double-backward graph through it, else a detached leaf
+Tensor track(const Tensor &t, bool create_graph)
+{
+  if (create_graph && t.requires_grad()) return t;
+  return t.detach().requires_grad_(true);
+}
+
+/* ----------------------------------------------------------------------
+   radial basis: Bessel functions times the polynomial cutoff envelope
+
+     out[e,k] = 2/r_max * sin(w_k x_e) / r_e * u(x_e),   x_e = r_e / r_max
+     u(x) = 1 - (p+1)(p+2)/2 x^p + p(p+2) x^(p+1) - p(p+1)/2 x^(p+2)
+
+   with u(x) = 0 for x >= 1.
+------------------------------------------------------------------------- */
+
+Tensor radial_basis_reference(const Tensor &r, const Tensor &weights, double r_max, int64_t p)
+{
+  const double pd = p;
+  Tensor x = r / r_max;
+  Tensor basis = (2.0 / r_max) * torch::sin(weights.unsqueeze(0) * x.unsqueeze(-1)) / r.unsqueeze(-1);
+  Tensor envelope = 1.0 - ((pd + 1.0) * (pd + 2.0) / 2.0) * torch::pow(x, pd)
+    + (pd * (pd + 2.0)) * torch::pow(x, pd + 1.0)
+    - (pd * (pd + 1.0) / 2.0) * torch::pow(x, pd + 2.0);
+  envelope = envelope * (x < 1.0);
+  return basis * envelope.unsqueeze(-1);
+}
+
+// Envelope u(x) and du/dx
+template <typename scalar_t>
+inline void poly_cutoff(scalar_t x, int64_t p, scalar_t &u, scalar_t &du)
+{
+  if (x >= 1) {
+    u = du = 0;
+    return;
+  }
+  const scalar_t pd = p;
+  const scalar_t xpm1 = std::pow(x, pd - 1);
+  const scalar_t xp = xpm1 * x;
+  u = 1 - (pd + 1) * (pd + 2) / 2 * xp + pd * (pd + 2) * xp * x - pd * (pd + 1) / 2 * xp * x * x;
+  du = -pd * (pd + 1) * (pd + 2) / 2 * xpm1 * (1 - x) * (1 - x);
+}
+
+template <typename scalar_t>
+void radial_basis_forward_kernel(const scalar_t *r, const scalar_t *w, scalar_t *out,
+                                 int64_t nedge, int64_t nbasis, double r_max, int64_t p)
+{
+  using Vec = at::vec::Vectorized<scalar_t>;
+  const scalar_t inv_rmax = 1.0 / r_max;
+  const scalar_t pref = 2.0 / r_max;
+
+  at::parallel_for(0, nedge, EDGE_GRAIN, [&](int64_t begin, int64_t end) {
+    for (int64_t e = begin; e < end; e++) {
+      const scalar_t x = r[e] * inv_rmax;
+      scalar_t u, du;
+      poly_cutoff(x, p, u, du);
+      const scalar_t scale = pref * u / r[e];
+      scalar_t *o = out + e * nbasis;
+
+      int64_t k = 0;
+      for (; k + Vec::size() <= nbasis; k += Vec::size())
+        ((Vec::loadu(w + k) * Vec(x)).sin() * Vec(scale)).store(o + k);
+      for (; k < nbasis; k++) o[k] = std::sin(w[k] * x) * scale;
+    }
+  });
+}
+
+template <typename scalar_t>
+void radial_basis_backward_kernel(const scalar_t *g, const scalar_t *r, const scalar_t *w,
+                                  scalar_t *grad_r, scalar_t *grad_w,
+                                  int64_t nedge, int64_t nbasis, double r_max, int64_t p)
+{
+  using Vec = at::vec::Vectorized<scalar_t>;
+  const scalar_t inv_rmax = 1.0 / r_max;
+  const scalar_t pref = 2.0 / r_max;
+
+  // grad_w is a reduction over edges: one partial sum per thread
+  std::vector<scalar_t> partial_w(grad_w ? at::get_num_threads() * nbasis : 0, 0);
+
+  at::parallel_for(0, nedge, EDGE_GRAIN, [&](int64_t begin, int64_t end) {
+    scalar_t *gw = grad_w ? &partial_w[at::get_thread_num() * nbasis] : nullptr;
+    for (int64_t e = begin; e < end; e++) {
+      const scalar_t inv_r = 1 / r[e];
+      const scalar_t x = r[e] * inv_rmax;
+      scalar_t u, du;
+      poly_cutoff(x, p, u, du);
+      const scalar_t *ge = g + e * nbasis;
+
+      // d out / dr = a w cos(w x) + b sin(w x),  d out / dw = c cos(w x)
+      const scalar_t a = pref * u * inv_r * inv_rmax;
+      const scalar_t b = pref * inv_r * (du * inv_rmax - u * inv_r);
+      const scalar_t c = pref * u * inv_rmax;
+
+      Vec acc_v(scalar_t(0));
+      int64_t k = 0;
+      for (; k + Vec::size() <= nbasis; k += Vec::size()) {
+        const Vec wk = Vec::loadu(w + k);
+        const Vec gk = Vec::loadu(ge + k);
+        const Vec arg = wk * Vec(x);
+        const Vec cs = arg.cos();
+        acc_v = acc_v + gk * (Vec(a) * wk * cs + Vec(b) * arg.sin());
+        if (gw) (Vec::loadu(gw + k) + gk * Vec(c) * cs).store(gw + k);
+      }
+      scalar_t lanes[Vec::size()];
+      acc_v.store(lanes);
+      scalar_t acc = 0;
+      for (int l = 0; l < Vec::size(); l++) acc += lanes[l];
+      for (; k < nbasis; k++) {
+        const scalar_t arg = w[k] * x;
+        const scalar_t cs = std::cos(arg);
+        acc += ge[k] * (a * w[k] * cs + b * std::sin(arg));
+        if (gw) gw[k] += ge[k] * c * cs;
+      }
+      grad_r[e] = acc;
+    }
+  });
+
+  if (grad_w) {
+    for (int64_t k = 0; k < nbasis; k++) grad_w[k] = 0;
+    for (size_t t = 0; t < partial_w.size(); t += nbasis)
+      for (int64_t k = 0; k < nbasis; k++) grad_w[k] += partial_w[t + k];
+  }
+}
+
+Tensor radial_basis_forward(const Tensor &r, const Tensor &weights, double r_max, int64_t p)
+{
+  if (!r.is_cpu()) return radial_basis_reference(r, weights, r_max, p);
+
+  const Tensor rc = r.contiguous(), wc = weights.contiguous();
+  Tensor out = torch::empty({rc.size(0), wc.size(0)}, rc.options());
+  AT_DISPATCH_FLOATING_TYPES(rc.scalar_type(), "phin::radial_basis", [&] {
+    radial_basis_forward_kernel<scalar_t>(rc.data_ptr<scalar_t>(), wc.data_ptr<scalar_t>(),
+                                          out.data_ptr<scalar_t>(), rc.size(0), wc.size(0), r_max, p);
+  });
+  return out;
+}
+
+std::tuple<Tensor, Tensor> radial_basis_backward(const Tensor &grad, const Tensor &r, const Tensor &weights,
+                                                 double r_max, int64_t p, bool need_grad_w)
+{
+  const bool create_graph = torch::GradMode::is_enabled();
+  if (create_graph || !r.is_cpu()) {
+    torch::AutoGradMode enable_grad(true);
+    Tensor rt = track(r, create_graph), wt = track(weights, create_graph);
+    Tensor out = radial_basis_reference(rt, wt, r_max, p);
+    auto grads = torch::autograd::grad({out}, {rt, wt}, {grad}, create_graph, create_graph, true);
+    return std::make_tuple(grads[0], need_grad_w ? grads[1] : Tensor());
+  }
+
+  const Tensor gc = grad.contiguous(), rc = r.contiguous(), wc = weights.contiguous();
+  Tensor grad_r = torch::empty_like(rc);
+  Tensor grad_w = need_grad_w ? torch::empty_like(wc) : Tensor();
+  AT_DISPATCH_FLOATING_TYPES(rc.scalar_type(), "phin::radial_basis_backward", [&] {
+    radial_basis_backward_kernel<scalar_t>(gc.data_ptr<scalar_t>(), rc.data_ptr<scalar_t>(), wc.data_ptr<scalar_t>(),
+                                           grad_r.data_ptr<scalar_t>(),
+                                           need_grad_w ? grad_w.data_ptr<scalar_t>() : nullptr,
+                                           rc.size(0), wc.size(0), r_max, p);
+  });
+  return std::make_tuple(grad_r, grad_w);
+}
+
+class RadialBasisFunction : public torch::autograd::Function<RadialBasisFunction> {
+ public:
+  static Tensor forward(AutogradContext *ctx, const Tensor &r, const Tensor &weights, double r_max, int64_t p)
+  {
+    ctx->save_for_backward({r, weights});
+    ctx->saved_data["r_max"] = r_max;
+    ctx->saved_data["p"] = p;
+    return radial_basis_forward(r, weights, r_max, p);
+  }
+
+  static variable_list backward(AutogradContext *ctx, variable_list grad_outputs)
+  {
+    auto saved = ctx->get_saved_variables();
+    Tensor grad_r, grad_w;
+    std::tie(grad_r, grad_w) = radial_basis_backward(grad_outputs[0], saved[0], saved[1],
+                                                     ctx->saved_data["r_max"].toDouble(),
+                                                     ctx->saved_data["p"].toInt(),
+                                                     ctx->needs_input_grad(1));
+    return {grad_r, grad_w, Tensor(), Tensor()};
+  }
+};
+
+/* ----------------------------------------------------------------------
+   real spherical harmonics up to l = 3 of the edge vectors, in the
+   component ordering used by e3nn (y is the polar axis) and with
+   "component" normalization (each l block has norm sqrt(2l+1)).
+   The same templated code is evaluated on scalars and on SIMD vectors
+   of edges.
+------------------------------------------------------------------------- */
+
+constexpr int64_t SH_LMAX = 3;
+
+inline float vsqrt(float a) { return std::sqrt(a); }
+inline double vsqrt(double a) { return std::sqrt(a); }
+template <typename scalar_t>
+inline at::vec::Vectorized<scalar_t> vsqrt(const at::vec::Vectorized<scalar_t> &a) { return a.sqrt(); }
+
+// Y[(l+1)^2] of a unit vector (x, y, z) and, if dY is given, dY/d(x, y, z)
+// stored as dY[3*c + {0,1,2}]
+template <typename T, typename scalar_t>
+inline void sh_eval(const T &x, const T &y, const T &z, int64_t lmax, T *Y, T *dY)
+{
+  const T zero(scalar_t(0));
+  auto set = [&](int c, scalar_t norm, const T &val, const T &dx, const T &dy, const T &dz) {
+    Y[c] = T(norm) * val;
+    if (dY) {
+      dY[3*c+0] = T(norm) * dx;
+      dY[3*c+1] = T(norm) * dy;
+      dY[3*c+2] = T(norm) * dz;
+    }
+  };
+  const T one(scalar_t(1));
+  set(0, 1, one, zero, zero, zero);
+  if (lmax < 1) return;
+
+  const scalar_t n1 = std::sqrt(scalar_t(3));
+  set(1, n1, x, one, zero, zero);
+  set(2, n1, y, zero, one, zero);
+  set(3, n1, z, zero, zero, one);
+  if (lmax < 2) return;
+
+  const scalar_t n2 = std::sqrt(scalar_t(5));
+  const scalar_t s3 = std::sqrt(scalar_t(3));
+  const T x2 = x*x, y2 = y*y, z2 = z*z;
+  const T h(scalar_t(0.5));
+  set(4, n2, T(s3)*x*z, T(s3)*z, zero, T(s3)*x);
+  set(5, n2, T(s3)*x*y, T(s3)*y, T(s3)*x, zero);
+  set(6, n2, y2 - h*(x2 + z2), zero - x, T(scalar_t(2))*y, zero - z);
+  set(7, n2, T(s3)*y*z, zero, T(s3)*z, T(s3)*y);
+  set(8, n2, T(s3/2)*(z2 - x2), T(-s3)*x, zero, T(s3)*z);
+  if (lmax < 3) return;
+
+  // l = 3, with the component normalization folded into the coefficients
+  const scalar_t c0 = std::sqrt(scalar_t(70)) / 4;
+  const scalar_t c1 = std::sqrt(scalar_t(105));
+  const scalar_t c2 = std::sqrt(scalar_t(42)) / 4;
+  const scalar_t c3 = std::sqrt(scalar_t(7)) / 2;
+  const scalar_t c5 = std::sqrt(scalar_t(105)) / 2;
+  const T t2(scalar_t(2)), t3(scalar_t(3)), t4(scalar_t(4)), t6(scalar_t(6)), t8(scalar_t(8));
+  set(9, c0, x*(t3*z2 - x2),
+      t3*z2 - t3*x2, zero, t6*x*z);
+  set(10, c1, x*y*z,
+      y*z, x*z, x*y);
+  set(11, c2, x*(t4*y2 - x2 - z2),
+      t4*y2 - t3*x2 - z2, t8*x*y, zero - t2*x*z);
+  set(12, c3, y*(t2*y2 - t3*x2 - t3*z2),
+      zero - t6*x*y, t6*y2 - t3*x2 - t3*z2, zero - t6*y*z);
+  set(13, c2, z*(t4*y2 - x2 - z2),
+      zero - t2*x*z, t8*y*z, t4*y2 - x2 - t3*z2);
+  set(14, c5, y*(z2 - x2),
+      zero - t2*x*y, z2 - x2, t2*y*z);
+  set(15, c0, z*(z2 - t3*x2),
+      zero - t6*x*z, zero, t3*z2 - t3*x2);
+}
+
+Tensor spherical_harmonics_reference(const Tensor &vec, int64_t lmax, bool normalize)
+{
+  const Tensor v = normalize ? vec / vec.norm(2, -1, true) : vec;
+  const Tensor x = v.select(-1, 0), y = v.select(-1, 1), z = v.select(-1, 2);
+  std::vector<Tensor> sh = {torch::ones_like(x)};
+  if (lmax >= 1) {
+    const double n1 = std::sqrt(3.0);
+    sh.insert(sh.end(), {n1*x, n1*y, n1*z});
+  }
+  if (lmax >= 2) {
+    const double n2 = std::sqrt(5.0), s3 = std::sqrt(3.0);
+    const Tensor x2z2 = x*x + z*z;
+    sh.insert(sh.end(), {n2*s3*x*z, n2*s3*x*y, n2*(y*y - 0.5*x2z2), n2*s3*y*z, n2*s3/2*(z*z - x*x)});
+  }
+  if (lmax >= 3) {
+    const Tensor x2 = x*x, y2 = y*y, z2 = z*z;
+    sh.insert(sh.end(), {
+      std::sqrt(70.0)/4*x*(3.0*z2 - x2),
+      std::sqrt(105.0)*x*y*z,
+      std::sqrt(42.0)/4*x*(4.0*y2 - x2 - z2),
+      std::sqrt(7.0)/2*y*(2.0*y2 - 3.0*x2 - 3.0*z2),
+      std::sqrt(42.0)/4*z*(4.0*y2 - x2 - z2),
+      std::sqrt(105.0)/2*y*(z2 - x2),
+      std::sqrt(70.0)/4*z*(z2 - 3.0*x2)});
+  }
+  return torch::stack(sh, -1);
+}
+
+template <typename scalar_t>
+void spherical_harmonics_forward_kernel(const scalar_t *vec, scalar_t *out, int64_t nedge,
+                                        int64_t lmax, bool normalize)
+{
+  using Vec = at::vec::Vectorized<scalar_t>;
+  constexpr int64_t V = Vec::size();
+  const int64_t ncomp = (lmax + 1) * (lmax + 1);
+
+  // one edge, scalar code path
+  auto edge = [&](int64_t e) {
+    scalar_t x = vec[3*e], y = vec[3*e+1], z = vec[3*e+2];
+    if (normalize) {
+      const scalar_t inv = 1 / std::sqrt(x*x + y*y + z*z);
+      x *= inv; y *= inv; z *= inv;
+    }
+    sh_eval<scalar_t, scalar_t>(x, y, z, lmax, out + e*ncomp, nullptr);
+  };
+
+  at::parallel_for(0, nedge, EDGE_GRAIN, [&](int64_t begin, int64_t end) {
+    scalar_t xs[V], ys[V], zs[V], lanes[V];
+    Vec Y[(SH_LMAX + 1) * (SH_LMAX + 1)];
+    int64_t e0 = begin;
+    // blocks of V edges: deinterleave, evaluate with SIMD, interleave back
+    for (; e0 + V <= end; e0 += V) {
+      for (int64_t l = 0; l < V; l++) {
+        xs[l] = vec[3*(e0+l)]; ys[l] = vec[3*(e0+l)+1]; zs[l] = vec[3*(e0+l)+2];
+      }
+      Vec x = Vec::loadu(xs), y = Vec::loadu(ys), z = Vec::loadu(zs);
+      if (normalize) {
+        const Vec inv = Vec(scalar_t(1)) / vsqrt(x*x + y*y + z*z);
+        x = x * inv; y = y * inv; z = z * inv;
+      }
+      sh_eval<Vec, scalar_t>(x, y, z, lmax, Y, nullptr);
+      for (int64_t c = 0; c < ncomp; c++) {
+        Y[c].store(lanes);
+        for (int64_t l = 0; l < V; l++) out[(e0+l)*ncomp + c] = lanes[l];
+      }
+    }
+    for (; e0 < end; e0++) edge(e0);
+  });
+}
+
+// grad_vec[e] = sum_c g[e,c] dY_c/dvec, chained through the normalization
+// u = v/|v|, du/dv = (1 - u u^T)/|v|
+template <typename scalar_t>
+void spherical_harmonics_backward_kernel(const scalar_t *g, const scalar_t *vec, scalar_t *grad_vec,
+                                         int64_t nedge, int64_t lmax, bool normalize)
+{
+  using Vec = at::vec::Vectorized<scalar_t>;
+  constexpr int64_t V = Vec::size();
+  constexpr int64_t NC = (SH_LMAX + 1) * (SH_LMAX + 1);
+  const int64_t ncomp = (lmax + 1) * (lmax + 1);
+
+  auto edge = [&](int64_t e) {
+    scalar_t x = vec[3*e], y = vec[3*e+1], z = vec[3*e+2];
+    scalar_t inv = 1;
+    if (normalize) {
+      inv = 1 / std::sqrt(x*x + y*y + z*z);
+      x *= inv; y *= inv; z *= inv;
+    }
+    scalar_t Y[NC], dY[3*NC];
+    sh_eval<scalar_t, scalar_t>(x, y, z, lmax, Y, dY);
+    scalar_t gu[3] = {0, 0, 0};
+    for (int64_t c = 0; c < ncomp; c++)
+      for (int d = 0; d < 3; d++) gu[d] += g[e*ncomp + c] * dY[3*c+d];
+    if (normalize) {
+      const scalar_t dot = gu[0]*x + gu[1]*y + gu[2]*z;
+      gu[0] = (gu[0] - dot*x) * inv;
+      gu[1] = (gu[1] - dot*y) * inv;
+      gu[2] = (gu[2] - dot*z) * inv;
+    }
+    for (int d = 0; d < 3; d++) grad_vec[3*e+d] = gu[d];
+  };
+
+  at::parallel_for(0, nedge, EDGE_GRAIN, [&](int64_t begin, int64_t end) {
+    scalar_t xs[V], ys[V], zs[V], lanes[V];
+    Vec Y[NC], dY[3*NC];
+    int64_t e0 = begin;
+    for (; e0 + V <= end; e0 += V) {
+      for (int64_t l = 0; l < V; l++) {
+        xs[l] = vec[3*(e0+l)]; ys[l] = vec[3*(e0+l)+1]; zs[l] = vec[3*(e0+l)+2];
+      }
+      Vec x = Vec::loadu(xs), y = Vec::loadu(ys), z = Vec::loadu(zs);
+      Vec inv(scalar_t(1));
+      if (normalize) {
+        inv = Vec(scalar_t(1)) / vsqrt(x*x + y*y + z*z);
+        x = x * inv; y = y * inv; z = z * inv;
+      }
+      sh_eval<Vec, scalar_t>(x, y, z, lmax, Y, dY);
+      Vec gx(scalar_t(0)), gy(scalar_t(0)), gz(scalar_t(0));
+      for (int64_t c = 0; c < ncomp; c++) {
+        for (int64_t l = 0; l < V; l++) lanes[l] = g[(e0+l)*ncomp + c];
+        const Vec gc = Vec::loadu(lanes);
+        gx = gx + gc * dY[3*c];
+        gy = gy + gc * dY[3*c+1];
+        gz = gz + gc * dY[3*c+2];
+      }
+      if (normalize) {
+        const Vec dot = gx*x + gy*y + gz*z;
+        gx = (gx - dot*x) * inv;
+        gy = (gy - dot*y) * inv;
+        gz = (gz - dot*z) * inv;
+      }
+      gx.store(xs); gy.store(ys); gz.store(zs);
+      for (int64_t l = 0; l < V; l++) {
+        grad_vec[3*(e0+l)] = xs[l]; grad_vec[3*(e0+l)+1] = ys[l]; grad_vec[3*(e0+l)+2] = zs[l];
+      }
+    }
+    for (; e0 < end; e0++) edge(e0);
+  });
+}
+
+Tensor spherical_harmonics_forward(const Tensor &vec, int64_t lmax, bool normalize)
+{
+  if (!vec.is_cpu()) return spherical_harmonics_reference(vec, lmax, normalize);
+
+  const Tensor vc = vec.contiguous();
+  Tensor out = torch::empty({vc.size(0), (lmax + 1) * (lmax + 1)}, vc.options());
+  AT_DISPATCH_FLOATING_TYPES(vc.scalar_type(), "phin::spherical_harmonics", [&] {
+    spherical_harmonics_forward_kernel<scalar_t>(vc.data_ptr<scalar_t>(), out.data_ptr<scalar_t>(),
+                                                 vc.size(0), lmax, normalize);
+  });
+  return out;
+}
+
+Tensor spherical_harmonics_backward(const Tensor &grad, const Tensor &vec, int64_t lmax, bool normalize)
+{
+  const bool create_graph = torch::GradMode::is_enabled();
+  if (create_graph || !vec.is_cpu()) {
+    torch::AutoGradMode enable_grad(true);
+    Tensor vt = track(vec, create_graph);
+    Tensor out = spherical_harmonics_reference(vt, lmax, normalize);
+    return torch::autograd::grad({out}, {vt}, {grad}, create_graph, create_graph)[0];
+  }
+
+  const Tensor gc = grad.contiguous(), vc = vec.contiguous();
+  Tensor grad_vec = torch::empty_like(vc);
+  AT_DISPATCH_FLOATING_TYPES(vc.scalar_type(), "phin::spherical_harmonics_backward", [&] {
+    spherical_harmonics_backward_kernel<scalar_t>(gc.data_ptr<scalar_t>(), vc.data_ptr<scalar_t>(),
+                                                  grad_vec.data_ptr<scalar_t>(), vc.size(0), lmax, normalize);
+  });
+  return grad_vec;
+}
+
+class SphericalHarmonicsFunction : public torch::autograd::Function<SphericalHarmonicsFunction> {
+ public:
+  static Tensor forward(AutogradContext *ctx, const Tensor &vec, int64_t lmax, bool normalize)
+  {
+    ctx->save_for_backward({vec});
+    ctx->saved_data["lmax"] = lmax;
+    ctx->saved_data["normalize"] = normalize;
+    return spherical_harmonics_forward(vec, lmax, normalize);
+  }
+
+  static variable_list backward(AutogradContext *ctx, variable_list grad_outputs)
+  {
+    auto saved = ctx->get_saved_variables();
+    Tensor grad_vec = spherical_harmonics_backward(grad_outputs[0], saved[0],
+                                                   ctx->saved_data["lmax"].toInt(),
+                                                   ctx->saved_data["normalize"].toBool());
+    return {grad_vec, Tensor(), Tensor()};
+  }
+};
+
+/* ----------------------------------------------------------------------
+   segment sum over receiver-sorted edges
+
+     out[n,:] = sum of src[e,:] for e in [offsets[n], offsets[n+1])
+
+   Every node owns a contiguous edge range, so threads split the nodes
+   and write disjoint rows without atomics. The backward is the matching
+   gather, grad_src[e,:] = grad_out[n,:].
+------------------------------------------------------------------------- */
+
+Tensor segment_sum_reference(const Tensor &src, const Tensor &offsets)
+{
+  const Tensor counts = offsets.slice(0, 1) - offsets.slice(0, 0, -1);
+  const Tensor index = torch::repeat_interleave(torch::arange(counts.size(0), offsets.options()), counts);
+  std::vector<int64_t> shape = src.sizes().vec();
+  shape[0] = counts.size(0);
+  return torch::zeros(shape, src.options()).index_add(0, index, src);
+}
+
+Tensor segment_gather_reference(const Tensor &grad, const Tensor &offsets)
+{
+  const Tensor counts = offsets.slice(0, 1) - offsets.slice(0, 0, -1);
+  return torch::repeat_interleave(grad, counts, 0);
+}
+
+// Nodes per parallel_for chunk, sized so a chunk holds about EDGE_GRAIN edges
+int64_t node_grain(int64_t nnode, int64_t nedge)
+{
+  if (nedge <= 0) return nnode + 1;
+  return std::max<int64_t>(1, EDGE_GRAIN * nnode / nedge);
+}
+
+template <typename scalar_t>
+void segment_sum_kernel(const scalar_t *src, const int64_t *offsets, scalar_t *out,
+                        int64_t nnode, int64_t nedge, int64_t nfeat)
+{
+  using Vec = at::vec::Vectorized<scalar_t>;
+
+  at::parallel_for(0, nnode, node_grain(nnode, nedge), [&](int64_t begin, int64_t end) {
+    for (int64_t n = begin; n < end; n++) {
+      scalar_t *o = out + n * nfeat;
+      int64_t k = 0;
+      for (; k + Vec::size() <= nfeat; k += Vec::size()) {
+        Vec acc(scalar_t(0));
+        for (int64_t e = offsets[n]; e < offsets[n+1]; e++) acc = acc + Vec::loadu(src + e * nfeat + k);
+        acc.store(o + k);
+      }
+      for (; k < nfeat; k++) {
+        scalar_t acc = 0;
+        for (int64_t e = offsets[n]; e < offsets[n+1]; e++) acc += src[e * nfeat + k];
+        o[k] = acc;
+      }
+    }
+  });
+}
+
+template <typename scalar_t>
+void segment_gather_kernel(const scalar_t *grad, const int64_t *offsets, scalar_t *grad_src,
+                           int64_t nnode, int64_t nedge, int64_t nfeat)
+{
+  at::parallel_for(0, nnode, node_grain(nnode, nedge), [&](int64_t begin, int64_t end) {
+    for (int64_t n = begin; n < end; n++)
+      for (int64_t e = offsets[n]; e < offsets[n+1]; e++)
+        std::copy(grad + n * nfeat, grad + (n + 1) * nfeat, grad_src + e * nfeat);
+  });
+}
+
+Tensor segment_sum_forward(const Tensor &src, const Tensor &offsets)
+{
+  if (!src.is_cpu()) return segment_sum_reference(src, offsets);
+
+  const Tensor sc = src.contiguous(), oc = offsets.contiguous();
+  const int64_t nnode = oc.size(0) - 1, nedge = sc.size(0);
+  std::vector<int64_t> shape = sc.sizes().vec();
+  shape[0] = nnode;
+  Tensor out = torch::empty(shape, sc.options());
+  const int64_t nfeat = nedge > 0 ? sc.numel() / nedge : out.numel() / std::max<int64_t>(nnode, 1);
+  AT_DISPATCH_FLOATING_TYPES(sc.scalar_type(), "phin::segment_sum", [&] {
+    segment_sum_kernel<scalar_t>(sc.data_ptr<scalar_t>(), oc.data_ptr<int64_t>(), out.data_ptr<scalar_t>(),
+                                 nnode, nedge, nfeat);
+  });
+  return out;
+}
+
+Tensor segment_sum_backward(const Tensor &grad, const Tensor &offsets, int64_t nedge)
+{
+  // the gather is linear in grad, so double backward only needs it to be
+  // differentiable: repeat_interleave is
+  if (torch::GradMode::is_enabled() || !grad.is_cpu()) return segment_gather_reference(grad, offsets);
+
+  const Tensor gc = grad.contiguous(), oc = offsets.contiguous();
+  const int64_t nnode = oc.size(0) - 1;
+  std::vector<int64_t> shape = gc.sizes().vec();
+  shape[0] = nedge;
+  Tensor grad_src = torch::empty(shape, gc.options());
+  const int64_t nfeat = nnode > 0 ? gc.numel() / nnode : 0;
+  AT_DISPATCH_FLOATING_TYPES(gc.scalar_type(), "phin::segment_sum_backward", [&] {
+    segment_gather_kernel<scalar_t>(gc.data_ptr<scalar_t>(), oc.data_ptr<int64_t>(),
+                                    grad_src.data_ptr<scalar_t>(), nnode, nedge, nfeat);
+  });
+  return grad_src;
+}
+
+class SegmentSumFunction : public torch::autograd::Function<SegmentSumFunction> {
+ public:
+  static Tensor forward(AutogradContext *ctx, const Tensor &src, const Tensor &offsets)
+  {
+    ctx->save_for_backward({offsets});
+    ctx->saved_data["nedge"] = src.size(0);
+    return segment_sum_forward(src, offsets);
+  }
+
+  static variable_list backward(AutogradContext *ctx, variable_list grad_outputs)
+  {
+    auto saved = ctx->get_saved_variables();
+    Tensor grad_src = segment_sum_backward(grad_outputs[0], saved[0], ctx->saved_data["nedge"].toInt());
+    return {grad_src, Tensor()};
+  }
+};
+
+/* ----------------------------------------------------------------------
+   weighted tensor-product messages, aggregated into the receivers
+
+     out[n, o3(p)+k, u] = sum over edges e of n, paths p = (l1, l2, l3):
+        w[e,p,u] * sum_ij cg_p[i,j,k] * x[s(e), l1^2+i, u] * Y[e, l2^2+j]
+
+   This is the "uvu" tensor product of NequIP's interaction block followed
+   by the scatter onto edge_index[0]. Features are channels-last, [.., D, C]
+   with one block per l at rows l^2 .. (l+1)^2-1, and every path writes its
+   own output block o3(p) in path order. cg holds the dense coupling
+   coefficients of every path (including any path normalization), of
+   which only the nonzeros are kept.
+
+   Edges are receiver-sorted as for segment_sum, so the forward pass and
+   the per-edge gradients loop over receivers, and grad_x loops over
+   senders through a sender-sorted permutation: no edge-by-channel
+   intermediate is ever formed and no atomics are needed.
+------------------------------------------------------------------------- */
+
+template <typename scalar_t>
+struct Coupling {
+  int64_t p, i1, i2, i3;    // path, row in x, column in sh, row in out
+  scalar_t c;
+};
+
+template <typename scalar_t>
+std::vector<Coupling<scalar_t>> tp_couplings(const Tensor &paths, const Tensor &cg)
+{
+  const Tensor pc = paths.contiguous();
+  const Tensor cc = cg.to(torch::kCPU, torch::kDouble).contiguous();
+  const int64_t *l = pc.data_ptr<int64_t>();
+  const double *c = cc.data_ptr<double>();
+
+  std::vector<Coupling<scalar_t>> cpl;
+  int64_t o3 = 0, k = 0;
+  for (int64_t p = 0; p < pc.size(0); p++) {
+    const int64_t l1 = l[3*p], l2 = l[3*p+1], l3 = l[3*p+2];
+    for (int64_t i = 0; i < 2*l1+1; i++)
+      for (int64_t j = 0; j < 2*l2+1; j++)
+        for (int64_t m = 0; m < 2*l3+1; m++, k++)
+          if (c[k] != 0.0) cpl.push_back({p, l1*l1 + i, l2*l2 + j, o3 + m, static_cast<scalar_t>(c[k])});
+    o3 += 2*l3+1;
+  }
+  return cpl;
+}
+
+// o[u] += a * v1[u] * v2[u]
+template <typename scalar_t>
+inline void fma3(int64_t n, scalar_t a, const scalar_t *v1, const scalar_t *v2, scalar_t *o)
+{
+  using Vec = at::vec::Vectorized<scalar_t>;
+  int64_t u = 0;
+  for (; u + Vec::size() <= n; u += Vec::size())
+    (Vec::loadu(o + u) + Vec(a) * Vec::loadu(v1 + u) * Vec::loadu(v2 + u)).store(o + u);
+  for (; u < n; u++) o[u] += a * v1[u] * v2[u];
+}
+
+// sum_u v1[u] * v2[u] * v3[u]
+template <typename scalar_t>
+inline scalar_t dot3(int64_t n, const scalar_t *v1, const scalar_t *v2, const scalar_t *v3)
+{
+  using Vec = at::vec::Vectorized<scalar_t>;
+  Vec acc_v(scalar_t(0));
+  int64_t u = 0;
+  for (; u + Vec::size() <= n; u += Vec::size())
+    acc_v = acc_v + Vec::loadu(v1 + u) * Vec::loadu(v2 + u) * Vec::loadu(v3 + u);
+  scalar_t lanes[Vec::size()];
+  acc_v.store(lanes);
+  scalar_t acc = 0;
+  for (int l = 0; l < Vec::size(); l++) acc += lanes[l];
+  for (; u < n; u++) acc += v1[u] * v2[u] * v3[u];
+  return acc;
+}
+
+// Sizes shared by the tensor-product kernels
+struct TPDims {
+  int64_t nx, nnode, nedge, dx, dsh, dout, npath, nchan;
+};
+
+Tensor tp_message_reference(const Tensor &x, const Tensor &sh, const Tensor &weights,
+                            const Tensor &senders, const Tensor &offsets,
+                            const Tensor &paths, const Tensor &cg)
+{
+  const Tensor pc = paths.cpu();
+  const int64_t nnode = offsets.size(0) - 1;
+  const Tensor counts = offsets.slice(0, 1) - offsets.slice(0, 0, -1);
+  const Tensor receivers = torch::repeat_interleave(torch::arange(nnode, offsets.options()), counts);
+  const Tensor xj = x.index_select(0, senders);
+
+  std::vector<Tensor> msg;
+  int64_t k = 0;
+  for (int64_t p = 0; p < pc.size(0); p++) {
+    const int64_t l1 = pc[p][0].item<int64_t>(), l2 = pc[p][1].item<int64_t>(), l3 = pc[p][2].item<int64_t>();
+    const int64_t n = (2*l1+1) * (2*l2+1) * (2*l3+1);
+    const Tensor cgp = cg.slice(0, k, k + n).view({2*l1+1, 2*l2+1, 2*l3+1}).to(x.options());
+    k += n;
+    msg.push_back(torch::einsum("eiu,ej,ijk,eu->eku",
+                                {xj.slice(1, l1*l1, (l1+1)*(l1+1)), sh.slice(1, l2*l2, (l2+1)*(l2+1)),
+                                 cgp, weights.select(1, p)}));
+  }
+  const Tensor m = torch::cat(msg, 1);
+  return torch::zeros({nnode, m.size(1), m.size(2)}, m.options()).index_add(0, receivers, m);
+}
+
+template <typename scalar_t>
+void tp_message_forward_kernel(const scalar_t *x, const scalar_t *sh, const scalar_t *w,
+                               const int64_t *senders, const int64_t *offsets,
+                               const std::vector<Coupling<scalar_t>> &cpl, scalar_t *out, const TPDims &d)
+{
+  const int64_t C = d.nchan;
+  at::parallel_for(0, d.nnode, node_grain(d.nnode, d.nedge), [&](int64_t begin, int64_t end) {
+    for (int64_t n = begin; n < end; n++) {
+      scalar_t *o = out + n * d.dout * C;
+      std::fill(o, o + d.dout * C, scalar_t(0));
+      for (int64_t e = offsets[n]; e < offsets[n+1]; e++) {
+        const scalar_t *xj = x + senders[e] * d.dx * C;
+        const scalar_t *Ye = sh + e * d.dsh;
+        const scalar_t *we = w + e * d.npath * C;
+        for (const auto &t : cpl) {
+          const scalar_t a = t.c * Ye[t.i2];
+          if (a != 0) fma3(C, a, we + t.p * C, xj + t.i1 * C, o + t.i3 * C);
+        }
+      }
+    }
+  });
+}
+
+template <typename scalar_t>
+void tp_message_backward_kernel(const scalar_t *g, const scalar_t *x, const scalar_t *sh, const scalar_t *w,
+                                const int64_t *senders, const int64_t *offsets,
+                                const std::vector<Coupling<scalar_t>> &cpl,
+                                scalar_t *grad_x, scalar_t *grad_sh, scalar_t *grad_w, const TPDims &d)
+{
+  const int64_t C = d.nchan;
+
+  // grad_sh and grad_w belong to single edges: loop over receivers
+  if (grad_sh || grad_w) {
+    at::parallel_for(0, d.nnode, node_grain(d.nnode, d.nedge), [&](int64_t begin, int64_t end) {
+      for (int64_t n = begin; n < end; n++) {
+        const scalar_t *gn = g + n * d.dout * C;
+        for (int64_t e = offsets[n]; e < offsets[n+1]; e++) {
+          const scalar_t *xj = x + senders[e] * d.dx * C;
+          const scalar_t *Ye = sh + e * d.dsh;
+          const scalar_t *we = w + e * d.npath * C;
+          for (const auto &t : cpl) {
+            const scalar_t *xv = xj + t.i1 * C, *gv = gn + t.i3 * C;
+            if (grad_sh) grad_sh[e * d.dsh + t.i2] += t.c * dot3(C, we + t.p * C, xv, gv);
+            if (grad_w) fma3(C, t.c * Ye[t.i2], xv, gv, grad_w + (e * d.npath + t.p) * C);
+          }
+        }
+      }
+    });
+  }
+
+  // grad_x gathers over the edges of every sender
+  if (grad_x) {
+    std::vector<int64_t> recv(d.nedge), soffsets(d.nx + 1, 0), order(d.nedge);
+    for (int64_t n = 0; n < d.nnode; n++)
+      for (int64_t e = offsets[n]; e < offsets[n+1]; e++) recv[e] = n;
+    for (int64_t e = 0; e < d.nedge; e++) soffsets[senders[e] + 1]++;
+    std::partial_sum(soffsets.begin(), soffsets.end(), soffsets.begin());
+    std::vector<int64_t> next(soffsets.begin(), soffsets.end() - 1);
+    for (int64_t e = 0; e < d.nedge; e++) order[next[senders[e]]++] = e;
+
+    at::parallel_for(0, d.nx, node_grain(d.nx, d.nedge), [&](int64_t begin, int64_t end) {
+      for (int64_t j = begin; j < end; j++) {
+        scalar_t *gx = grad_x + j * d.dx * C;
+        std::fill(gx, gx + d.dx * C, scalar_t(0));
+        for (int64_t k = soffsets[j]; k < soffsets[j+1]; k++) {
+          const int64_t e = order[k];
+          const scalar_t *gn = g + recv[e] * d.dout * C;
+          const scalar_t *Ye = sh + e * d.dsh;
+          const scalar_t *we = w + e * d.npath * C;
+          for (const auto &t : cpl) {
+            const scalar_t a = t.c * Ye[t.i2];
+            if (a != 0) fma3(C, a, we + t.p * C, gn + t.i3 * C, gx + t.i1 * C);
+          }
+        }
+      }
+    });
+  }
+}
+
+TPDims tp_dims(const Tensor &x, const Tensor &sh, const Tensor &offsets, const Tensor &paths)
+{
+  const Tensor pc = paths.cpu().contiguous();
+  const int64_t *l = pc.data_ptr<int64_t>();
+  int64_t dout = 0;
+  for (int64_t p = 0; p < pc.size(0); p++) dout += 2*l[3*p+2] + 1;
+  return {x.size(0), offsets.size(0) - 1, sh.size(0), x.size(1), sh.size(1), dout, pc.size(0), x.size(2)};
+}
+
+Tensor tp_message_forward(const Tensor &x, const Tensor &sh, const Tensor &weights, const Tensor &senders,
+                          const Tensor &offsets, const Tensor &paths, const Tensor &cg)
+{
+  if (!x.is_cpu()) return tp_message_reference(x, sh, weights, senders, offsets, paths, cg);
+
+  const Tensor xc = x.contiguous(), sc = sh.contiguous(), wc = weights.contiguous();
+  const Tensor snd = senders.contiguous(), oc = offsets.contiguous();
+  const TPDims d = tp_dims(xc, sc, oc, paths);
+  Tensor out = torch::empty({d.nnode, d.dout, d.nchan}, xc.options());
+  AT_DISPATCH_FLOATING_TYPES(xc.scalar_type(), "phin::tp_message", [&] {
+    tp_message_forward_kernel<scalar_t>(xc.data_ptr<scalar_t>(), sc.data_ptr<scalar_t>(), wc.data_ptr<scalar_t>(),
+                                        snd.data_ptr<int64_t>(), oc.data_ptr<int64_t>(),
+                                        tp_couplings<scalar_t>(paths, cg), out.data_ptr<scalar_t>(), d);
+  });
+  return out;
+}
+
+std::tuple<Tensor, Tensor, Tensor> tp_message_backward(const Tensor &grad, const Tensor &x, const Tensor &sh,
+                                                       const Tensor &weights, const Tensor &senders,
+                                                       const Tensor &offsets, const Tensor &paths,
+                                                       const Tensor &cg, const std::array<bool, 3> &need)
+{
+  const bool create_graph = torch::GradMode::is_enabled();
+  if (create_graph || !x.is_cpu()) {
+    torch::AutoGradMode enable_grad(true);
+    Tensor xt = track(x, create_graph), st = track(sh, create_graph), wt = track(weights, create_graph);
+    Tensor out = tp_message_reference(xt, st, wt, senders, offsets, paths, cg);
+    auto grads = torch::autograd::grad({out}, {xt, st, wt}, {grad}, create_graph, create_graph, true);
+    return std::make_tuple(need[0] ? grads[0] : Tensor(), need[1] ? grads[1] : Tensor(),
+                           need[2] ? grads[2] : Tensor());
+  }
+
+  const Tensor gc = grad.contiguous(), xc = x.contiguous(), sc = sh.contiguous(), wc = weights.contiguous();
+  const Tensor snd = senders.contiguous(), oc = offsets.contiguous();
+  const TPDims d = tp_dims(xc, sc, oc, paths);
+  Tensor grad_x = need[0] ? torch::empty_like(xc) : Tensor();
+  Tensor grad_sh = need[1] ? torch::zeros_like(sc) : Tensor();
+  Tensor grad_w = need[2] ? torch::zeros_like(wc) : Tensor();
+  AT_DISPATCH_FLOATING_TYPES(xc.scalar_type(), "phin::tp_message_backward", [&] {
+    tp_message_backward_kernel<scalar_t>(gc.data_ptr<scalar_t>(), xc.data_ptr<scalar_t>(), sc.data_ptr<scalar_t>(),
+                                         wc.data_ptr<scalar_t>(), snd.data_ptr<int64_t>(), oc.data_ptr<int64_t>(),
+                                         tp_couplings<scalar_t>(paths, cg),
+                                         need[0] ? grad_x.data_ptr<scalar_t>() : nullptr,
+                                         need[1] ? grad_sh.data_ptr<scalar_t>() : nullptr,
+                                         need[2] ? grad_w.data_ptr<scalar_t>() : nullptr, d);
+  });
+  return std::make_tuple(grad_x, grad_sh, grad_w);
+}
+
+class TPMessageFunction : public torch::autograd::Function<TPMessageFunction> {
+ public:
+  static Tensor forward(AutogradContext *ctx, const Tensor &x, const Tensor &sh, const Tensor &weights,
+                        const Tensor &senders, const Tensor &offsets, const Tensor &paths, const Tensor &cg)
+  {
+    ctx->save_for_backward({x, sh, weights, senders, offsets, paths, cg});
+    return tp_message_forward(x, sh, weights, senders, offsets, paths, cg);
+  }
+
+  static variable_list backward(AutogradContext *ctx, variable_list grad_outputs)
+  {
+    auto s = ctx->get_saved_variables();
+    Tensor grad_x, grad_sh, grad_w;
+    std::tie(grad_x, grad_sh, grad_w) =
+      tp_message_backward(grad_outputs[0], s[0], s[1], s[2], s[3], s[4], s[5], s[6],
+                          {ctx->needs_input_grad(0), ctx->needs_input_grad(1), ctx->needs_input_grad(2)});
+    return {grad_x, grad_sh, grad_w, Tensor(), Tensor(), Tensor(), Tensor()};
+  }
+};
+
+}    // namespace
+
+Tensor radial_basis(const Tensor &r, const Tensor &weights, double r_max, int64_t p)
+{
+  TORCH_CHECK(r.dim() == 1, "phin::radial_basis: r must be 1-D (one length per edge)");
+  TORCH_CHECK(weights.dim() == 1, "phin::radial_basis: weights must be 1-D");
+  TORCH_CHECK(r.scalar_type() == weights.scalar_type(), "phin::radial_basis: r and weights must have the same dtype");
+  TORCH_CHECK(p >= 1, "phin::radial_basis: p must be positive");
+  return RadialBasisFunction::apply(r, weights, r_max, p);
+}
+
+Tensor spherical_harmonics(const Tensor &vec, int64_t lmax, bool normalize)
+{
+  TORCH_CHECK(vec.dim() == 2 && vec.size(1) == 3, "phin::spherical_harmonics: vec must be [nedge, 3]");
+  TORCH_CHECK(lmax >= 0 && lmax <= SH_LMAX, "phin::spherical_harmonics: lmax must be between 0 and 3");
+  return SphericalHarmonicsFunction::apply(vec, lmax, normalize);
+}
+
+Tensor segment_sum(const Tensor &src, const Tensor &offsets)
+{
+  TORCH_CHECK(src.dim() >= 1, "phin::segment_sum: src must have an edge dimension");
+  TORCH_CHECK(offsets.dim() == 1 && offsets.size(0) >= 1 && offsets.scalar_type() == torch::kLong,
+              "phin::segment_sum: offsets must be a 1-D int64 tensor of nnode+1 entries");
+  TORCH_CHECK(offsets.device() == src.device(), "phin::segment_sum: src and offsets must be on the same device");
+  if (offsets.is_cpu()) {
+    const Tensor oc = offsets.contiguous();
+    const int64_t *o = oc.data_ptr<int64_t>();
+    const int64_t n = oc.size(0);
+    TORCH_CHECK(o[0] == 0 && o[n-1] == src.size(0),
+                "phin::segment_sum: offsets must start at 0 and end at the number of edges");
+    for (int64_t i = 1; i < n; i++)
+      TORCH_CHECK(o[i] >= o[i-1], "phin::segment_sum: offsets must be non-decreasing");
+  }
+  return SegmentSumFunction::apply(src, offsets);
+}
+
+Tensor tp_message(const Tensor &x, const Tensor &sh, const Tensor &weights, const Tensor &senders,
+                  const Tensor &offsets, const Tensor &paths, const Tensor &cg)
+{
+  TORCH_CHECK(x.dim() == 3, "phin::tp_message: x must be [nnode, dim, channels]");
+  TORCH_CHECK(sh.dim() == 2, "phin::tp_message: sh must be [nedge, dim]");
+  TORCH_CHECK(paths.dim() == 2 && paths.size(1) == 3 && paths.scalar_type() == torch::kLong,
+              "phin::tp_message: paths must be an int64 [npath, 3] tensor of (l1, l2, l3)");
+  TORCH_CHECK(weights.dim() == 3 && weights.size(0) == sh.size(0) && weights.size(1) == paths.size(0)
+              && weights.size(2) == x.size(2), "phin::tp_message: weights must be [nedge, npath, channels]");
+  TORCH_CHECK(x.scalar_type() == sh.scalar_type() && x.scalar_type() == weights.scalar_type(),
+              "phin::tp_message: x, sh and weights must have the same dtype");
+  TORCH_CHECK(senders.dim() == 1 && senders.size(0) == sh.size(0) && senders.scalar_type() == torch::kLong,
+              "phin::tp_message: senders must be a 1-D int64 tensor with one entry per edge");
+  TORCH_CHECK(offsets.dim() == 1 && offsets.size(0) >= 1 && offsets.scalar_type() == torch::kLong,
+              "phin::tp_message: offsets must be a 1-D int64 tensor of nnode+1 entries");
+
+  const Tensor pc = paths.cpu().contiguous();
+  const int64_t *l = pc.data_ptr<int64_t>();
+  int64_t ncg = 0;
+  for (int64_t p = 0; p < pc.size(0); p++) {
+    const int64_t l1 = l[3*p], l2 = l[3*p+1], l3 = l[3*p+2];
+    TORCH_CHECK(l1 >= 0 && l2 >= 0 && l3 >= 0 && (l1+1)*(l1+1) <= x.size(1) && (l2+1)*(l2+1) <= sh.size(1),
+                "phin::tp_message: path ", p, " = (", l1, ", ", l2, ", ", l3, ") is out of range of x or sh");
+    ncg += (2*l1+1) * (2*l2+1) * (2*l3+1);
+  }
+  TORCH_CHECK(cg.dim() == 1 && cg.size(0) == ncg,
+              "phin::tp_message: cg must hold the ", ncg, " dense coupling coefficients of the paths");
+
+  if (offsets.is_cpu()) {
+    const Tensor oc = offsets.contiguous();
+    const int64_t *o = oc.data_ptr<int64_t>();
+    const int64_t n = oc.size(0);
+    TORCH_CHECK(o[0] == 0 && o[n-1] == sh.size(0),
+                "phin::tp_message: offsets must start at 0 and end at the number of edges");
+    for (int64_t i = 1; i < n; i++)
+      TORCH_CHECK(o[i] >= o[i-1], "phin::tp_message: offsets must be non-decreasing");
+  }
+  if (senders.is_cpu() && senders.numel() > 0) {
+    TORCH_CHECK(senders.min().item<int64_t>() >= 0 && senders.max().item<int64_t>() < x.size(0),
+                "phin::tp_message: senders out of range of x");
+  }
+  return TPMessageFunction::apply(x, sh, weights, senders, offsets, paths, cg);
+}
+
+}    // namespace phin
+
+TORCH_LIBRARY(phin, m)
+{
+  m.def("radial_basis(Tensor r, Tensor weights, float r_max, int p=6) -> Tensor", &phin::radial_basis);
+  m.def("spherical_harmonics(Tensor vec, int lmax, bool normalize=True) -> Tensor", &phin::spherical_harmonics);
+  m.def("segment_sum(Tensor src, Tensor offsets) -> Tensor", &phin::segment_sum);
+  m.def("tp_message(Tensor x, Tensor sh, Tensor weights, Tensor senders, Tensor offsets, "
+        "Tensor paths, Tensor cg) -> Tensor", &phin::tp_message);
+}
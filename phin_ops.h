@@ -0,0 +1,39 @@
+/* ----------------------------------------------------------------------
+   Custom TorchScript operators shipped with pair_style phin.
+
+   The operators are registered in the "phin" namespace when the library
+   is loaded, so deployed models can call them as torch.ops.phin.<name>.
+------------------------------------------------------------------------- */
+
+#ifndef PHIN_OPS_H
+#define PHIN_OPS_H
+
+#include <torch/torch.h>
+
+namespace phin {
+
+// Referenced by the pair style, so that the linker keeps the operator
+// registrations even when LAMMPS is linked as a static library.
+void ops_linked();
+
+// Bessel radial basis times the polynomial cutoff envelope, [nedge, nbasis]
+torch::Tensor radial_basis(const torch::Tensor &r, const torch::Tensor &weights,
+                           double r_max, int64_t p);
+
+// Real spherical harmonics l = 0..lmax (lmax <= 3) of edge vectors, [nedge, (lmax+1)^2]
+torch::Tensor spherical_harmonics(const torch::Tensor &vec, int64_t lmax, bool normalize);
+
+// Sum of src rows over the contiguous edge ranges [offsets[n], offsets[n+1])
+// of receiver-sorted edges, [nnode, ...]
+torch::Tensor segment_sum(const torch::Tensor &src, const torch::Tensor &offsets);
+
+// Weighted tensor-product messages of sender features x [nnode, dim, channels]
+// and edge spherical harmonics, summed into the receivers of receiver-sorted
+// edges, [nnode_out, sum_p (2 l3_p + 1), channels]
+torch::Tensor tp_message(const torch::Tensor &x, const torch::Tensor &sh, const torch::Tensor &weights,
+                         const torch::Tensor &senders, const torch::Tensor &offsets,
+                         const torch::Tensor &paths, const torch::Tensor &cg);
+
+}
+
+#endif
@@ -0,0 +1,151 @@
+/* ----------------------------------------------------------------------
+   Memory-mapped weight files (.phinw), see phin_weights.h
+------------------------------------------------------------------------- */
+
+#include "phin_weights.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace phin {
+
+namespace {
+
+const char MAGIC[8] = {'P', 'H', 'I', 'N', 'W', 'T', 'S', '1'};
+
+std::string unescape(const std::string &s)
+{
+  std::string out;
+  out.reserve(s.size());
+  for (size_t i = 0; i < s.size(); i++) {
+    if (s[i] == '\\' && i + 1 < s.size()) {
+      i++;
+      out += s[i] == 'n' ? '\n' : s[i];
+    } else out += s[i];
+  }
+  return out;
+}
+
+size_t dtype_size(const std::string &dtype)
+{
+  if (dtype == "float64" || dtype == "int64") return 8;
+  if (dtype == "float32" || dtype == "int32") return 4;
+  if (dtype == "float16" || dtype == "bfloat16") return 2;
+  if (dtype == "int8" || dtype == "uint8" || dtype == "bool") return 1;
+  return 0;
+}
+
+}    // namespace
+
+bool is_weight_file(const std::string &filename)
+{
+  char magic[8];
+  std::ifstream in(filename, std::ios::binary);
+  return in.read(magic, 8) && memcmp(magic, MAGIC, 8) == 0;
+}
+
+WeightFile::WeightFile(const std::string &fname) : filename(fname)
+{
+  const int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) throw std::runtime_error("cannot open weight file " + filename);
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < 16) {
+    close(fd);
+    throw std::runtime_error(filename + " is not a PHIN weight file");
+  }
+  size = st.st_size;
+  base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    base = nullptr;
+    throw std::runtime_error("cannot map weight file " + filename);
+  }
+
+  char *bytes = static_cast<char *>(base);
+  uint64_t header_size;
+  memcpy(&header_size, bytes + 8, 8);
+  if (memcmp(bytes, MAGIC, 8) != 0 || 16 + header_size > size) {
+    munmap(base, size);
+    base = nullptr;
+    throw std::runtime_error(filename + " is not a PHIN weight file");
+  }
+
+  std::istringstream header(std::string(bytes + 16, header_size));
+  std::string line;
+  while (std::getline(header, line)) {
+    std::istringstream ls(line);
+    std::string kind;
+    ls >> kind;
+    if (kind == "meta") {
+      std::string key, value;
+      ls >> key;
+      std::getline(ls >> std::ws, value);
+      meta[key] = unescape(value);
+    } else if (kind == "tensor") {
+      WeightEntry e;
+      uint64_t offset;
+      int ndim;
+      ls >> e.name >> e.dtype >> offset >> e.nbytes >> ndim;
+      e.shape.resize(ndim > 0 ? ndim : 0);
+      size_t numel = 1;
+      for (auto &d : e.shape) {
+        ls >> d;
+        numel *= d;
+      }
+      if (!ls || dtype_size(e.dtype) == 0 || numel * dtype_size(e.dtype) != e.nbytes
+          || offset % 64 != 0 || offset + e.nbytes > size) {
+        munmap(base, size);
+        base = nullptr;
+        throw std::runtime_error(filename + ": bad tensor record: " + line);
+      }
+      e.data = bytes + offset;
+      entries.push_back(e);
+    }
+  }
+}
+
+WeightFile::~WeightFile()
+{
+  if (base) munmap(base, size);
+}
+
+const WeightEntry *WeightFile::find(const std::string &name) const
+{
+  const WeightEntry *match = nullptr;
+  int nmatch = 0;
+  const std::string suffix = "." + name;
+  for (const auto &e : entries) {
+    if (e.name == name) return &e;
+    if (e.name.size() > suffix.size()
+        && e.name.compare(e.name.size() - suffix.size(), suffix.size(), suffix) == 0) {
+      match = &e;
+      nmatch++;
+    }
+  }
+  return nmatch == 1 ? match : nullptr;
+}
+
+const float *WeightFile::require(const std::string &name, const std::vector<int64_t> &shape) const
+{
+  const WeightEntry *e = find(name);
+  if (!e) throw std::runtime_error(filename + ": no (unique) tensor " + name);
+  bool ok = e->dtype == "float32" && e->shape.size() == shape.size();
+  for (size_t d = 0; ok && d < shape.size(); d++) ok = shape[d] < 0 || shape[d] == e->shape[d];
+  if (!ok) {
+    std::ostringstream msg;
+    msg << filename << ": tensor " << e->name << " must be float32 of shape (";
+    for (size_t d = 0; d < shape.size(); d++) msg << (d ? ", " : "") << shape[d];
+    msg << ")";
+    throw std::runtime_error(msg.str());
+  }
+  return static_cast<const float *>(e->data);
+}
+
+}
@@ -0,0 +1,67 @@
+/* ----------------------------------------------------------------------
+   Memory-mapped weight files (.phinw) written by tools/phin_export.py.
+
+   Layout:
+     bytes 0-7    magic "PHINWTS1"
+     bytes 8-15   uint64 (little endian) length of the text header
+     text header  one record per line,
+                    meta <key> <value>            (value escaped: \\ and \n)
+                    tensor <name> <dtype> <offset> <nbytes> <ndim> <dims...>
+     data         every tensor at a page-aligned (4096) file offset
+
+   The file is mapped copy-on-write and tensors are used in place, so
+   loading costs no copies and ranks on a node share the page cache
+   (until a page is written to, which the models never do).
+   Does not depend on LAMMPS or libtorch; errors throw std::runtime_error.
+------------------------------------------------------------------------- */
+
+#ifndef PHIN_WEIGHTS_H
+#define PHIN_WEIGHTS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace phin {
+
+struct WeightEntry {
+  std::string name;
+  std::string dtype;             // float32, float64, float16, bfloat16, int64, int32, int8, uint8, bool
+  std::vector<int64_t> shape;
+  void *data;                    // into the mapping
+  size_t nbytes;
+};
+
+class WeightFile {
+ public:
+  explicit WeightFile(const std::string &filename);
+  ~WeightFile();
+  WeightFile(const WeightFile &) = delete;
+  WeightFile &operator=(const WeightFile &) = delete;
+
+  const std::map<std::string, std::string> &metadata() const { return meta; }
+  const std::vector<WeightEntry> &tensors() const { return entries; }
+
+  // Entry called name, or else the only one whose name ends in "." + name;
+  // nullptr if there is none
+  const WeightEntry *find(const std::string &name) const;
+
+  // As find(), but float32 of the given shape (-1 matches any size), else throws
+  const float *require(const std::string &name, const std::vector<int64_t> &shape) const;
+
+ private:
+  std::string filename;
+  void *base = nullptr;
+  size_t size = 0;
+  std::map<std::string, std::string> meta;
+  std::vector<WeightEntry> entries;
+};
+
+// Whether a file starts with the .phinw magic
+bool is_weight_file(const std::string &filename);
+
+}
+
+#endif
@@ -0,0 +1,225 @@
+/* ----------------------------------------------------------------------
+   LAMMPS - Large-scale Atomic/Molecular Massively Parallel Simulator
+   https://www.lammps.org/, Sandia National Laboratories
+   Steve Plimpton, sjplimp@sandia.gov
+
+   Copyright (2003) Sandia Corporation.  Under the terms of Contract
+   DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government retains
+   certain rights in this software.  This software is distributed under
+   the GNU General Public License.
+
+   See the README file in the top-level LAMMPS directory.
+------------------------------------------------------------------------- */
+
+/* ----------------------------------------------------------------------
+   rerun/phin: evaluate pair_style phin on every frame of a text dump
+   file, batch frames per model call, instead of one rerun step each.
+
+   rerun/phin dumpfile [batch K] [output name]
+
+   Frames must be fully periodic (pp pp pp), orthogonal or triclinic,
+   with columns id, type and x y z (or xu yu zu, or xs ys zs). Every
+   frame is a separate graph built with the small cell edge builder, so
+   frames may differ in size and cell. The output has one line per atom
+   and frame:  timestep id type total_energy atomic_energy fx fy fz
+   uncertainty, with atoms in ID order.
+------------------------------------------------------------------------- */
+
+#include "rerun_phin.h"
+
+#include "atom.h"
+#include "comm.h"
+#include "domain.h"
+#include "error.h"
+#include "force.h"
+
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+#include <string>
+
+using namespace LAMMPS_NS;
+
+static constexpr int MAXLINE = 1024;
+
+void RerunPHIN::command(int narg, char **arg)
+{
+  if (narg < 1) error->all(FLERR, "Illegal rerun/phin command");
+  if (domain->box_exist == 0)
+    error->all(FLERR, "rerun/phin command before simulation box is defined");
+  if (comm->nprocs != 1) error->all(FLERR, "rerun/phin requires a single MPI rank");
+
+  std::string output = "rerun_phin.dat";
+  int batch = 16;
+  int iarg = 1;
+  while (iarg < narg) {
+    if (iarg+2 > narg) error->all(FLERR, "Illegal rerun/phin command");
+    if (strcmp(arg[iarg], "batch") == 0) {
+      batch = utils::inumeric(FLERR, arg[iarg+1], false, lmp);
+      if (batch < 1) error->all(FLERR, "Illegal rerun/phin command");
+    } else if (strcmp(arg[iarg], "output") == 0) output = arg[iarg+1];
+    else error->all(FLERR, "Illegal rerun/phin command");
+    iarg += 2;
+  }
+
+  auto pair = dynamic_cast<PairPHIN *>(force->pair_match("phin", 1));
+  if (!pair) error->all(FLERR, "rerun/phin requires pair_style phin");
+
+  fp = fopen(arg[0], "r");
+  if (!fp) error->one(FLERR, "Cannot open rerun/phin dump file {}: {}", arg[0], utils::getsyserror());
+  FILE *out = fopen(output.c_str(), "w");
+  if (!out) error->one(FLERR, "Cannot open rerun/phin output file {}: {}", output, utils::getsyserror());
+  fprintf(out, "# timestep id type total_energy atomic_energy fx fy fz uncertainty\n");
+
+  const double t_start = MPI_Wtime();
+  bigint nframes = 0, natoms = 0;
+  std::vector<PairPHIN::Frame> frames(batch);
+  std::vector<bigint> steps(batch);
+  std::vector<std::vector<tagint>> ids(batch);
+  std::vector<PairPHIN::FrameResult> results;
+  while (true) {
+    int nb = 0;
+    while (nb < batch && read_frame(frames[nb], steps[nb], ids[nb])) nb++;
+    if (nb == 0) break;
+    frames.resize(nb);
+    pair->evaluate_frames(frames, results);
+
+    for (int k = 0; k < nb; k++) {
+      const PairPHIN::FrameResult &r = results[k];
+      for (size_t a = 0; a < ids[k].size(); a++)
+        fprintf(out, BIGINT_FORMAT " " TAGINT_FORMAT " %d %.10g %.10g %.10g %.10g %.10g %.6g\n",
+                steps[k], ids[k][a], frames[k].type[a], r.energy, r.atomic_energy[a],
+                r.forces[3*a], r.forces[3*a+1], r.forces[3*a+2], r.uncertainty[a]);
+      natoms += ids[k].size();
+    }
+    nframes += nb;
+    if (nb < batch) break;
+  }
+  fclose(fp);
+  fp = nullptr;
+  fclose(out);
+
+  const double elapsed = MPI_Wtime() - t_start;
+  if (comm->me == 0)
+    utils::logmesg(lmp, "rerun/phin: {} frames ({} atoms) written to {} in {:.3f} s, {:.1f} frames/s\n",
+                   nframes, natoms, output, elapsed, elapsed > 0.0 ? nframes / elapsed : 0.0);
+}
+
+/* ----------------------------------------------------------------------
+   next frame of the dump file, atoms sorted by ID; 0 at the end of file
+------------------------------------------------------------------------- */
+
+int RerunPHIN::read_frame(PairPHIN::Frame &frame, bigint &ntimestep, std::vector<tagint> &ids)
+{
+  char line[MAXLINE];
+  auto next = [&]() {
+    if (!fgets(line, MAXLINE, fp)) error->one(FLERR, "Unexpected end of rerun/phin dump file");
+  };
+
+  bigint n = -1;
+  double lo[3], hi[3], tilt[3] = {0.0, 0.0, 0.0};
+  int have_box = 0;
+  if (!fgets(line, MAXLINE, fp)) return 0;
+  while (true) {
+    if (strncmp(line, "ITEM:", 5) != 0)
+      error->one(FLERR, "Unexpected line in rerun/phin dump file: {}", utils::trim(line));
+    const std::string item = utils::trim(line + 5);
+
+    if (item == "TIMESTEP") {
+      next();
+      ntimestep = utils::bnumeric(FLERR, utils::trim(line), false, lmp);
+    } else if (item == "NUMBER OF ATOMS") {
+      next();
+      n = utils::bnumeric(FLERR, utils::trim(line), false, lmp);
+    } else if (utils::strmatch(item, "^BOX BOUNDS")) {
+      auto words = utils::split_words(item);
+      const bool triclinic = words.size() == 8 && words[2] == "xy";
+      if (words.size() < 5 || words[words.size()-3] != "pp" || words[words.size()-2] != "pp"
+          || words[words.size()-1] != "pp")
+        error->one(FLERR, "rerun/phin requires fully periodic frames (pp pp pp)");
+      for (int d = 0; d < 3; d++) {
+        next();
+        auto values = utils::split_words(line);
+        if (values.size() < (triclinic ? 3u : 2u))
+          error->one(FLERR, "Bad box bounds in rerun/phin dump file: {}", utils::trim(line));
+        lo[d] = utils::numeric(FLERR, values[0], false, lmp);
+        hi[d] = utils::numeric(FLERR, values[1], false, lmp);
+        if (triclinic) tilt[d] = utils::numeric(FLERR, values[2], false, lmp);
+      }
+      // dump files store the bounding box of a triclinic cell
+      const double xy = tilt[0], xz = tilt[1], yz = tilt[2];
+      lo[0] -= std::min({0.0, xy, xz, xy + xz});
+      hi[0] -= std::max({0.0, xy, xz, xy + xz});
+      lo[1] -= std::min(0.0, yz);
+      hi[1] -= std::max(0.0, yz);
+      have_box = 1;
+    } else if (utils::strmatch(item, "^ATOMS")) {
+      break;
+    } else {
+      // UNITS, TIME and other single value sections
+      next();
+    }
+    next();
+  }
+  if (n < 0 || !have_box)
+    error->one(FLERR, "rerun/phin dump frame without NUMBER OF ATOMS or BOX BOUNDS");
+
+  // column of id, type and the three coordinates, and their kind
+  auto columns = utils::split_words(utils::trim(line + 5));
+  columns.erase(columns.begin());
+  int icol = -1, tcol = -1, xcol[3] = {-1, -1, -1}, scaled = 0;
+  const char *names[3][3] = {{"x", "y", "z"}, {"xu", "yu", "zu"}, {"xs", "ys", "zs"}};
+  for (size_t c = 0; c < columns.size(); c++) {
+    if (columns[c] == "id") icol = c;
+    else if (columns[c] == "type") tcol = c;
+    for (int kind = 0; kind < 3; kind++)
+      for (int d = 0; d < 3; d++)
+        if (columns[c] == names[kind][d] && (xcol[d] < 0 || kind == 1)) {
+          xcol[d] = c;
+          if (d == 0) scaled = kind == 2;
+        }
+  }
+  if (icol < 0 || tcol < 0 || xcol[0] < 0 || xcol[1] < 0 || xcol[2] < 0)
+    error->one(FLERR, "rerun/phin dump files need id, type and x y z (or xu yu zu, xs ys zs) columns");
+
+  const double lx = hi[0] - lo[0], ly = hi[1] - lo[1], lz = hi[2] - lo[2];
+  const double cell[3][3] = {{lx, 0.0, 0.0}, {tilt[0], ly, 0.0}, {tilt[1], tilt[2], lz}};
+  memcpy(frame.cell, cell, sizeof(cell));
+  for (int d = 0; d < 3; d++) frame.origin[d] = lo[d];
+
+  std::vector<tagint> tag(n);
+  std::vector<int> type(n);
+  std::vector<double> x(3*n);
+  for (bigint a = 0; a < n; a++) {
+    next();
+    auto values = utils::split_words(line);
+    if (values.size() < columns.size())
+      error->one(FLERR, "Bad atom line in rerun/phin dump file: {}", utils::trim(line));
+    tag[a] = utils::tnumeric(FLERR, values[icol], false, lmp);
+    type[a] = utils::inumeric(FLERR, values[tcol], false, lmp);
+    if (type[a] < 1 || type[a] > atom->ntypes)
+      error->one(FLERR, "Invalid atom type {} in rerun/phin dump file", type[a]);
+    double s[3];
+    for (int d = 0; d < 3; d++) s[d] = utils::numeric(FLERR, values[xcol[d]], false, lmp);
+    if (scaled) {
+      x[3*a+0] = lo[0] + s[0]*lx + s[1]*tilt[0] + s[2]*tilt[1];
+      x[3*a+1] = lo[1] + s[1]*ly + s[2]*tilt[2];
+      x[3*a+2] = lo[2] + s[2]*lz;
+    } else
+      for (int d = 0; d < 3; d++) x[3*a+d] = s[d];
+  }
+
+  std::vector<bigint> order(n);
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(), [&tag](bigint a, bigint b) { return tag[a] < tag[b]; });
+  ids.resize(n);
+  frame.type.resize(n);
+  frame.x.resize(3*n);
+  for (bigint k = 0; k < n; k++) {
+    const bigint a = order[k];
+    ids[k] = tag[a];
+    frame.type[k] = type[a];
+    for (int d = 0; d < 3; d++) frame.x[3*k+d] = x[3*a+d];
+  }
+  return 1;
+}
@@ -0,0 +1,44 @@
+/* -*- c++ -*- ----------------------------------------------------------
+   LAMMPS - Large-scale Atomic/Molecular Massively Parallel Simulator
+   https://www.lammps.org/, Sandia National Laboratories
+   Steve Plimpton, sjplimp@sandia.gov
+
+   Copyright (2003) Sandia Corporation.  Under the terms of Contract
+   DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government retains
+   certain rights in this software.  This software is distributed under
+   the GNU General Public License.
+
+   See the README file in the top-level LAMMPS directory.
+------------------------------------------------------------------------- */
+
+#ifdef COMMAND_CLASS
+
+CommandStyle(rerun/phin,RerunPHIN)
+
+#else
+
+#ifndef LMP_RERUN_PHIN_H
+#define LMP_RERUN_PHIN_H
+
+#include "command.h"
+#include "pair_phin.h"
+
+#include <cstdio>
+#include <vector>
+
+namespace LAMMPS_NS {
+
+class RerunPHIN : public Command {
+ public:
+  RerunPHIN(class LAMMPS *lmp) : Command(lmp) {}
+  void command(int, char **) override;
+
+ protected:
+  FILE *fp = nullptr;
+  int read_frame(PairPHIN::Frame &frame, bigint &ntimestep, std::vector<tagint> &ids);
+};
+
+}
+
+#endif
+#endif
@@ -0,0 +1,138 @@
+"""Benchmark the edge builders of pair_style phin (neigh internal and
+smallcell) against the LAMMPS list.
+
+Run from the repository root, with a LAMMPS binary that has the pair
+style (the LAMMPS environment variable, else `lmp`) and a model deployed
+for the species of the structure:
+
+    python tests/bench_phin_neigh.py deployed.pth tests/test_data/Cu-cubic.xyz
+    python tests/bench_phin_neigh.py deployed.pth tests/test_data/CuPd-cubic-big.xyz \\
+        [--replicate 2 2 2] [--steps 200] [--skin 2.0]
+
+Every variant runs the same NVE trajectory at the same LAMMPS neighbor
+skin (`--skin`, default 2.0, the metal-units default) after a short
+warm-up run, and reports the loop time per step, the Pair and Neigh
+rows of the LAMMPS timing breakdown, the edge-building time of the pair
+style (c_phinstats[4], averaged over the steps) and the final potential
+energy, which must agree between the variants. Run it on one MPI rank,
+as smallcell requires.
+"""
+import argparse
+import os
+import re
+import subprocess
+import sys
+import tempfile
+import textwrap
+from pathlib import Path
+
+import ase.data
+import ase.io
+
+VARIANTS = {
+    "lammps": "",
+    "internal": "neigh internal",
+    # internal list with its own skin, rebuilt only when needed
+    "internal+skin": "neigh internal neigh/skin {skin}",
+    # edges from the lattice images of the local atoms, single rank only
+    "smallcell": "smallcell yes",
+}
+
+
+def lammps_input(model, symbols, options, args):
+    masses = "\n".join(
+        f"mass {k + 1} {ase.data.atomic_masses[ase.data.atomic_numbers[s]]}" for k, s in enumerate(symbols)
+    )
+    return textwrap.dedent(
+        f"""
+        units		metal
+        atom_style	atomic
+        newton off
+        boundary p p p
+        read_data structure.data
+        replicate {' '.join(map(str, args.replicate))}
+        {{masses}}
+
+        pair_style	phin {options}
+        pair_coeff	* * {model} {' '.join(symbols)}
+        neighbor	{args.skin} bin
+        neigh_modify	delay 0 every 1 check yes
+
+        velocity	all create 300.0 {args.seed} dist gaussian
+        fix		1 all nve
+        timestep	0.001
+
+        compute		phinstats all pair phin
+        variable	tedges equal c_phinstats[4]
+        fix		tedges all ave/time 1 1 1 v_tedges ave running
+        thermo_style	custom step pe f_tedges
+        thermo_modify	format float %20.12g
+        thermo		{args.steps}
+
+        run		{args.warmup}
+        unfix		tedges
+        fix		tedges all ave/time 1 1 1 v_tedges ave running
+        run		{args.steps}
+        """
+    ).format(masses=masses)
+
+
+def run(lmp, workdir, name, text):
+    infile = Path(workdir) / f"{name}.in"
+    infile.write_text(text)
+    log = Path(workdir) / f"{name}.log"
+    subprocess.run(
+        [lmp, "-in", str(infile), "-log", str(log), "-screen", "none"], cwd=workdir, check=True
+    )
+    return log.read_text()
+
+
+def parse(log, steps):
+    # the last run's loop time, timing breakdown and thermo output
+    last = log[log.rindex("Loop time of") :]
+    loop = float(re.search(r"Loop time of (\S+)", last).group(1))
+    rows = {}
+    for row in ("Pair", "Neigh"):
+        m = re.search(rf"^{row}\s*\|\s*\S+\s*\|\s*(\S+)", last, re.M)
+        rows[row] = float(m.group(1)) if m else 0.0
+    thermo = log[: log.rindex("Loop time of")].split("\n")
+    pe, tedges = map(float, [line for line in thermo if line.strip()][-1].split()[1:3])
+    return loop / steps, rows["Pair"] / steps, rows["Neigh"] / steps, tedges, pe
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("model")
+    parser.add_argument("structure")
+    parser.add_argument("--replicate", type=int, nargs=3, default=[1, 1, 1])
+    parser.add_argument("--steps", type=int, default=200)
+    parser.add_argument("--warmup", type=int, default=20)
+    parser.add_argument("--skin", type=float, default=2.0)
+    parser.add_argument("--seed", type=int, default=4928459)
+    parser.add_argument("--lammps", default=os.environ.get("LAMMPS", "lmp"))
+    args = parser.parse_args()
+
+    atoms = ase.io.read(args.structure, index=0)
+    atoms.wrap()
+    # ase writes the types in alphabetical order of the symbols
+    symbols = sorted(set(atoms.get_chemical_symbols()))
+    model = str(Path(args.model).resolve())
+
+    natoms = len(atoms) * args.replicate[0] * args.replicate[1] * args.replicate[2]
+    print(f"{args.structure}: {natoms} atoms, skin {args.skin}, {args.steps} steps")
+    print(f"{'variant':16s} {'ms/step':>10s} {'pair ms':>10s} {'neigh ms':>10s} "
+          f"{'edges ms':>10s} {'pe':>20s}")
+    with tempfile.TemporaryDirectory() as tmpdir:
+        ase.io.write(
+            Path(tmpdir) / "structure.data", atoms, format="lammps-data", specorder=symbols, atom_style="atomic"
+        )
+        for name, options in VARIANTS.items():
+            text = lammps_input(model, symbols, options.format(skin=args.skin), args)
+            step, pair, neigh, tedges, pe = parse(run(args.lammps, tmpdir, name, text), args.steps)
+            print(f"{name:16s} {1e3 * step:10.3f} {1e3 * pair:10.3f} {1e3 * neigh:10.3f} "
+                  f"{1e3 * tedges:10.3f} {pe:20.10f}")
+    sys.stdout.flush()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,122 @@
+"""Benchmark the phin custom operators against their TorchScript compositions.
+
+Run from the repository root:
+
+    python tests/bench_phin_ops.py [--edges 1000000] [--threads N]
+
+Times forward + backward of each fused operator and of the reference
+composition from test_phin_ops.py (scripted where possible) on the same
+inputs. tp_message runs on at most 100000 edges.
+"""
+import argparse
+import math
+import sys
+from pathlib import Path
+
+import torch
+import torch.utils.benchmark as benchmark
+from torch.utils.cpp_extension import load
+
+TESTS_DIR = Path(__file__).resolve().parent
+sys.path.insert(0, str(TESTS_DIR))
+from test_phin_ops import (  # noqa: E402
+    reference_radial_basis,
+    reference_spherical_harmonics,
+    reference_tp_message,
+    random_tp_inputs,
+)
+
+
+def fwd_bwd(f, x, *args):
+    out = f(x, *args)
+    (g,) = torch.autograd.grad(out, x, torch.ones_like(out))
+    return g
+
+
+def reference_segment_sum(src, receivers, nnode: int):
+    return torch.zeros(
+        [nnode, src.shape[1]], dtype=src.dtype, device=src.device
+    ).index_add(0, receivers, src)
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--edges", type=int, default=1_000_000)
+    parser.add_argument("--threads", type=int, default=torch.get_num_threads())
+    parser.add_argument("--dtype", choices=["float32", "float64"], default="float32")
+    args = parser.parse_args()
+
+    load(
+        name="phin_ops",
+        sources=[str(TESTS_DIR.parent / "phin_ops.cpp")],
+        extra_include_paths=[str(TESTS_DIR.parent)],
+        is_python_module=False,
+        extra_cflags=["-O3", "-march=native"],
+    )
+    torch.set_num_threads(args.threads)
+    dtype = getattr(torch, args.dtype)
+
+    r_max = 5.0
+    r = (0.5 + r_max * torch.rand(args.edges, dtype=dtype)).requires_grad_(True)
+    weights = torch.arange(1, 9, dtype=dtype) * math.pi
+    vec = torch.randn(args.edges, 3, dtype=dtype).requires_grad_(True)
+    # ~30 neighbors per node, messages of 64 features
+    nnode = max(1, args.edges // 30)
+    receivers = torch.sort(torch.randint(0, nnode, (args.edges,))).values
+    offsets = torch.cat(
+        [
+            torch.zeros(1, dtype=torch.long),
+            torch.cumsum(torch.bincount(receivers, minlength=nnode), 0),
+        ]
+    )
+    msg = torch.randn(args.edges, 64, dtype=dtype).requires_grad_(True)
+    scripted_segment_sum = torch.jit.script(reference_segment_sum)
+    # lmax=3 features with 32 channels; the per-edge path weights alone
+    # are large, so cap the graph size
+    tp_edges = min(args.edges, 100_000)
+    x, sh, tp_w, senders, tp_offsets, paths, cg = random_tp_inputs(
+        max(1, tp_edges // 30), tp_edges, 3, 32, dtype
+    )
+    x.requires_grad_(True)
+    tp_rest = (sh, tp_w, senders, tp_offsets, paths, cg)
+
+    cases = {
+        "radial_basis": (
+            torch.ops.phin.radial_basis,
+            torch.jit.script(reference_radial_basis),
+            (r, weights, r_max, 6),
+        ),
+        "spherical_harmonics(lmax=3)": (
+            torch.ops.phin.spherical_harmonics,
+            reference_spherical_harmonics,  # e3nn
+            (vec, 3, True),
+        ),
+        "segment_sum(64 features)": (
+            torch.ops.phin.segment_sum,
+            lambda src, _: scripted_segment_sum(src, receivers, nnode),
+            (msg, offsets),
+        ),
+        "tp_message(lmax=3, 32 channels, <=1e5 edges)": (
+            torch.ops.phin.tp_message,
+            reference_tp_message,
+            (x,) + tp_rest,
+        ),
+    }
+
+    results = []
+    for name, (op, ref, inputs) in cases.items():
+        for label, f in (("phin op", op), ("reference", ref)):
+            t = benchmark.Timer(
+                stmt="fwd_bwd(f, *inputs)",
+                globals={"fwd_bwd": fwd_bwd, "f": f, "inputs": inputs},
+                label=f"{args.edges} edges, {args.dtype}, {args.threads} threads",
+                sub_label=name,
+                description=label,
+                num_threads=args.threads,
+            )
+            results.append(t.blocked_autorange(min_run_time=2.0))
+    benchmark.Compare(results).print()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,123 @@
+import math
+import sys
+from pathlib import Path
+
+import torch
+
+REPO_DIR = Path(__file__).resolve().parent.parent
+sys.path.insert(0, str(REPO_DIR / "tools"))
+from phin_eam_fit import (  # noqa: E402
+    EAMBasis,
+    bspline,
+    fit,
+    neighbor_pairs,
+    predict,
+    read_dump,
+    write_setfl,
+)
+
+F64 = torch.float64
+
+
+def fcc_frame(seed, a=4.05, reps=(2, 2, 2), noise=0.1):
+    g = torch.Generator().manual_seed(seed)
+    basis = torch.tensor([[0.0, 0.0, 0.0], [0.5, 0.5, 0.0], [0.5, 0.0, 0.5], [0.0, 0.5, 0.5]], dtype=F64)
+    cells = torch.stack(torch.meshgrid(*[torch.arange(n) for n in reps], indexing="ij"), -1).reshape(-1, 1, 3)
+    frac = ((cells + basis) / torch.tensor(reps, dtype=F64)).reshape(-1, 3)
+    cell = torch.diag(torch.tensor([a * n for n in reps], dtype=F64))
+    cell[1, 0] = 0.3  # some tilt
+    pos = frac @ cell + noise * torch.randn(len(frac), 3, generator=g, dtype=F64)
+    el = torch.randint(0, 2, (len(frac),), generator=g)
+    return pos, cell, el
+
+
+def reference_eam(pos, cell, el, rc):
+    # an EAM of the fitted form, with analytic embedding and pair functions
+    pos = pos.clone().requires_grad_(True)
+    i, j, _, d = neighbor_pairs(pos, cell, rc)
+    r = d.norm(dim=1)
+    x = 1.0 - r / rc
+    rho = torch.zeros(len(el), dtype=F64).index_add(0, i, x**3)
+    depth = torch.tensor([[0.4, 0.3], [0.3, 0.6]], dtype=F64)[el[i], el[j]]
+    phi = depth * (torch.exp(-2.0 * (r - 2.8)) - 2.0 * torch.exp(-(r - 2.8))) * x**2
+    scale = torch.tensor([1.0, 1.5], dtype=F64)[el]
+    energy = (-scale * torch.sqrt(rho + 0.1)).sum() + 0.5 * phi.sum()
+    (grad,) = torch.autograd.grad(energy, pos)
+    return float(energy), -grad.detach()
+
+
+def basis_density(d, rc):
+    return (1.0 - d.norm(dim=1) / rc) ** 3
+
+
+def test_bspline():
+    x = torch.linspace(0.0, 3.0, 301, dtype=F64)
+    value, slope = bspline(x, -0.5, 0.5, 10)
+    # partition of unity where the basis is complete
+    inside = (x >= 0.0) & (x <= 3.0)
+    assert torch.allclose(value[inside].sum(1), torch.ones(int(inside.sum()), dtype=F64))
+    eps = 1.0e-6
+    up, _ = bspline(x + eps, -0.5, 0.5, 10)
+    down, _ = bspline(x - eps, -0.5, 0.5, 10)
+    assert torch.allclose(slope, (up - down) / (2 * eps), atol=1.0e-6)
+
+
+def test_design_forces_are_gradients():
+    rc = 5.0
+    pos, cell, el = fcc_frame(0)
+    basis = EAMBasis(2, rc, 2.0, 12.0, npair=12, nembed=8)
+    coef = torch.randn(basis.ncoef, generator=torch.Generator().manual_seed(1), dtype=F64)
+
+    pos = pos.requires_grad_(True)
+    i, j, _, d = neighbor_pairs(pos, cell, rc)
+    e_row, f_rows = basis.design(el, i, j, d)
+    (grad,) = torch.autograd.grad(e_row @ coef, pos)
+    assert torch.allclose((f_rows @ coef).view(-1, 3), -grad, atol=1.0e-9)
+
+
+def test_fit_and_setfl(tmp_path):
+    rc = 5.0
+    samples = []
+    for seed in range(6):
+        pos, cell, el = fcc_frame(seed)
+        energy, forces = reference_eam(pos, cell, el, rc)
+        i, j, _, d = neighbor_pairs(pos, cell, rc)
+        samples.append((el, i, j, d, energy, forces))
+    rmin = min(float(s[3].norm(dim=1).min()) for s in samples)
+    rhomax = 1.2 * max(float(torch.zeros(len(s[0]), dtype=F64).index_add(0, s[1], basis_density(s[3], rc)).max())
+                       for s in samples)
+    basis = EAMBasis(2, rc, rmin, rhomax, npair=20, nembed=12)
+    coef = fit(basis, samples[:5])
+
+    el, i, j, d, energy, forces = samples[5]
+    e, f = predict(basis, coef, el, i, j, d)
+    assert abs(e - energy) / len(el) < 1.0e-2
+    assert (f - forces).norm() / forces.norm() < 0.05
+
+    path = tmp_path / "surrogate.eam.alloy"
+    write_setfl(path, ["Al", "Ni"], basis, coef, nrho=100, nr=200)
+    lines = path.read_text().splitlines()
+    assert lines[3].split() == ["2", "Al", "Ni"]
+    nrho, drho, nr, dr, cutoff = lines[4].split()
+    assert (int(nrho), int(nr)) == (100, 200)
+    assert math.isclose(float(cutoff), rc) and math.isclose(float(dr) * 199, rc)
+    assert lines[5].split()[:2] == ["13", "26.982"]
+    # F and f per element, then three r*phi tables, five values per line
+    values = " ".join(lines[5:]).split()
+    assert len(values) == 2 * (4 + 100 + 200) + 3 * 200
+    # r*phi vanishes at the cutoff
+    assert abs(float(lines[-1].split()[-1])) < 1.0e-10
+
+
+def test_read_dump(tmp_path):
+    path = tmp_path / "traj.dump"
+    path.write_text(
+        "ITEM: TIMESTEP\n100\nITEM: NUMBER OF ATOMS\n2\n"
+        "ITEM: BOX BOUNDS xy xz yz pp pp pp\n0.0 11.0 1.0\n0.0 10.0 0.0\n0.0 10.0 0.0\n"
+        "ITEM: ATOMS id type xs ys zs\n2 1 0.5 0.5 0.5\n1 2 0.0 0.0 0.0\n"
+    )
+    (frame,) = read_dump(path)
+    assert frame["timestep"] == 100
+    assert frame["types"].tolist() == [2, 1]
+    assert torch.allclose(frame["cell"], torch.tensor([[10.0, 0.0, 0.0], [1.0, 10.0, 0.0], [0.0, 0.0, 10.0]], dtype=F64))
+    assert torch.allclose(frame["pos"][1], torch.tensor([5.5, 5.0, 5.0], dtype=F64))
@@ -0,0 +1,81 @@
+import io
+import sys
+from pathlib import Path
+
+import torch
+
+REPO_DIR = Path(__file__).resolve().parent.parent
+sys.path.insert(0, str(REPO_DIR / "tools"))
+from phin_export import (  # noqa: E402
+    ALIGN,
+    TORCHSCRIPT_ENTRY,
+    read_phinw,
+    strip_tensors,
+    write_phinw,
+)
+
+
+def test_phinw_roundtrip(tmp_path):
+    tensors = {
+        "layers.0.weight": torch.randn(7, 5),
+        "layers.0.bessel_weights": torch.arange(1, 9, dtype=torch.float64),
+        "type_ids": torch.tensor([3, 1, 2]),
+        "scalar": torch.tensor(2.5),
+        "mask": torch.tensor([True, False, True]),
+        "empty": torch.zeros(0, 4),
+    }
+    metadata = {"r_max": "4.0", "type_names": "Cu Pd", "config": "a: 1\nb: c\\d\n"}
+    path = tmp_path / "model.phinw"
+    write_phinw(path, tensors, metadata)
+
+    read, meta = read_phinw(path)
+    assert meta == metadata
+    assert read.keys() == tensors.keys()
+    for name, t in tensors.items():
+        assert read[name].dtype == t.dtype
+        assert torch.equal(read[name], t)
+
+    # every tensor is page-aligned
+    header = path.read_bytes()[16:].split(b"\n")
+    for line in header:
+        if line.startswith(b"tensor "):
+            assert int(line.split()[3]) % ALIGN == 0
+
+
+class Tiny(torch.nn.Module):
+    def __init__(self):
+        super().__init__()
+        self.layers = torch.nn.Sequential(torch.nn.Linear(4, 8), torch.nn.SiLU(), torch.nn.Linear(8, 1))
+        self.register_buffer("shift", torch.tensor([0.5]))
+
+    def forward(self, x):
+        return self.layers(x) + self.shift
+
+
+def test_torchscript_skeleton(tmp_path):
+    # what pair_style phin does with a .phinw: load the stripped module and
+    # put the mapped tensors back in place
+    model = torch.jit.script(Tiny())
+    tensors = dict(model.named_parameters())
+    tensors.update(dict(model.named_buffers()))
+    tensors[TORCHSCRIPT_ENTRY] = strip_tensors(model, dict(tensors), {"r_max": "4.0"})
+    path = tmp_path / "model.phinw"
+    write_phinw(path, tensors, {"r_max": "4.0"})
+
+    read, _ = read_phinw(path)
+    skeleton_bytes = read.pop(TORCHSCRIPT_ENTRY).numpy().tobytes()
+    # the skeleton carries no tensor data
+    assert len(skeleton_bytes) < 64 * 1024
+    extra_files = {"r_max": ""}
+    skeleton = torch.jit.load(io.BytesIO(skeleton_bytes), _extra_files=extra_files)
+    assert extra_files["r_max"] in ("4.0", b"4.0")
+    assert all(p.numel() == 0 for p in skeleton.parameters())
+    for name, t in read.items():
+        *path_, attr = name.split(".")
+        module = skeleton
+        for part in path_:
+            module = getattr(module, part)
+        setattr(module, attr, t)
+
+    x = torch.randn(10, 4)
+    assert torch.equal(skeleton(x), model(x))
@@ -0,0 +1,247 @@
+import pytest
+
+import math
+from pathlib import Path
+
+import torch
+from e3nn import o3
+from torch.utils.cpp_extension import load
+
+REPO_DIR = Path(__file__).resolve().parent.parent
+
+
+@pytest.fixture(scope="module")
+def phin_ops():
+    # build the LAMMPS-independent operator library on its own,
+    # which registers torch.ops.phin.*
+    load(
+        name="phin_ops",
+        sources=[str(REPO_DIR / "phin_ops.cpp")],
+        extra_include_paths=[str(REPO_DIR)],
+        is_python_module=False,
+    )
+    return torch.ops.phin
+
+
+def reference_radial_basis(r, weights, r_max: float, p: int):
+    # nequip.nn.radial_basis.BesselBasis * nequip.nn.cutoffs.PolynomialCutoff
+    x = r / r_max
+    basis = (2.0 / r_max) * torch.sin(weights * x.unsqueeze(-1)) / r.unsqueeze(-1)
+    envelope = (
+        1.0
+        - ((p + 1.0) * (p + 2.0) / 2.0) * torch.pow(x, p)
+        + (p * (p + 2.0)) * torch.pow(x, p + 1.0)
+        - (p * (p + 1.0) / 2.0) * torch.pow(x, p + 2.0)
+    ) * (x < 1.0)
+    return basis * envelope.unsqueeze(-1)
+
+
+def reference_spherical_harmonics(vec, lmax: int, normalize: bool = True):
+    # e3nn, as used by the deployed models: real spherical harmonics with
+    # y as the polar axis and "component" normalization
+    return o3.spherical_harmonics(list(range(lmax + 1)), vec, normalize, normalization="component")
+
+
+@pytest.mark.parametrize("dtype", [torch.float32, torch.float64])
+@pytest.mark.parametrize("num_basis", [3, 8, 19])
+@pytest.mark.parametrize("p", [6, 3])
+def test_radial_basis(phin_ops, dtype, num_basis, p):
+    r_max = 4.5
+    torch.manual_seed(0)
+    # include some lengths beyond the cutoff
+    r = (0.3 + 1.2 * r_max * torch.rand(5000)).to(dtype).requires_grad_(True)
+    weights = (torch.arange(1, num_basis + 1) * math.pi).to(dtype).requires_grad_(True)
+
+    out = phin_ops.radial_basis(r, weights, r_max, p)
+    ref = reference_radial_basis(r, weights, r_max, p)
+    atol = 1e-5 if dtype == torch.float32 else 1e-10
+    assert torch.allclose(out, ref, atol=atol)
+
+    grad_out = torch.randn_like(out)
+    g_r, g_w = torch.autograd.grad(out, [r, weights], grad_out)
+    ref_r, ref_w = torch.autograd.grad(ref, [r, weights], grad_out)
+    assert torch.allclose(g_r, ref_r, atol=atol, rtol=1e-4)
+    assert torch.allclose(g_w, ref_w, atol=10 * atol, rtol=1e-4)
+
+
+def test_radial_basis_gradcheck(phin_ops):
+    r = (0.5 + 4.0 * torch.rand(40, dtype=torch.float64)).requires_grad_(True)
+    weights = (torch.arange(1, 9, dtype=torch.float64) * math.pi).requires_grad_(True)
+    f = lambda r, w: phin_ops.radial_basis(r, w, 4.0, 6)
+    assert torch.autograd.gradcheck(f, (r, weights))
+    # double backward goes through the reference composition
+    assert torch.autograd.gradgradcheck(f, (r, weights))
+
+
+def test_radial_basis_torchscript(phin_ops):
+    @torch.jit.script
+    def f(r, w):
+        return torch.ops.phin.radial_basis(r, w, 5.0, 6)
+
+    r = 0.5 + 5.0 * torch.rand(100)
+    w = torch.arange(1, 9) * math.pi
+    assert torch.allclose(f(r, w), reference_radial_basis(r, w, 5.0, 6), atol=1e-5)
+
+
+@pytest.mark.parametrize("dtype", [torch.float32, torch.float64])
+@pytest.mark.parametrize("lmax", [0, 1, 2, 3])
+@pytest.mark.parametrize("normalize", [True, False])
+def test_spherical_harmonics(phin_ops, dtype, lmax, normalize):
+    torch.manual_seed(0)
+    # odd edge count to exercise the scalar tail after the SIMD blocks
+    vec = (3.0 * torch.randn(4099, 3)).to(dtype).requires_grad_(True)
+
+    out = phin_ops.spherical_harmonics(vec, lmax, normalize)
+    ref = reference_spherical_harmonics(vec, lmax, normalize)
+    atol, rtol = (1e-4, 1e-4) if dtype == torch.float32 else (1e-10, 1e-8)
+    assert out.shape == (4099, (lmax + 1) ** 2)
+    assert torch.allclose(out, ref, atol=atol, rtol=rtol)
+
+    grad_out = torch.randn_like(out)
+    (g,) = torch.autograd.grad(out, vec, grad_out)
+    if lmax == 0:
+        # constant, the reference is not even connected to vec
+        assert torch.all(g == 0)
+    else:
+        (ref_g,) = torch.autograd.grad(ref, vec, grad_out)
+        assert torch.allclose(g, ref_g, atol=atol, rtol=rtol)
+
+    if normalize:
+        # component normalization: every l block has squared norm 2l+1
+        norms = torch.stack(
+            [out[:, l * l : (l + 1) ** 2].pow(2).sum(-1) for l in range(lmax + 1)],
+            dim=-1,
+        )
+        expected = torch.tensor([2.0 * l + 1 for l in range(lmax + 1)], dtype=dtype)
+        assert torch.allclose(norms, expected.expand_as(norms), rtol=1e-4)
+
+
+def test_spherical_harmonics_gradcheck(phin_ops):
+    vec = torch.randn(30, 3, dtype=torch.float64).requires_grad_(True)
+    f = lambda v: phin_ops.spherical_harmonics(v, 3, True)
+    assert torch.autograd.gradcheck(f, (vec,))
+    assert torch.autograd.gradgradcheck(f, (vec,))
+
+
+def random_offsets(nnode: int, nedge: int):
+    # receiver-sorted edge ranges, including nodes with no edges
+    receivers = torch.sort(torch.randint(0, nnode, (nedge,))).values
+    counts = torch.bincount(receivers, minlength=nnode)
+    return torch.cat([torch.zeros(1, dtype=torch.long), torch.cumsum(counts, 0)]), receivers
+
+
+@pytest.mark.parametrize("dtype", [torch.float32, torch.float64])
+@pytest.mark.parametrize("shape", [(), (7,), (16,), (5, 9)])
+def test_segment_sum(phin_ops, dtype, shape):
+    torch.manual_seed(0)
+    offsets, receivers = random_offsets(300, 5000)
+    src = torch.randn((5000,) + shape, dtype=dtype).requires_grad_(True)
+
+    out = phin_ops.segment_sum(src, offsets)
+    ref = torch.zeros((300,) + shape, dtype=dtype).index_add(0, receivers, src)
+    atol = 1e-4 if dtype == torch.float32 else 1e-10
+    assert out.shape == ref.shape
+    assert torch.allclose(out, ref, atol=atol)
+
+    grad_out = torch.randn_like(out)
+    (g,) = torch.autograd.grad(out, src, grad_out)
+    (ref_g,) = torch.autograd.grad(ref, src, grad_out)
+    assert torch.equal(g, ref_g)
+
+
+def test_segment_sum_gradcheck(phin_ops):
+    offsets, _ = random_offsets(10, 40)
+    src = torch.randn(40, 3, dtype=torch.float64).requires_grad_(True)
+    f = lambda s: phin_ops.segment_sum(s, offsets)
+    assert torch.autograd.gradcheck(f, (src,))
+    assert torch.autograd.gradgradcheck(f, (src,))
+
+
+def test_segment_sum_bad_offsets(phin_ops):
+    src = torch.randn(10, 4)
+    with pytest.raises(RuntimeError):
+        phin_ops.segment_sum(src, torch.tensor([0, 4, 8]))
+    with pytest.raises(RuntimeError):
+        phin_ops.segment_sum(src, torch.tensor([0, 6, 4, 10]))
+
+
+def reference_tp_message(x, sh, weights, senders, offsets, paths, cg):
+    # per-edge einsum followed by the scatter onto the receivers
+    nnode = offsets.shape[0] - 1
+    receivers = torch.repeat_interleave(torch.arange(nnode), offsets[1:] - offsets[:-1])
+    xj = x[senders]
+    msg = []
+    k = 0
+    for l1, l2, l3 in paths.tolist():
+        n = (2 * l1 + 1) * (2 * l2 + 1) * (2 * l3 + 1)
+        cgp = cg[k : k + n].view(2 * l1 + 1, 2 * l2 + 1, 2 * l3 + 1)
+        k += n
+        msg.append(
+            torch.einsum(
+                "eiu,ej,ijk,eu->eku",
+                xj[:, l1 * l1 : (l1 + 1) ** 2],
+                sh[:, l2 * l2 : (l2 + 1) ** 2],
+                cgp,
+                weights[:, len(msg)],
+            )
+        )
+    msg = torch.cat(msg, dim=1)
+    return torch.zeros(nnode, msg.shape[1], msg.shape[2], dtype=x.dtype).index_add(
+        0, receivers, msg
+    )
+
+
+def random_tp_inputs(nnode, nedge, lmax, nchan, dtype):
+    paths = torch.tensor(
+        [
+            [l1, l2, l3]
+            for l1 in range(lmax + 1)
+            for l2 in range(lmax + 1)
+            for l3 in range(abs(l1 - l2), min(l1 + l2, lmax) + 1)
+        ]
+    )
+    ncg = sum((2 * a + 1) * (2 * b + 1) * (2 * c + 1) for a, b, c in paths.tolist())
+    # sparse, like real coupling coefficients
+    cg = torch.randn(ncg, dtype=dtype) * (torch.rand(ncg) < 0.3)
+    offsets, _ = random_offsets(nnode, nedge)
+    senders = torch.randint(0, nnode, (nedge,))
+    dim = (lmax + 1) ** 2
+    x = torch.randn(nnode, dim, nchan, dtype=dtype)
+    sh = torch.randn(nedge, dim, dtype=dtype)
+    weights = torch.randn(nedge, len(paths), nchan, dtype=dtype)
+    return x, sh, weights, senders, offsets, paths, cg
+
+
+@pytest.mark.parametrize("dtype", [torch.float32, torch.float64])
+@pytest.mark.parametrize("lmax", [0, 1, 2, 3])
+@pytest.mark.parametrize("nchan", [5, 32])
+def test_tp_message(phin_ops, dtype, lmax, nchan):
+    torch.manual_seed(0)
+    x, sh, weights, senders, offsets, paths, cg = random_tp_inputs(
+        200, 3000, lmax, nchan, dtype
+    )
+    for t in (x, sh, weights):
+        t.requires_grad_(True)
+
+    out = phin_ops.tp_message(x, sh, weights, senders, offsets, paths, cg)
+    ref = reference_tp_message(x, sh, weights, senders, offsets, paths, cg)
+    atol, rtol = (1e-4, 1e-4) if dtype == torch.float32 else (1e-10, 1e-8)
+    assert out.shape == ref.shape
+    assert torch.allclose(out, ref, atol=atol, rtol=rtol)
+
+    grad_out = torch.randn_like(out)
+    grads = torch.autograd.grad(out, [x, sh, weights], grad_out)
+    ref_grads = torch.autograd.grad(ref, [x, sh, weights], grad_out)
+    for g, ref_g in zip(grads, ref_grads):
+        assert torch.allclose(g, ref_g, atol=10 * atol, rtol=rtol)
+
+
+def test_tp_message_gradcheck(phin_ops):
+    torch.manual_seed(0)
+    x, sh, weights, senders, offsets, paths, cg = random_tp_inputs(
+        6, 20, 2, 3, torch.float64
+    )
+    f = lambda x, sh, w: phin_ops.tp_message(x, sh, w, senders, offsets, paths, cg)
+    inputs = tuple(t.requires_grad_(True) for t in (x, sh, weights))
+    assert torch.autograd.gradcheck(f, inputs)
+    assert torch.autograd.gradgradcheck(f, inputs)
@@ -0,0 +1,439 @@
+"""Fit a tabulated eam/alloy surrogate to a deployed PHIN model.
+
+    python tools/phin_eam_fit.py traj.dump --elements Al O --model deployed.pth -o surrogate.eam.alloy
+    python tools/phin_eam_fit.py traj.dump --elements Al O --reference rerun_phin.dat -o surrogate.eam.alloy
+
+The reference energies and forces on the frames of a LAMMPS text dump
+(fully periodic, with id, type and x y z / xu yu zu / xs ys zs columns)
+come either from the pair style, as the output of `rerun/phin` on the same
+dump, or from evaluating the TorchScript model here.
+
+The surrogate is an embedded-atom model
+
+    E = sum_i F_a(rho_i) + 1/2 sum_ij phi_ab(r_ij),   rho_i = sum_j (1 - r_ij/rc)^p
+
+with cubic B-spline F_a and phi_ab, which makes energies and forces linear
+in the spline coefficients: they are fitted in one regularized least
+squares problem and tabulated in the setfl format of `pair_style
+eam/alloy`. Below the shortest sampled distance phi continues with a
+repulsive wall, and above the largest sampled density F continues
+linearly, so the surrogate stays usable for pre-equilibration slightly
+outside the sampled configurations.
+"""
+import argparse
+import math
+
+import torch
+
+SYMBOLS = (
+    "H He Li Be B C N O F Ne Na Mg Al Si P S Cl Ar K Ca Sc Ti V Cr Mn Fe Co Ni Cu Zn "
+    "Ga Ge As Se Br Kr Rb Sr Y Zr Nb Mo Tc Ru Rh Pd Ag Cd In Sn Sb Te I Xe Cs Ba La Ce "
+    "Pr Nd Pm Sm Eu Gd Tb Dy Ho Er Tm Yb Lu Hf Ta W Re Os Ir Pt Au Hg Tl Pb Bi Po At Rn"
+).split()
+MASSES = [
+    1.008, 4.0026, 6.94, 9.0122, 10.81, 12.011, 14.007, 15.999, 18.998, 20.180,
+    22.990, 24.305, 26.982, 28.085, 30.974, 32.06, 35.45, 39.948, 39.098, 40.078,
+    44.956, 47.867, 50.942, 51.996, 54.938, 55.845, 58.933, 58.693, 63.546, 65.38,
+    69.723, 72.630, 74.922, 78.971, 79.904, 83.798, 85.468, 87.62, 88.906, 91.224,
+    92.906, 95.95, 98.0, 101.07, 102.91, 106.42, 107.87, 112.41, 114.82, 118.71,
+    121.76, 127.60, 126.90, 131.29, 132.91, 137.33, 138.91, 140.12, 140.91, 144.24,
+    145.0, 150.36, 151.96, 157.25, 158.93, 162.50, 164.93, 167.26, 168.93, 173.05,
+    174.97, 178.49, 180.95, 183.84, 186.21, 190.23, 192.22, 195.08, 196.97, 200.59,
+    204.38, 207.2, 208.98, 209.0, 210.0, 222.0,
+]
+
+
+# ---------------------------------------------------------------------------
+# input
+
+
+def read_dump(path):
+    """Frames of a LAMMPS text dump as dicts with timestep, cell (rows a, b, c),
+    types (LAMMPS, 1-based) and pos, atoms sorted by ID."""
+    frames = []
+    with open(path) as f:
+        lines = iter(f.read().splitlines())
+    line = next(lines, None)
+    while line is not None:
+        frame = {}
+        while not line.startswith("ITEM: ATOMS"):
+            item = line[5:].strip()
+            if item == "TIMESTEP":
+                frame["timestep"] = int(next(lines))
+            elif item == "NUMBER OF ATOMS":
+                frame["natoms"] = int(next(lines))
+            elif item.startswith("BOX BOUNDS"):
+                words = item.split()
+                if words[-3:] != ["pp", "pp", "pp"]:
+                    raise ValueError(f"{path}: frames must be fully periodic (pp pp pp)")
+                bounds = [[float(v) for v in next(lines).split()] for _ in range(3)]
+                xy, xz, yz = (b[2] for b in bounds) if len(words) == 8 else (0.0, 0.0, 0.0)
+                # dump files store the bounding box of a triclinic cell
+                lo = [
+                    bounds[0][0] - min(0.0, xy, xz, xy + xz),
+                    bounds[1][0] - min(0.0, yz),
+                    bounds[2][0],
+                ]
+                hi = [
+                    bounds[0][1] - max(0.0, xy, xz, xy + xz),
+                    bounds[1][1] - max(0.0, yz),
+                    bounds[2][1],
+                ]
+                frame["cell"] = torch.tensor(
+                    [[hi[0] - lo[0], 0.0, 0.0], [xy, hi[1] - lo[1], 0.0], [xz, yz, hi[2] - lo[2]]],
+                    dtype=torch.float64,
+                )
+                frame["origin"] = torch.tensor(lo, dtype=torch.float64)
+            else:
+                next(lines)
+            line = next(lines)
+        if "natoms" not in frame or "cell" not in frame:
+            raise ValueError(f"{path}: frame without NUMBER OF ATOMS or BOX BOUNDS")
+
+        columns = line.split()[2:]
+        for names in (("xu", "yu", "zu"), ("x", "y", "z"), ("xs", "ys", "zs")):
+            if all(n in columns for n in names):
+                break
+        else:
+            raise ValueError(f"{path}: need x y z, xu yu zu or xs ys zs columns")
+        if "id" not in columns or "type" not in columns:
+            raise ValueError(f"{path}: need id and type columns")
+        rows = [next(lines).split() for _ in range(frame["natoms"])]
+        rows.sort(key=lambda r: int(r[columns.index("id")]))
+        frame["types"] = torch.tensor([int(r[columns.index("type")]) for r in rows])
+        pos = torch.tensor([[float(r[columns.index(n)]) for n in names] for r in rows], dtype=torch.float64)
+        if names[0] == "xs":
+            pos = frame["origin"] + pos @ frame["cell"]
+        frame["pos"] = pos
+        frames.append(frame)
+        line = next(lines, None)
+    return frames
+
+
+def read_reference(path):
+    """Total energies and forces (atoms in ID order) per timestep from rerun/phin output."""
+    data = {}
+    with open(path) as f:
+        for line in f:
+            if line.startswith("#") or not line.strip():
+                continue
+            v = line.split()
+            step = int(v[0])
+            if step not in data:
+                data[step] = [float(v[3]), []]
+            data[step][1].append([float(x) for x in v[5:8]])
+    return {step: (e, torch.tensor(f, dtype=torch.float64)) for step, (e, f) in data.items()}
+
+
+# ---------------------------------------------------------------------------
+# graph and model
+
+
+def neighbor_pairs(pos, cell, rc):
+    """Directed pairs (i, j, shift) with d = pos[j] + shift @ cell - pos[i], |d| < rc."""
+    inv = torch.linalg.inv(cell)
+    image = torch.floor(pos @ inv)
+    wrapped = pos - image @ cell
+    # perpendicular widths of the cell give the images that can be in range
+    vol = torch.det(cell).abs()
+    widths = [vol / torch.linalg.cross(cell[(d + 1) % 3], cell[(d + 2) % 3]).norm() for d in range(3)]
+    reach = [int(math.ceil(rc / w)) for w in widths]
+
+    n = len(pos)
+    ii, jj, ss = [], [], []
+    for a in range(-reach[0], reach[0] + 1):
+        for b in range(-reach[1], reach[1] + 1):
+            for c in range(-reach[2], reach[2] + 1):
+                shift = torch.tensor([a, b, c], dtype=torch.float64)
+                d = wrapped.unsqueeze(0) + (shift @ cell) - wrapped.unsqueeze(1)
+                mask = (d * d).sum(-1) < rc * rc
+                if a == 0 and b == 0 and c == 0:
+                    mask.fill_diagonal_(False)
+                i, j = mask.nonzero(as_tuple=True)
+                ii.append(i)
+                jj.append(j)
+                ss.append(shift.expand(len(i), 3))
+    i, j, s = torch.cat(ii), torch.cat(jj), torch.cat(ss)
+    # shifts for the original (possibly unwrapped) positions
+    s = s - image[j] + image[i]
+    d = pos[j] + s @ cell - pos[i]
+    return i, j, s, d
+
+
+def evaluate_model(model, frame, species, rmax):
+    """Energy and forces of the TorchScript model on one frame."""
+    i, j, s, _ = neighbor_pairs(frame["pos"], frame["cell"], rmax)
+    data = {
+        "pos": frame["pos"].float(),
+        "edge_index": torch.stack([i, j]),
+        "edge_cell_shift": s.float(),
+        "cell": frame["cell"].float(),
+        "atom_types": species[frame["types"]],
+    }
+    out = model(data)
+    return float(out["total_energy"].sum()), out["forces"].detach().double()
+
+
+# ---------------------------------------------------------------------------
+# splines
+
+
+def bspline(x, x0, h, n):
+    """Uniform cubic B-spline basis centered at x0 + k h, k < n, and its derivative."""
+    t = (x.unsqueeze(-1) - x0 - h * torch.arange(n, dtype=x.dtype)) / h
+    a = t.abs()
+    inner = a < 1.0
+    outer = (a >= 1.0) & (a < 2.0)
+    value = torch.where(inner, 2.0 / 3.0 - a * a + 0.5 * a**3, torch.where(outer, (2.0 - a) ** 3 / 6.0, 0.0 * a))
+    slope = torch.where(
+        inner, -2.0 * t + 1.5 * t * a, torch.where(outer, -0.5 * (2.0 - a) ** 2 * torch.sign(t), 0.0 * a)
+    )
+    return value, slope / h
+
+
+class EAMBasis:
+    """Spline bases of phi_ab on [rmin, rc] (vanishing smoothly at rc) and
+    F_a on [0, rhomax], with rho from (1 - r/rc)^p."""
+
+    def __init__(self, nelements, rc, rmin, rhomax, npair=24, nembed=16, power=3):
+        self.nel, self.rc, self.p = nelements, rc, power
+        self.npairtypes = nelements * (nelements + 1) // 2
+        self.rmin, self.rhomax = rmin, rhomax
+        self.npair, self.nembed = npair, nembed
+        # the last pair knot support ends at rc; the embedding one covers [0, rhomax]
+        self.hr = (rc - rmin) / (npair + 1)
+        self.hrho = rhomax / (nembed - 3)
+        self.ncoef = self.npairtypes * npair + nelements * nembed
+
+    def pair_type(self, a, b):
+        hi, lo = torch.maximum(a, b), torch.minimum(a, b)
+        return hi * (hi + 1) // 2 + lo
+
+    def density(self, r):
+        x = (1.0 - r / self.rc).clamp(min=0.0)
+        return x**self.p, -self.p / self.rc * x ** (self.p - 1)
+
+    def pair(self, r):
+        return bspline(r, self.rmin, self.hr, self.npair)
+
+    def embed(self, rho):
+        return bspline(rho, -self.hrho, self.hrho, self.nembed)
+
+    def design(self, el, i, j, d):
+        """Energy row [ncoef] and force rows [3N, ncoef] of one frame."""
+        n = len(el)
+        r = d.norm(dim=1)
+        u = d / r.unsqueeze(1)
+        ntp, nel = self.npairtypes, self.nel
+
+        t = self.pair_type(el[i], el[j])
+        b, db = self.pair(r)
+        e_pair = torch.zeros(ntp, self.npair, dtype=r.dtype).index_add_(0, t, 0.5 * b)
+        g = 0.5 * db.unsqueeze(2) * u.unsqueeze(1)
+        f_pair = torch.zeros(n * ntp, self.npair, 3, dtype=r.dtype)
+        f_pair.index_add_(0, j * ntp + t, -g).index_add_(0, i * ntp + t, g)
+
+        f, df = self.density(r)
+        rho = torch.zeros(n, dtype=r.dtype).index_add_(0, i, f)
+        c, dc = self.embed(rho)
+        e_emb = torch.zeros(nel, self.nembed, dtype=r.dtype).index_add_(0, el, c)
+        g = dc[i].unsqueeze(2) * (df.unsqueeze(1) * u).unsqueeze(1)
+        f_emb = torch.zeros(n * nel, self.nembed, 3, dtype=r.dtype)
+        f_emb.index_add_(0, j * nel + el[i], -g).index_add_(0, i * nel + el[i], g)
+
+        energy = torch.cat([e_pair.reshape(-1), e_emb.reshape(-1)])
+        forces = torch.cat(
+            [
+                f_pair.view(n, ntp, self.npair, 3).permute(0, 3, 1, 2).reshape(3 * n, -1),
+                f_emb.view(n, nel, self.nembed, 3).permute(0, 3, 1, 2).reshape(3 * n, -1),
+            ],
+            dim=1,
+        )
+        return energy, forces
+
+    def smoothness(self):
+        """Second differences of the coefficients within every spline."""
+        rows = []
+        blocks = [(k * self.npair, self.npair) for k in range(self.npairtypes)]
+        blocks += [(self.npairtypes * self.npair + k * self.nembed, self.nembed) for k in range(self.nel)]
+        for start, size in blocks:
+            for k in range(size - 2):
+                row = torch.zeros(self.ncoef, dtype=torch.float64)
+                row[start + k : start + k + 3] = torch.tensor([1.0, -2.0, 1.0], dtype=torch.float64)
+                rows.append(row)
+        return torch.stack(rows)
+
+
+def fit(basis, frames, energy_weight=1.0, force_weight=1.0, smooth=1.0e-4):
+    """Spline coefficients from frames of (el, i, j, d, energy, forces)."""
+    rows, rhs = [], []
+    for el, i, j, d, energy, forces in frames:
+        n = len(el)
+        e_row, f_rows = basis.design(el, i, j, d)
+        # energy per atom and force components weigh alike across frame sizes
+        rows.append(energy_weight * e_row.unsqueeze(0) / n)
+        rhs.append(torch.tensor([energy_weight * energy / n], dtype=torch.float64))
+        scale = force_weight / math.sqrt(3 * n)
+        rows.append(scale * f_rows)
+        rhs.append(scale * forces.reshape(-1))
+    reg = math.sqrt(smooth) * basis.smoothness()
+    a = torch.cat(rows + [reg])
+    b = torch.cat(rhs + [torch.zeros(len(reg), dtype=torch.float64)])
+    return torch.linalg.lstsq(a, b.unsqueeze(1), driver="gelsd").solution.squeeze(1)
+
+
+def predict(basis, coef, el, i, j, d):
+    e_row, f_rows = basis.design(el, i, j, d)
+    return float(e_row @ coef), (f_rows @ coef).view(-1, 3)
+
+
+# ---------------------------------------------------------------------------
+# output
+
+
+def tabulate(basis, coef, nrho=2000, nr=2000, wall=10.0):
+    """F_a(rho), f(r) and r*phi_ab(r) on the setfl grids."""
+    rhomax_tab = 2.0 * basis.rhomax
+    drho = rhomax_tab / (nrho - 1)
+    dr = basis.rc / (nr - 1)
+    rho = torch.arange(nrho, dtype=torch.float64) * drho
+    r = torch.arange(nr, dtype=torch.float64) * dr
+    npc = basis.npairtypes * basis.npair
+
+    embed = []
+    c_max, dc_max = basis.embed(torch.tensor([basis.rhomax], dtype=torch.float64))
+    c, _ = basis.embed(rho)
+    for a in range(basis.nel):
+        w = coef[npc + a * basis.nembed : npc + (a + 1) * basis.nembed]
+        value = c @ w
+        # continue linearly above the sampled densities
+        f0, df0 = float(c_max[0] @ w), float(dc_max[0] @ w)
+        embed.append(torch.where(rho > basis.rhomax, f0 + df0 * (rho - basis.rhomax), value))
+
+    density, _ = basis.density(r)
+
+    pairs = []
+    rmin = torch.tensor([basis.rmin], dtype=torch.float64)
+    b0, db0 = basis.pair(rmin)
+    b, _ = basis.pair(r)
+    for k in range(basis.npairtypes):
+        w = coef[k * basis.npair : (k + 1) * basis.npair]
+        phi = b @ w
+        # repulsive wall below the shortest sampled distance
+        p0, dp0 = float(b0[0] @ w), min(float(db0[0] @ w), 0.0)
+        x = r - basis.rmin
+        phi = torch.where(r < basis.rmin, p0 + dp0 * x + wall * x * x, phi)
+        pairs.append(r * phi)
+    return drho, dr, embed, density, pairs
+
+
+def write_setfl(path, elements, basis, coef, nrho=2000, nr=2000, wall=10.0, comment=""):
+    drho, dr, embed, density, pairs = tabulate(basis, coef, nrho, nr, wall)
+
+    def block(values):
+        v = [f"{x:.16e}" for x in values.tolist()]
+        return "\n".join(" ".join(v[k : k + 5]) for k in range(0, len(v), 5)) + "\n"
+
+    with open(path, "w") as f:
+        f.write("PHIN eam/alloy surrogate (tools/phin_eam_fit.py)\n")
+        f.write(f"{comment}\n")
+        f.write(f"rho = (1 - r/rc)^{basis.p}, {basis.npair} pair and {basis.nembed} embedding knots\n")
+        f.write(f"{len(elements)} {' '.join(elements)}\n")
+        f.write(f"{nrho} {drho:.16e} {nr} {dr:.16e} {basis.rc:.16e}\n")
+        for a, name in enumerate(elements):
+            z = SYMBOLS.index(name) + 1 if name in SYMBOLS else 0
+            mass = MASSES[z - 1] if z else 1.0
+            f.write(f"{z} {mass} 0.0 none\n")
+            f.write(block(embed[a]))
+            f.write(block(density))
+        for k in range(basis.npairtypes):
+            f.write(block(pairs[k]))
+
+
+# ---------------------------------------------------------------------------
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("dump", nargs="+", help="LAMMPS text dump file(s) with the sampled frames")
+    parser.add_argument("--elements", nargs="+", required=True, help="element of each LAMMPS atom type")
+    source = parser.add_mutually_exclusive_group(required=True)
+    source.add_argument("--model", help="deployed TorchScript model to evaluate on the frames")
+    source.add_argument("--reference", help="rerun/phin output for the same frames")
+    parser.add_argument("-o", "--output", default="phin.eam.alloy")
+    parser.add_argument("--cutoff", type=float, help="surrogate cutoff (default: r_max of the model)")
+    parser.add_argument("--pair-knots", type=int, default=24)
+    parser.add_argument("--embed-knots", type=int, default=16)
+    parser.add_argument("--density-power", type=int, default=3)
+    parser.add_argument("--energy-weight", type=float, default=1.0)
+    parser.add_argument("--force-weight", type=float, default=1.0)
+    parser.add_argument("--smooth", type=float, default=1.0e-4, help="weight of the curvature penalty")
+    parser.add_argument("--validation", type=float, default=0.1, help="fraction of frames held out")
+    parser.add_argument("--nr", type=int, default=2000)
+    parser.add_argument("--nrho", type=int, default=2000)
+    parser.add_argument("--wall", type=float, default=10.0, help="curvature of the short-range wall")
+    args = parser.parse_args()
+
+    frames = [fr for path in args.dump for fr in read_dump(path)]
+    # LAMMPS type -> surrogate element index
+    elements = list(dict.fromkeys(args.elements))
+    el_of_type = torch.tensor([0] + [elements.index(e) for e in args.elements])
+
+    if args.model:
+        extra_files = {"r_max": "", "type_names": ""}
+        model = torch.jit.load(args.model, map_location="cpu", _extra_files=extra_files)
+        meta = {k: v.decode() if isinstance(v, bytes) else v for k, v in extra_files.items()}
+        type_names = meta["type_names"].split()
+        species = torch.tensor([0] + [type_names.index(e) for e in args.elements])
+        rmax = float(meta["r_max"])
+        cutoff = args.cutoff or rmax
+        references = [evaluate_model(model, fr, species, rmax) for fr in frames]
+    else:
+        if not args.cutoff:
+            parser.error("--cutoff is required with --reference")
+        cutoff = args.cutoff
+        data = read_reference(args.reference)
+        missing = [fr["timestep"] for fr in frames if fr["timestep"] not in data]
+        if missing:
+            raise SystemExit(f"no reference for timesteps {missing[:5]}")
+        references = [data[fr["timestep"]] for fr in frames]
+
+    samples = []
+    rmin, rhomax = cutoff, 0.0
+    for fr, (energy, forces) in zip(frames, references):
+        i, j, _, d = neighbor_pairs(fr["pos"], fr["cell"], cutoff)
+        el = el_of_type[fr["types"]]
+        samples.append((el, i, j, d, energy, forces))
+        r = d.norm(dim=1)
+        rmin = min(rmin, float(r.min()))
+        rho = torch.zeros(len(el), dtype=torch.float64).index_add_(0, i, (1.0 - r / cutoff) ** args.density_power)
+        rhomax = max(rhomax, float(rho.max()))
+
+    basis = EAMBasis(len(elements), cutoff, rmin, rhomax, args.pair_knots, args.embed_knots, args.density_power)
+    nval = int(round(args.validation * len(samples))) if len(samples) > 1 else 0
+    train, val = samples[: len(samples) - nval], samples[len(samples) - nval :]
+    coef = fit(basis, train, args.energy_weight, args.force_weight, args.smooth)
+
+    for name, part in (("train", train), ("validation", val)):
+        if not part:
+            continue
+        de, df, nf = 0.0, 0.0, 0
+        for el, i, j, d, energy, forces in part:
+            e, f = predict(basis, coef, el, i, j, d)
+            de += ((e - energy) / len(el)) ** 2
+            df += float(((f - forces) ** 2).sum())
+            nf += forces.numel()
+        print(
+            f"{name}: {len(part)} frames, energy RMSE {math.sqrt(de / len(part)):.4g} /atom, "
+            f"force RMSE {math.sqrt(df / nf):.4g}"
+        )
+
+    write_setfl(
+        args.output, elements, basis, coef, args.nrho, args.nr, args.wall,
+        comment=f"fitted to {len(train)} frames, r in [{rmin:.4g}, {cutoff:.4g}], rho up to {rhomax:.4g}",
+    )
+    print(f"wrote {args.output}: pair_coeff * * {args.output} {' '.join(args.elements)}")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,166 @@
+"""Export a deployed PHIN model to a memory-mappable weight file (.phinw).
+
+    python tools/phin_export.py deployed.pth model.phinw [--meta key=value ...]
+
+Every parameter and buffer of the TorchScript module is written at a
+page-aligned offset, together with the model metadata, in the layout
+documented in phin_weights.h. The module itself, stripped of its tensors,
+is stored as the uint8 tensor "__torchscript__".
+
+`pair_style phin` loads such a file by mapping it and using the tensors
+in place.
+"""
+import argparse
+import io
+import struct
+
+import torch
+
+MAGIC = b"PHINWTS1"
+ALIGN = 4096
+
+# metadata stored by deployment (see pair_phin.cpp)
+METADATA_KEYS = [
+    "config",
+    "phin_version",
+    "r_max",
+    "n_species",
+    "type_names",
+    "_jit_bailout_depth",
+    "_jit_fusion_strategy",
+    "allow_tf32",
+    "per_edge_type_cutoff",
+    "max_neighbors",
+    "per_atom_outputs",
+    "state_outputs",
+    "long_range_cutoff",
+    "num_layers",
+    "avg_num_neighbors",
+    "polynomial_cutoff_p",
+]
+
+TORCHSCRIPT_ENTRY = "__torchscript__"
+
+DTYPES = {
+    torch.float32: "float32",
+    torch.float64: "float64",
+    torch.float16: "float16",
+    torch.bfloat16: "bfloat16",
+    torch.int64: "int64",
+    torch.int32: "int32",
+    torch.int8: "int8",
+    torch.uint8: "uint8",
+    torch.bool: "bool",
+}
+
+
+def escape(value: str) -> str:
+    return value.replace("\\", "\\\\").replace("\n", "\\n")
+
+
+def write_phinw(path, tensors, metadata):
+    """Write named tensors and string metadata in the .phinw layout."""
+    blobs = []
+    for name, t in tensors.items():
+        if " " in name:
+            raise ValueError(f"tensor name {name!r} contains a space")
+        if t.dtype not in DTYPES:
+            raise ValueError(f"tensor {name} has unsupported dtype {t.dtype}")
+        t = t.detach().cpu().contiguous()
+        blobs.append((name, t, t.view(-1).view(torch.uint8).numpy().tobytes() if t.numel() else b""))
+
+    def header(data_start):
+        lines = [f"meta {k} {escape(str(v))}" for k, v in metadata.items() if v != ""]
+        offset = data_start
+        for name, t, raw in blobs:
+            dims = " ".join(str(d) for d in t.shape)
+            lines.append(f"tensor {name} {DTYPES[t.dtype]} {offset} {len(raw)} {t.dim()} {dims}".rstrip())
+            offset += -(-max(len(raw), 1) // ALIGN) * ALIGN
+        return ("\n".join(lines) + "\n").encode()
+
+    # the header length depends on the offsets, which depend on where the data starts
+    data_start = ALIGN
+    while 16 + len(header(data_start)) > data_start:
+        data_start += ALIGN
+    head = header(data_start)
+
+    with open(path, "wb") as f:
+        f.write(MAGIC + struct.pack("<Q", len(head)) + head)
+        offset = data_start
+        for _, _, raw in blobs:
+            f.seek(offset)
+            f.write(raw)
+            offset += -(-max(len(raw), 1) // ALIGN) * ALIGN
+        f.truncate(offset)
+
+
+def strip_tensors(model, names, extra_files):
+    """Serialized copy of a TorchScript module with the named tensors emptied."""
+    buf = io.BytesIO()
+    torch.jit.save(model, buf)
+    buf.seek(0)
+    skeleton = torch.jit.load(buf, map_location="cpu")
+    for name, t in names.items():
+        *path, attr = name.split(".")
+        module = skeleton
+        for part in path:
+            module = getattr(module, part)
+        setattr(module, attr, torch.empty(0, dtype=t.dtype))
+    out = io.BytesIO()
+    torch.jit.save(skeleton, out, _extra_files=extra_files)
+    return torch.frombuffer(bytearray(out.getvalue()), dtype=torch.uint8)
+
+
+def read_phinw(path):
+    """Read a .phinw file back into (tensors, metadata); for tests and inspection."""
+    with open(path, "rb") as f:
+        data = f.read()
+    if data[:8] != MAGIC:
+        raise ValueError(f"{path} is not a PHIN weight file")
+    (size,) = struct.unpack("<Q", data[8:16])
+    tensors, metadata = {}, {}
+    inv_dtypes = {v: k for k, v in DTYPES.items()}
+    for line in data[16 : 16 + size].decode().splitlines():
+        kind, rest = line.split(" ", 1)
+        if kind == "meta":
+            key, _, value = rest.partition(" ")
+            metadata[key] = value.replace("\\n", "\n").replace("\\\\", "\\")
+        elif kind == "tensor":
+            name, dtype, offset, nbytes, ndim, *dims = rest.split()
+            offset, nbytes = int(offset), int(nbytes)
+            raw = bytearray(data[offset : offset + nbytes])
+            t = torch.frombuffer(raw, dtype=inv_dtypes[dtype]) if nbytes else torch.empty(0, dtype=inv_dtypes[dtype])
+            tensors[name] = t.reshape([int(d) for d in dims[: int(ndim)]])
+    return tensors, metadata
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("model", help="deployed TorchScript model")
+    parser.add_argument("output", help="weight file to write")
+    parser.add_argument(
+        "--meta", action="append", default=[], metavar="KEY=VALUE",
+        help="add or override a metadata entry",
+    )
+    args = parser.parse_args()
+
+    extra_files = {k: "" for k in METADATA_KEYS}
+    model = torch.jit.load(args.model, map_location="cpu", _extra_files=extra_files)
+    metadata = {k: v.decode() if isinstance(v, bytes) else v for k, v in extra_files.items()}
+    for item in args.meta:
+        key, _, value = item.partition("=")
+        metadata[key] = value
+
+    tensors = dict(model.named_parameters())
+    tensors.update(dict(model.named_buffers()))
+    if not tensors:
+        raise SystemExit(f"{args.model} has no parameters; was it frozen before saving?")
+    tensors[TORCHSCRIPT_ENTRY] = strip_tensors(
+        model, tensors, {k: v for k, v in metadata.items() if v != ""}
+    )
+    write_phinw(args.output, tensors, metadata)
+    print(f"wrote {len(tensors) - 1} tensors and {len(metadata)} metadata entries to {args.output}")
+
+
+if __name__ == "__main__":
+    main()